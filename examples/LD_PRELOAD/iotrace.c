@@ -0,0 +1,218 @@
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "iotrace.h"
+
+/*
+ * Wraps I/O calls, their latency and byte counts go to the shared memory
+ * segment /iotrace.PID (or $IOTRACE_NAME), see iotrace.h and iotrace_read.
+ * Children of fork() share the segment of their parent, processes started
+ * with the same $IOTRACE_NAME share that segment.
+ */
+
+static struct iotrace_shm *shm;
+
+static ssize_t (*real_read)(int, void *, size_t);
+static ssize_t (*real_write)(int, const void *, size_t);
+static size_t (*real_fread)(void *, size_t, size_t, FILE *);
+static size_t (*real_fwrite)(const void *, size_t, size_t, FILE *);
+static int (*real_epoll_wait)(int, struct epoll_event *, int, int);
+static int (*real_accept)(int, struct sockaddr *, socklen_t *);
+static FILE *(*real_tmpfile)(void);
+
+static void *next(void *real, const char *name)
+{
+	return real ? real : dlsym(RTLD_NEXT, name);
+}
+
+static uint64_t now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void add(uint64_t *counter, uint64_t value)
+{
+	__atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+static void record(int call, int fd, uint64_t start, int64_t result,
+		   uint64_t bytes, int failed)
+{
+	uint64_t ns = now() - start;
+	if (shm == NULL)
+		return;
+
+	struct iotrace_stat *stat = &shm->stat[call];
+	add(&stat->calls, 1);
+	add(&stat->errors, failed);
+	add(&stat->bytes, bytes);
+	add(&stat->total_ns, ns);
+	uint64_t max = __atomic_load_n(&stat->max_ns, __ATOMIC_RELAXED);
+	while (ns > max && !__atomic_compare_exchange_n(&stat->max_ns, &max, ns,
+				1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+	add(&stat->hist[bucket < IOTRACE_BUCKETS ? bucket : IOTRACE_BUCKETS - 1], 1);
+
+	uint64_t pos = __atomic_fetch_add(&shm->head, 1, __ATOMIC_RELAXED);
+	struct iotrace_event *event = &shm->ring[pos & (IOTRACE_RING - 1)];
+	__atomic_store_n(&event->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	event->start_ns = start - shm->start_ns;
+	event->ns = ns;
+	event->result = result;
+	event->call = call;
+	event->fd = fd;
+	__atomic_store_n(&event->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/* Maps a segment another process has created, waits for its header */
+static struct iotrace_shm *attach(const char *name)
+{
+	int fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0)
+		return NULL;
+	/* the creator may not have sized it yet, growing is harmless */
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (st.st_size < (off_t)sizeof(struct iotrace_shm) &&
+				    ftruncate(fd, sizeof(struct iotrace_shm)) != 0)) {
+		close(fd);
+		return NULL;
+	}
+	struct iotrace_shm *mem = mmap(NULL, sizeof(struct iotrace_shm),
+			PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED)
+		return NULL;
+
+	for (int i = 0; i < 100; i++) {
+		if (memcmp(mem->magic, IOTRACE_MAGIC, sizeof(mem->magic)) == 0) {
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (mem->calls == IOTRACE_CALLS)
+				return mem;
+			break;
+		}
+		usleep(1000);
+	}
+	munmap(mem, sizeof(struct iotrace_shm));
+	return NULL;
+}
+
+/*
+ * Only the process that creates the segment sizes and initializes it: other
+ * processes started with the same $IOTRACE_NAME (exec'd children, a second
+ * traced program) add to the same counters and ring instead of wiping them.
+ */
+__attribute__((constructor))
+static void iotrace_init(void)
+{
+	char name[64];
+	const char *env = getenv("IOTRACE_NAME");
+	if (env != NULL)
+		snprintf(name, sizeof(name), "%s", env);
+	else
+		snprintf(name, sizeof(name), "/iotrace.%d", (int)getpid());
+
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		if (errno == EEXIST)
+			shm = attach(name);
+		return;
+	}
+	if (ftruncate(fd, sizeof(struct iotrace_shm)) != 0) {
+		close(fd);
+		return;
+	}
+	struct iotrace_shm *mem = mmap(NULL, sizeof(struct iotrace_shm),
+			PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED)
+		return;
+
+	mem->pid = getpid();
+	mem->calls = IOTRACE_CALLS;
+	mem->start_ns = now();
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(mem->magic, IOTRACE_MAGIC, sizeof(mem->magic));
+	shm = mem;
+}
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+	real_read = next(real_read, "read");
+	uint64_t start = now();
+	ssize_t result = real_read(fd, buf, count);
+	record(IOTRACE_READ, fd, start, result, result > 0 ? result : 0, result < 0);
+	return result;
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+	real_write = next(real_write, "write");
+	uint64_t start = now();
+	ssize_t result = real_write(fd, buf, count);
+	record(IOTRACE_WRITE, fd, start, result, result > 0 ? result : 0, result < 0);
+	return result;
+}
+
+size_t fread(void *ptr, size_t size, size_t nmemb, FILE *stream)
+{
+	real_fread = next(real_fread, "fread");
+	uint64_t start = now();
+	size_t result = real_fread(ptr, size, nmemb, stream);
+	record(IOTRACE_FREAD, fileno(stream), start, result, result * size,
+	       result < nmemb && ferror(stream));
+	return result;
+}
+
+size_t fwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream)
+{
+	real_fwrite = next(real_fwrite, "fwrite");
+	uint64_t start = now();
+	size_t result = real_fwrite(ptr, size, nmemb, stream);
+	record(IOTRACE_FWRITE, fileno(stream), start, result, result * size,
+	       result < nmemb);
+	return result;
+}
+
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout)
+{
+	real_epoll_wait = next(real_epoll_wait, "epoll_wait");
+	uint64_t start = now();
+	int result = real_epoll_wait(epfd, events, maxevents, timeout);
+	record(IOTRACE_EPOLL_WAIT, epfd, start, result, result > 0 ? result : 0,
+	       result < 0);
+	return result;
+}
+
+int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen)
+{
+	real_accept = next(real_accept, "accept");
+	uint64_t start = now();
+	int result = real_accept(sockfd, addr, addrlen);
+	record(IOTRACE_ACCEPT, sockfd, start, result, 0, result < 0);
+	return result;
+}
+
+FILE *tmpfile(void)
+{
+	real_tmpfile = next(real_tmpfile, "tmpfile");
+	uint64_t start = now();
+	FILE *result = real_tmpfile();
+	record(IOTRACE_TMPFILE, result ? fileno(result) : -1, start,
+	       result ? fileno(result) : -1, 0, result == NULL);
+	return result;
+}
@@ -0,0 +1,61 @@
+#ifndef IOTRACE_H
+#define IOTRACE_H
+
+#include <stdint.h>
+
+/*
+ * Shared memory layout of iotrace.so, read by iotrace_read.
+ *
+ * Every wrapped call adds to the counters of its kind and puts an event into
+ * the ring. Writers only use atomic adds, an event is valid once its seq is
+ * set to its position + 1.
+ */
+
+#define IOTRACE_MAGIC "IOTRACE1"
+#define IOTRACE_BUCKETS 40 /* latency histogram, bucket i: [2^i, 2^(i+1)) ns */
+#define IOTRACE_RING 4096  /* events, a power of two */
+
+enum iotrace_call {
+	IOTRACE_READ,
+	IOTRACE_WRITE,
+	IOTRACE_FREAD,
+	IOTRACE_FWRITE,
+	IOTRACE_EPOLL_WAIT,
+	IOTRACE_ACCEPT,
+	IOTRACE_TMPFILE,
+	IOTRACE_CALLS
+};
+
+struct iotrace_stat {
+	uint64_t calls;
+	uint64_t errors;
+	uint64_t bytes;    /* transferred, or events for epoll_wait */
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t hist[IOTRACE_BUCKETS];
+};
+
+struct iotrace_event {
+	uint64_t seq;
+	uint64_t start_ns; /* since iotrace_shm.start_ns */
+	uint64_t ns;
+	int64_t result;
+	int32_t call;
+	int32_t fd;        /* -1 for stdio calls without a stream fd */
+};
+
+struct iotrace_shm {
+	char magic[8];
+	int32_t pid;
+	int32_t calls;     /* IOTRACE_CALLS of the writer */
+	uint64_t start_ns; /* CLOCK_MONOTONIC */
+	struct iotrace_stat stat[IOTRACE_CALLS];
+	uint64_t head;     /* events ever written */
+	struct iotrace_event ring[IOTRACE_RING];
+};
+
+static const char *const iotrace_names[IOTRACE_CALLS] = {
+	"read", "write", "fread", "fwrite", "epoll_wait", "accept", "tmpfile"
+};
+
+#endif /* IOTRACE_H */
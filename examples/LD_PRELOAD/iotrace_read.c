@@ -0,0 +1,141 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "iotrace.h"
+
+/*
+ * Prints what iotrace.so collected:
+ *
+ *   iotrace_read [-e EVENTS] [-i SECONDS] PID|NAME
+ *
+ * -e also prints the last EVENTS calls, -i repeats every SECONDS until
+ * interrupted. The segment is left in place, remove it with
+ * rm /dev/shm/iotrace.PID
+ */
+
+static void usage(void)
+{
+	fprintf(stderr, "usage: iotrace_read [-e EVENTS] [-i SECONDS] PID|NAME\n");
+	exit(2);
+}
+
+/*
+ * upper bound of the bucket where the share p of the calls is reached, but
+ * no more than the slowest call
+ */
+static uint64_t percentile(const struct iotrace_stat *stat, double p)
+{
+	uint64_t seen = 0;
+	for (int i = 0; i < IOTRACE_BUCKETS; i++) {
+		seen += stat->hist[i];
+		if (seen >= p * stat->calls)
+			return (2ull << i) < stat->max_ns ? 2ull << i : stat->max_ns;
+	}
+	return stat->max_ns;
+}
+
+static void print_stats(const struct iotrace_shm *shm)
+{
+	printf("%-10s %10s %8s %14s %10s %10s %10s %12s\n", "call", "calls",
+	       "errors", "bytes", "avg_ns", "p50_ns", "p99_ns", "max_ns");
+	for (int i = 0; i < IOTRACE_CALLS; i++) {
+		const struct iotrace_stat *stat = &shm->stat[i];
+		if (stat->calls == 0)
+			continue;
+		printf("%-10s %10llu %8llu %14llu %10llu %10llu %10llu %12llu\n",
+		       iotrace_names[i],
+		       (unsigned long long)stat->calls,
+		       (unsigned long long)stat->errors,
+		       (unsigned long long)stat->bytes,
+		       (unsigned long long)(stat->total_ns / stat->calls),
+		       (unsigned long long)percentile(stat, 0.5),
+		       (unsigned long long)percentile(stat, 0.99),
+		       (unsigned long long)stat->max_ns);
+	}
+}
+
+static void print_events(const struct iotrace_shm *shm, uint64_t count)
+{
+	uint64_t head = __atomic_load_n(&shm->head, __ATOMIC_ACQUIRE);
+	if (count > IOTRACE_RING)
+		count = IOTRACE_RING;
+	if (count > head)
+		count = head;
+
+	printf("\n%12s %-10s %6s %12s %10s\n", "start_us", "call", "fd",
+	       "result", "ns");
+	for (uint64_t pos = head - count; pos < head; pos++) {
+		const struct iotrace_event *slot = &shm->ring[pos & (IOTRACE_RING - 1)];
+		struct iotrace_event event = *slot;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		/* overwritten or still being written */
+		if (event.seq != pos + 1 ||
+		    __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != pos + 1)
+			continue;
+		if (event.call < 0 || event.call >= IOTRACE_CALLS)
+			continue;
+		printf("%12llu %-10s %6d %12lld %10llu\n",
+		       (unsigned long long)(event.start_ns / 1000),
+		       iotrace_names[event.call], event.fd,
+		       (long long)event.result, (unsigned long long)event.ns);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t events = 0;
+	int interval = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "e:i:")) != -1) {
+		if (opt == 'e')
+			events = strtoull(optarg, NULL, 10);
+		else if (opt == 'i')
+			interval = atoi(optarg);
+		else
+			usage();
+	}
+	if (optind + 1 != argc)
+		usage();
+
+	char name[64];
+	const char *arg = argv[optind];
+	if (arg[0] >= '0' && arg[0] <= '9')
+		snprintf(name, sizeof(name), "/iotrace.%s", arg);
+	else
+		snprintf(name, sizeof(name), "%s", arg);
+
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		perror(name);
+		return 1;
+	}
+	struct iotrace_shm *shm = mmap(NULL, sizeof(struct iotrace_shm),
+			PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	if (memcmp(shm->magic, IOTRACE_MAGIC, sizeof(shm->magic)) != 0 ||
+	    shm->calls != IOTRACE_CALLS) {
+		fprintf(stderr, "%s: not an iotrace segment\n", name);
+		return 1;
+	}
+
+	for (;;) {
+		printf("pid %d\n", shm->pid);
+		print_stats(shm);
+		if (events)
+			print_events(shm, events);
+		if (interval <= 0)
+			break;
+		fflush(stdout);
+		sleep(interval);
+		printf("\n");
+	}
+	return 0;
+}
@@ -1,25 +1,40 @@
 #include "allocator.h"
 #include "allocator_error.h"
 #include "allocator_pointer.h"
+#include "allocator_trace.h"
 #include <algorithm>
 #include <cassert>
+#include <cstdint>
 #include <cstring>
 #include <iostream>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
 
 void AllocatorNode::setUsage(bool flag) {
-  head = flag ? head | flg_mask : head & ~flg_mask;
+  head = flag ? head | flg_mask : head & len_mask;
 }
 
 void AllocatorNode::setLength(size_t length) {
-  if (length & flg_mask) {
+  if (length & ~len_mask) {
     throw AllocError(AllocErrorType::Internal, "length overlaps flag");
   }
-  head = (head & flg_mask) | length;
+  head = (head & ~len_mask) | length;
+}
+
+void AllocatorNode::setAlignment(size_t log2) {
+  head = (head & ~align_mask) | (log2 << align_shift);
 }
 
 bool AllocatorNode::usage() { return !!(head & flg_mask); }
 
-size_t AllocatorNode::length() { return head & ~flg_mask; }
+size_t AllocatorNode::length() { return head & len_mask; }
+
+size_t AllocatorNode::alignment() { return (head & align_mask) >> align_shift; }
 
 AllocatorNode *AllocatorNode::next(int step) {
   assert(step > 0);
@@ -27,16 +42,196 @@ AllocatorNode *AllocatorNode::next(int step) {
     return this->next(1)->next(step - 1);
   }
 
-  return (AllocatorNode *)(&head + head + 1);
+  return (AllocatorNode *)(&head + length() + 1);
+}
+
+AllocatorNode *AllocatorNode::nextFree() { return ((AllocatorNode **)(this + 1))[0]; }
+
+AllocatorNode *AllocatorNode::prevFree() { return ((AllocatorNode **)(this + 1))[1]; }
+
+void AllocatorNode::setNextFree(AllocatorNode *node) {
+  ((AllocatorNode **)(this + 1))[0] = node;
 }
 
+void AllocatorNode::setPrevFree(AllocatorNode *node) {
+  ((AllocatorNode **)(this + 1))[1] = node;
+}
+
+AllocatorSlot *AllocatorNode::owner() { return ((AllocatorSlot **)(this + 1))[0]; }
+
+void AllocatorNode::setOwner(AllocatorSlot *slot) {
+  ((AllocatorSlot **)(this + 1))[0] = slot;
+}
+
+void *AllocatorNode::data() { return &head + 2; }
+
 /////////////////////////////////////////////////////////////////////////////////
 
-Allocator::Allocator(void *base, size_t size)
-    : base(base), first_node((AllocatorNode *)base), last_node(first_node),
+bool AllocatorSlot::vacant() const { return (size_t)node & vacant_tag; }
+
+AllocatorSlot *AllocatorSlot::nextVacant() const {
+  return (AllocatorSlot *)((size_t)node & ~vacant_tag);
+}
+
+AllocatorSlot *AllocatorSlot::prevVacant() const { return (AllocatorSlot *)pins; }
+
+void AllocatorSlot::setNextVacant(AllocatorSlot *slot) {
+  node = (AllocatorNode *)((size_t)slot | vacant_tag);
+}
+
+void AllocatorSlot::setPrevVacant(AllocatorSlot *slot) { pins = (size_t)slot; }
+
+AllocatorNode *AllocatorSlot::pin() {
+  for (;;) {
+    size_t state = __atomic_load_n(&pins, __ATOMIC_RELAXED);
+    if (state & moving) { // wait for a single node move to finish
+      std::this_thread::yield();
+      continue;
+    }
+    if (__atomic_compare_exchange_n(&pins, &state, state + 1, true,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      return node;
+    }
+  }
+}
+
+void AllocatorSlot::unpin() { __atomic_fetch_sub(&pins, 1, __ATOMIC_RELEASE); }
+
+bool AllocatorSlot::pinned() const {
+  return __atomic_load_n(&pins, __ATOMIC_ACQUIRE) != 0;
+}
+
+bool AllocatorSlot::lockMove() {
+  size_t state = 0;
+  return __atomic_compare_exchange_n(&pins, &state, moving, false,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+void AllocatorSlot::unlockMove() { __atomic_store_n(&pins, 0, __ATOMIC_RELEASE); }
+
+
+/////////////////////////////////////////////////////////////////////////////////
+
+// Visits the fields in declaration order
+template <class F> static void visit(const AllocatorStats &s, F &f) {
+  f("heap_bytes", s.heap_bytes);
+  f("live_bytes", s.live_bytes);
+  f("live_blocks", s.live_blocks);
+  f("free_bytes", s.free_bytes);
+  f("free_blocks", s.free_blocks);
+  f("largest_free", s.largest_free);
+  f("wilderness", s.wilderness);
+  f("fragmentation", s.fragmentation);
+  f("slots", s.slots);
+  f("used_slots", s.used_slots);
+  f("committed_bytes", s.committed_bytes);
+  f("small_objects", s.small_objects);
+  f("slabs", s.slabs);
+  f("allocs", s.allocs);
+  f("failed_allocs", s.failed_allocs);
+  f("frees", s.frees);
+  f("reallocs", s.reallocs);
+  f("realloc_in_place", s.realloc_in_place);
+  f("realloc_slides", s.realloc_slides);
+  f("realloc_moves", s.realloc_moves);
+  f("defrags", s.defrags);
+  f("defrag_steps", s.defrag_steps);
+  f("defrag_moves", s.defrag_moves);
+  f("defrag_bytes", s.defrag_bytes);
+}
+
+namespace {
+struct TextWriter {
+  std::ostringstream out;
+  template <class T> void operator()(const char *name, T value) {
+    out << name << ' ' << value << '\n';
+  }
+};
+
+struct JsonWriter {
+  std::ostringstream out;
+  const char *sep = "{";
+  template <class T> void operator()(const char *name, T value) {
+    out << sep << '"' << name << "\": " << value;
+    sep = ", ";
+  }
+};
+} // namespace
+
+std::string AllocatorStats::text() const {
+  TextWriter writer;
+  visit(*this, writer);
+  return writer.out.str();
+}
+
+std::string AllocatorStats::json() const {
+  JsonWriter writer;
+  visit(*this, writer);
+  writer.out << '}';
+  return writer.out.str();
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+
+static size_t msb(size_t x) { return sizeof(size_t) * 8 - 1 - __builtin_clzl(x); }
+
+static size_t lsb(size_t x) { return __builtin_ctzl(x); }
+
+/**
+ * Slab header, a tag and a pin count per object and the objects follow it. The slab is the
+ * data of a raw node aligned to slab_bytes. Its slot refers to the node and
+ * is never moved, handles of the objects refer to the slot
+ */
+struct Allocator::Slab {
+  Slab *next; // in the list of slabs with vacant objects
+  Slab *prev;
+  AllocatorSlot *slot;
+  uint32_t size;     // object bytes
+  uint32_t capacity; // objects
+  uint32_t used;
+  uint32_t hint; // bitmap word a vacant object was last found in
+  uint64_t bitmap[slab_bytes / slab_step / 64]; // set bits are taken
+
+  // bumped when the object is freed, handles keep a copy
+  uint8_t *tags() { return (uint8_t *)(this + 1); }
+  // Allocator::pin of the object, released without the lock
+  uint8_t *pins() { return tags() + capacity; }
+  char *objects() {
+    return (char *)this + ((sizeof(Slab) + 2 * capacity + 15) & ~size_t(15));
+  }
+};
+
+// Small object handle generation: the object index and tag over the low bits
+// of the slab slot generation
+static constexpr size_t small_index_shift = 48;
+static constexpr size_t small_tag_shift = 40;
+static constexpr size_t small_generation_mask = (size_t(1) << small_tag_shift) - 1;
+
+constexpr size_t Allocator::min_length;
+
+Allocator::Allocator(void *base, size_t size, const AllocatorOptions &options)
+    : Allocator(base, size, options, true) {}
+
+// format is false when the area already holds a heap (see load())
+Allocator::Allocator(void *base, size_t size, const AllocatorOptions &options,
+                     bool format)
+    : base(base), reserved(0), heap_commit(nullptr), table_commit(nullptr),
+      file(nullptr),
+      first_node((AllocatorNode *)base), last_node(first_node),
       ptr_first(
-          (AllocatorNode **)((char *)base + size - size % sizeof(size_t))),
-      ptr_last(ptr_first) {
+          (AllocatorSlot *)((char *)base + size - size % sizeof(AllocatorSlot))),
+      ptr_last(ptr_first), vacant_ptrs(nullptr), free_ptrs(0),
+      tag_words(options.layout == AllocatorLayout::BoundaryTags ? 1 : 0),
+      placement(options.placement),
+      large_length(options.large_threshold ? words(options.large_threshold)
+                                           : 0),
+      defrag_on_failure(options.defrag_on_failure), rover(first_node),
+      trace(options.trace), root_id(~size_t(0)), generations(0),
+      align_log2(0),
+      small_slabs(options.small_slabs), slabs(), small_objects(0),
+      slab_count(0),
+      defrag_cursor(first_node), defrag_deferred(nullptr), free_words(0),
+      free_nodes(0), used_nodes(0), counters() {
   assert(sizeof(AllocatorNode) == sizeof(size_t));
   assert(sizeof(AllocatorNode *) == sizeof(size_t));
   assert(sizeof(size_t) == 8);
@@ -48,18 +243,385 @@ Allocator::Allocator(void *base, size_t size)
                      "too small size of base memory chunk");
   }
 
+  if (!format) {
+    return;
+  }
   first_node->setUsage(false);
-  first_node->setLength(size / sizeof(size_t));
+  first_node->setLength((size_t *)ptr_first - &first_node->head - 1);
+  tag(first_node);
+  reset_lists();
+  if (trace) {
+    trace->record(TraceOp::Init, (size_t)options.layout, size);
+  }
 }
 
-Pointer Allocator::alloc(size_t N) {
+Allocator::Allocator(size_t size, const AllocatorOptions &options)
+    : Allocator(reserve(size), size, options) {
+  reserved = size;
+  heap_commit = std::min((char *)base + commit_step, (char *)ptr_first);
+  table_commit = std::max((char *)base + reserved - commit_step, heap_commit);
+}
+
+// Both ends are committed up front: the first node header at the bottom,
+// the table (and the wilderness footer) at the top
+void *Allocator::reserve(size_t size) {
+  if (size % commit_step) {
+    throw AllocError(AllocErrorType::Internal,
+                     "reserve size must be a multiple of commit_step");
+  }
+  void *base = mmap(nullptr, size, PROT_NONE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED) {
+    throw AllocError(AllocErrorType::NoMemory, "mmap failed");
+  }
+  size_t top = std::max(size, 2 * commit_step) - commit_step;
+  if (mprotect(base, std::min(size, commit_step), PROT_READ | PROT_WRITE) ||
+      mprotect((char *)base + top, size - top, PROT_READ | PROT_WRITE)) {
+    munmap(base, size);
+    throw AllocError(AllocErrorType::NoMemory, "commit failed");
+  }
+  return base;
+}
+
+// Grows the bottom committed pages up to end, a no-op for a caller buffer
+void Allocator::commit_heap(void *end) {
+  if ((char *)end <= heap_commit || heap_commit >= table_commit) {
+    return;
+  }
+  size_t step = ((char *)end - heap_commit + commit_step - 1) / commit_step;
+  char *commit = std::min(heap_commit + step * commit_step, table_commit);
+  if (mprotect(heap_commit, commit - heap_commit, PROT_READ | PROT_WRITE)) {
+    throw AllocError(AllocErrorType::NoMemory, "commit failed");
+  }
+  heap_commit = commit;
+}
+
+// Grows the top committed pages down to start, a no-op for a caller buffer
+void Allocator::commit_table(void *start) {
+  if ((char *)start >= table_commit || heap_commit >= table_commit) {
+    return;
+  }
+  size_t step = (table_commit - (char *)start + commit_step - 1) / commit_step;
+  char *commit = std::max(table_commit - step * commit_step, heap_commit);
+  if (mprotect(commit, table_commit - commit, PROT_READ | PROT_WRITE)) {
+    throw AllocError(AllocErrorType::NoMemory, "commit failed");
+  }
+  table_commit = commit;
+}
+
+// Gives the pages inside the wilderness back to the system. Its header and
+// footer words stay committed
+void Allocator::trim() {
+  if (!reserved || last_node->usage()) {
+    return;
+  }
+  size_t page = commit_step;
+  size_t from = ((size_t)(&last_node->head + 1) + page - 1) & ~(page - 1);
+  size_t to = (size_t)((size_t *)ptr_first - 1) & ~(page - 1);
+  if (from >= to ||
+      (heap_commit <= (char *)from && table_commit >= (char *)to)) {
+    return;
+  }
+  madvise((void *)from, to - from, MADV_DONTNEED);
+  mprotect((void *)from, to - from, PROT_NONE);
+  heap_commit = std::min(heap_commit, (char *)from);
+  table_commit = std::max(table_commit, (char *)to);
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+
+static const char file_magic[8] = {'A', 'L', 'L', 'O', 'C', 'F', '3', 0};
+
+/**
+ * Head of an allocator file, the heap follows it. Fields past clean are a
+ * copy of the Allocator state as of the last save(), pointers included:
+ * base tells how much they are off if the file is mapped elsewhere.
+ */
+struct Allocator::File {
+  char magic[8];
+  size_t size;  // of the file
+  size_t clean; // 0 once changed after the last save(), see mark_dirty()
+  size_t tag_words;
+  size_t align_log2; // a new mapping keeps nodes aligned to that
+
+  char *base;
+  AllocatorNode *last_node;
+  AllocatorSlot *ptr_first;
+  AllocatorSlot *vacant_ptrs;
+  size_t free_ptrs;
+  AllocatorNode *rover;
+  AllocatorNode *defrag_cursor;
+  AllocatorNode *defrag_deferred;
+  size_t free_words;
+  size_t free_nodes;
+  size_t used_nodes;
+  size_t root_id;
+  size_t generations;
+  AllocatorStats counters;
+  size_t fl_bitmap;
+  size_t sl_bitmap[fl_count];
+  AllocatorNode *free_lists[fl_count][sl_count];
+
+  static constexpr size_t page = 4096;
+
+  // Heap starts at the first page boundary after the header
+  static size_t header() { return (sizeof(File) + page - 1) & ~(page - 1); }
+};
+
+Allocator::Allocator(const std::string &path, size_t size,
+                     const AllocatorOptions &options)
+    : Allocator(open_file(path, size, options), options) {}
+
+Allocator::~Allocator() {
+  if (reserved) {
+    munmap(base, reserved);
+  }
+  if (file) {
+    save();
+    munmap(file, file->size);
+  }
+}
+
+// The mapping is ours until the constructor is done: the destructor doesn't
+// run if the delegated constructor throws, and this->file is set last
+Allocator::Allocator(File *file, const AllocatorOptions &options) try
+    : Allocator((char *)file + File::header(), file->size - File::header(),
+                options, file->base == nullptr) {
+  if (file->base == nullptr) {
+    memcpy(file->magic, file_magic, sizeof(file_magic));
+    file->tag_words = tag_words;
+  } else {
+    load(file);
+  }
+  this->file = file;
+  file->clean = 0;
+} catch (...) {
+  munmap(file, file->size);
+}
+
+// Maps the file at hint if possible, otherwise at an address off hint by a
+// multiple of alignment: a larger range is reserved and the file is mapped
+// into it at the right offset
+static void *map_file(int fd, size_t size, void *hint, size_t alignment) {
+  void *addr = mmap(hint, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED || hint == nullptr ||
+      ((char *)addr - (char *)hint) % alignment == 0) {
+    return addr;
+  }
+  munmap(addr, size);
+
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t mapped = (size + page - 1) & ~(page - 1);
+  char *room = (char *)mmap(nullptr, mapped + alignment, PROT_NONE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (room == MAP_FAILED) {
+    return MAP_FAILED;
+  }
+  size_t shift = ((size_t)hint - (size_t)room) % alignment;
+  addr = mmap(room + shift, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+              fd, 0);
+  if (addr == MAP_FAILED) {
+    munmap(room, mapped + alignment);
+    return MAP_FAILED;
+  }
+  if (shift) {
+    munmap(room, shift);
+  }
+  munmap(room + shift + mapped, alignment - shift);
+  return addr;
+}
+
+Allocator::File *Allocator::open_file(const std::string &path, size_t size,
+                                      const AllocatorOptions &options) {
+  if (options.small_slabs) { // slab lists are not saved
+    throw AllocError(AllocErrorType::InvalidOperation,
+                     "small_slabs can't be used with a file");
+  }
+  int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    throw AllocError(AllocErrorType::Internal, "can't open " + path);
+  }
+
+  File head = {};
+  struct stat st;
+  std::string error;
+  AllocErrorType type = AllocErrorType::Internal;
+  if (fstat(fd, &st) != 0) {
+    error = "can't stat " + path;
+  } else if (st.st_size != 0) {
+    type = AllocErrorType::BadFile;
+    if (pread(fd, &head, sizeof(head), 0) != sizeof(head) ||
+        memcmp(head.magic, file_magic, sizeof(file_magic)) != 0 ||
+        head.size != (size_t)st.st_size) {
+      error = path + " is not an allocator file";
+    } else if (!head.clean) {
+      error = path + " was changed after its last save";
+    } else if (head.tag_words !=
+               (options.layout == AllocatorLayout::BoundaryTags ? 1 : 0)) {
+      error = path + " has another layout";
+    } else {
+      size = head.size;
+    }
+    if (!error.empty() && options.reset_bad_file) { // formatted anew below
+      head = File();
+      size = size ? size : st.st_size;
+      st.st_size = 0;
+      error.clear();
+      type = AllocErrorType::Internal;
+      if (ftruncate(fd, 0) != 0) {
+        error = "can't reset " + path;
+      }
+    }
+  }
+  if (error.empty() && st.st_size == 0) {
+    if (size < File::header() + File::page) {
+      error = "too small size of " + path;
+    } else if (ftruncate(fd, size) != 0) {
+      error = "can't resize " + path;
+    }
+  }
+  if (!error.empty()) {
+    close(fd);
+    throw AllocError(type, error);
+  }
+
+  // The previous address is only a hint, an occupied one gets us elsewhere
+  void *hint = head.base ? head.base - File::header() : nullptr;
+  void *addr = map_file(fd, size, hint, size_t(1) << head.align_log2);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    throw AllocError(AllocErrorType::NoMemory, "can't map " + path);
+  }
+  File *file = (File *)addr;
+  file->size = size;
+  return file;
+}
+
+void Allocator::save() {
+  if (file == nullptr) {
+    return;
+  }
+  file->base = (char *)base;
+  file->last_node = last_node;
+  file->ptr_first = ptr_first;
+  file->vacant_ptrs = vacant_ptrs;
+  file->free_ptrs = free_ptrs;
+  file->rover = rover;
+  file->defrag_cursor = defrag_cursor;
+  file->defrag_deferred = defrag_deferred;
+  file->free_words = free_words;
+  file->free_nodes = free_nodes;
+  file->used_nodes = used_nodes;
+  file->root_id = root_id;
+  file->generations = generations;
+  file->align_log2 = align_log2;
+  file->counters = counters;
+  file->fl_bitmap = fl_bitmap;
+  memcpy(file->sl_bitmap, sl_bitmap, sizeof(sl_bitmap));
+  memcpy(file->free_lists, free_lists, sizeof(free_lists));
+  __atomic_signal_fence(__ATOMIC_SEQ_CST); // the state is complete first
+  file->clean = 1;
+}
+
+// Called before the heap or the table is changed: the state saved last no
+// longer describes them
+inline void Allocator::mark_dirty() {
+  if (file != nullptr && file->clean) {
+    file->clean = 0;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  }
+}
+
+template <class T> static T *rebase(T *p, ptrdiff_t delta) {
+  return p ? (T *)((char *)p + delta) : nullptr;
+}
+
+void Allocator::load(const File *file) {
+  ptrdiff_t delta = (char *)base - file->base;
+  if (delta % (ptrdiff_t(1) << file->align_log2)) { // see map_file()
+    throw AllocError(AllocErrorType::BadFile,
+                     "heap file mapped off the alignment of its nodes");
+  }
+  last_node = rebase(file->last_node, delta);
+  ptr_first = rebase(file->ptr_first, delta);
+  vacant_ptrs = rebase(file->vacant_ptrs, delta);
+  free_ptrs = file->free_ptrs;
+  rover = rebase(file->rover, delta);
+  defrag_cursor = rebase(file->defrag_cursor, delta);
+  defrag_deferred = rebase(file->defrag_deferred, delta);
+  free_words = file->free_words;
+  free_nodes = file->free_nodes;
+  used_nodes = file->used_nodes;
+  root_id = file->root_id;
+  generations = file->generations;
+  align_log2 = file->align_log2;
+  counters = file->counters;
+  fl_bitmap = file->fl_bitmap;
+  memcpy(sl_bitmap, file->sl_bitmap, sizeof(sl_bitmap));
+  for (size_t fl = 0; fl < fl_count; fl++) {
+    for (size_t sl = 0; sl < sl_count; sl++) {
+      free_lists[fl][sl] = rebase(file->free_lists[fl][sl], delta);
+    }
+  }
+  if (delta == 0) {
+    return;
+  }
+
+  // Mapped elsewhere: fix the links in nodes and slots
+  for (AllocatorNode *node = first_node; node != (AllocatorNode *)ptr_first;
+       node = node->next()) {
+    if (node->usage()) {
+      node->setOwner(rebase(node->owner(), delta));
+    } else if (node != last_node) {
+      node->setNextFree(rebase(node->nextFree(), delta));
+      node->setPrevFree(rebase(node->prevFree(), delta));
+    }
+  }
+  for (AllocatorSlot *slot = ptr_first; slot != ptr_last; slot++) {
+    if (slot->vacant()) {
+      slot->setNextVacant(rebase(slot->nextVacant(), delta));
+      slot->setPrevVacant(rebase(slot->prevVacant(), delta));
+    } else {
+      slot->node = rebase(slot->node, delta);
+    }
+  }
+}
+
+Pointer Allocator::alloc(size_t N) { return alloc_aligned(N, sizeof(size_t)); }
+
+Pointer Allocator::alloc_aligned(size_t N, size_t alignment) {
+  size_t log2 = alignment_log2(alignment);
   if (!N) {
     return Pointer();
   }
+  mark_dirty();
+  align_log2 = std::max(align_log2, log2);
+  if (log2 == 0 && slab_size(N)) {
+    return slab_alloc(N);
+  }
 
-  AllocatorNode **ptr = place_ptr();
-  *ptr = force_find_free_node(N);
-  alloc_node(*ptr, N);
+  AllocatorSlot *ptr;
+  try {
+    ptr = place_ptr();
+    try {
+      ptr->node = log2 ? find_aligned_node(N, log2) : force_find_free_node(N);
+    } catch (AllocError &) {
+      release_ptr(ptr); // give back the slot taken above
+      throw;
+    }
+  } catch (AllocError &) {
+    ++counters.failed_allocs;
+    if (trace) {
+      trace->record(TraceOp::AllocFail, 0, N);
+    }
+    throw;
+  }
+  alloc_node(ptr->node, N, log2);
+  ptr->node->setOwner(ptr);
+  ++counters.allocs;
+  if (trace) {
+    trace->record(TraceOp::Alloc, slot_id(ptr), N);
+  }
   return Pointer(ptr);
 }
 
@@ -69,183 +631,1193 @@ void Allocator::realloc(Pointer &p, size_t N) {
     return;
   }
 
-  AllocatorNode *node = *(p.inner_ptr);
+  if (p.small()) { // stays if the class fits, otherwise a new place anyway
+    size_t capacity = slab_of(p, "realloc() of a freed ptr")->size;
+    ++counters.reallocs;
+    if (N > capacity || (N != 0 && N + slab_step <= capacity)) {
+      if (__atomic_load_n(slab_pins(p, "realloc() of a freed ptr"),
+                          __ATOMIC_ACQUIRE)) {
+        throw AllocError(AllocErrorType::InvalidOperation,
+                         "realloc() of pinned ptr can't move it");
+      }
+      Pointer q = alloc(N);
+      memcpy(q.get(), slab_object(p, "realloc() of a freed ptr"),
+             std::min(N, capacity));
+      free(p);
+      --counters.allocs; // a move, not an alloc/free pair
+      --counters.frees;
+      p = q;
+      ++counters.realloc_moves;
+    } else {
+      ++counters.realloc_in_place;
+    }
+    return;
+  }
+
+  if (stale(p)) {
+    Pointer::stale("realloc() of a freed ptr");
+  }
+  mark_dirty();
+  AllocatorNode *node = p.inner_ptr->node;
+  ++counters.reallocs;
+  if (trace) {
+    trace->record(TraceOp::Realloc, slot_id(p.inner_ptr), N);
+  }
 
-  if (node->length() * sizeof(size_t) >= N) { // if shrink
-    alloc_node(node, N);
+  if (node->length() >= words(N)) { // if shrink
+    shrink_node(node, words(N));
+    ++counters.realloc_in_place;
     return;
   }
 
   // grow
-  if (node != last_node) { // try expand
-    AllocatorNode *next = node->next();
-    if (!next->usage()) {
-      size_t avail_size =
-          (node->length() + next->length() + 1) * sizeof(size_t);
-      if (avail_size >= N) {
-        realloc_node(node, N);
-        return;
-      }
+  AllocatorNode *next = node != last_node ? node->next() : nullptr;
+  size_t room = node->length();
+  if (next != nullptr && !next->usage()) { // try expand
+    room += next->length() + 1;
+    if (room >= words(N)) {
+      realloc_node(node, N);
+      ++counters.realloc_in_place;
+      return;
     }
   }
 
-  AllocatorNode *dst = force_find_free_node(N);
-  memcpy(dst + 1, node + 1, N);
+  // try to slide down over the free node in front, it is only found in O(1)
+  // with footers
+  AllocatorNode *prev = tag_words && node != first_node && !node->alignment()
+                            ? prev_node(node)
+                            : nullptr;
+  if (prev != nullptr && !prev->usage() &&
+      room + prev->length() + 1 >= words(N)) {
+    if (!p.inner_ptr->lockMove()) {
+      throw AllocError(AllocErrorType::InvalidOperation,
+                       "realloc() of pinned ptr can't move it");
+    }
+    try {
+      slide_node(prev, N);
+    } catch (AllocError &) {
+      p.inner_ptr->unlockMove();
+      throw;
+    }
+    p.inner_ptr->node = prev;
+    p.inner_ptr->unlockMove();
+    ++counters.realloc_slides;
+    return;
+  }
 
-  dst->setUsage(true);
+  if (!p.inner_ptr->lockMove()) {
+    throw AllocError(AllocErrorType::InvalidOperation,
+                     "realloc() of pinned ptr can't move it");
+  }
+  AllocatorNode *dst;
+  size_t log2 = node->alignment();
+  try {
+    dst = log2 ? find_aligned_node(N, log2) : force_find_free_node(N);
+  } catch (AllocError &) {
+    p.inner_ptr->unlockMove();
+    throw;
+  }
+  alloc_node(dst, N, log2);
+  memcpy(dst->data(), node->data(),
+         (node->length() - 1 - tag_words) * sizeof(size_t));
+  dst->setOwner(p.inner_ptr);
   free_node(node);
-  alloc_node(dst, N);
 
-  *(p.inner_ptr) = dst;
+  p.inner_ptr->node = dst;
+  p.inner_ptr->unlockMove();
+  ++counters.realloc_moves;
 }
 
 void Allocator::free(Pointer &p) {
+  if (p.small()) {
+    slab_free(p);
+    p.inner_ptr = nullptr;
+    ++counters.frees;
+    return;
+  }
   if (p.inner_ptr != nullptr) { // if nullptr
-    free_node(*(p.inner_ptr));
-    *p.inner_ptr = nullptr;
+    if (stale(p)) {
+      Pointer::stale("free() of a freed ptr");
+    }
+    if (p.inner_ptr->pinned()) {
+      throw AllocError(AllocErrorType::InvalidOperation, "free() of pinned ptr");
+    }
+    mark_dirty();
+    if (trace) {
+      trace->record(TraceOp::Free, slot_id(p.inner_ptr));
+    }
+    free_node(p.inner_ptr->node);
+    release_ptr(p.inner_ptr);
     p.inner_ptr = nullptr;
-    squeze_ptrs();
+    ++counters.frees;
+  }
+}
+
+void Allocator::alloc_many(const size_t *sizes, size_t count, Pointer *out) {
+  size_t length = 0; // of the free node to carve them from
+  for (size_t i = 0; i < count; i++) {
+    out[i] = Pointer();
+    if (sizes[i] && !slab_size(sizes[i])) {
+      length += words(sizes[i]) + 1;
+    }
+  }
+
+  // Small objects first, from their slabs as alloc() would place them
+  for (size_t i = 0; i < count; i++) {
+    if (sizes[i] && slab_size(sizes[i])) {
+      try {
+        out[i] = slab_alloc(sizes[i]);
+      } catch (AllocError &) {
+        free_many(out, i);
+        throw;
+      }
+    }
   }
+  if (length == 0) {
+    return;
+  }
+  mark_dirty();
+  length -= 1; // the header of the first node is the free node one
+
+  // Slots next (out keeps them): they may be cut from the wilderness the
+  // nodes are carved from
+  auto release_slots = [&]() {
+    for (size_t i = 0; i < count; i++) {
+      if (out[i].inner_ptr != nullptr && !out[i].small()) {
+        release_ptr(out[i].inner_ptr);
+        out[i].inner_ptr = nullptr;
+      }
+    }
+  };
+  AllocatorNode *node = nullptr;
+  try {
+    for (size_t i = 0; i < count; i++) {
+      if (sizes[i] && out[i].inner_ptr == nullptr) {
+        out[i] = Pointer(place_ptr());
+      }
+    }
+    // find_free_node takes bytes, that many make a node of length words
+    node = find_free_node((length - 1 - tag_words) * sizeof(size_t));
+    if (node == nullptr && defrag_on_failure) {
+      compact();
+      node = find_free_node((length - 1 - tag_words) * sizeof(size_t));
+    }
+  } catch (AllocError &e) {
+    if (e.getType() != AllocErrorType::NoMemory) {
+      release_slots();
+      free_many(out, count);
+      throw;
+    }
+  }
+  if (node == nullptr) {
+    release_slots();
+    for (size_t i = 0; i < count; i++) { // one by one then
+      if (out[i].inner_ptr != nullptr) {
+        continue;
+      }
+      try {
+        out[i] = alloc(sizes[i]);
+      } catch (AllocError &) {
+        free_many(out, count);
+        throw;
+      }
+    }
+    return;
+  }
+
+  // Every node but the last splits the rest of the free node off
+  for (size_t i = 0; i < count; i++) {
+    AllocatorSlot *slot = out[i].inner_ptr;
+    if (slot == nullptr || out[i].small()) {
+      continue;
+    }
+    alloc_node(node, sizes[i]);
+    node->setOwner(slot);
+    slot->node = node;
+    ++counters.allocs;
+    if (trace) {
+      trace->record(TraceOp::Alloc, slot_id(slot), sizes[i]);
+    }
+    node = node->next();
+  }
+}
+
+void Allocator::free_many(Pointer *ptrs, size_t count) {
+  // Handles are checked against the state before the batch, so a handle
+  // given twice would pass twice: duplicates are found by sorting
+  std::vector<std::pair<AllocatorSlot *, size_t>> handles;
+  handles.reserve(count);
+  for (size_t i = 0; i < count; i++) {
+    if (ptrs[i].inner_ptr == nullptr) {
+      continue;
+    }
+    handles.emplace_back(ptrs[i].inner_ptr, ptrs[i].generation);
+    if (ptrs[i].small()) {
+      if (__atomic_load_n(slab_pins(ptrs[i], "free() of a freed ptr"),
+                          __ATOMIC_ACQUIRE)) {
+        throw AllocError(AllocErrorType::InvalidOperation,
+                         "free() of pinned ptr");
+      }
+      continue;
+    }
+    if (stale(ptrs[i])) {
+      Pointer::stale("free() of a freed ptr");
+    }
+    if (ptrs[i].inner_ptr->pinned()) {
+      throw AllocError(AllocErrorType::InvalidOperation, "free() of pinned ptr");
+    }
+  }
+  std::sort(handles.begin(), handles.end());
+  if (std::adjacent_find(handles.begin(), handles.end()) != handles.end()) {
+    throw AllocError(AllocErrorType::InvalidOperation,
+                     "free_many() of the same ptr twice");
+  }
+  mark_dirty();
+  if (tag_words) { // footers give the node in front in O(1) anyway
+    for (size_t i = 0; i < count; i++) {
+      free(ptrs[i]);
+    }
+    return;
+  }
+
+  std::vector<AllocatorNode *> nodes;
+  nodes.reserve(count);
+  for (size_t i = 0; i < count; i++) {
+    AllocatorSlot *slot = ptrs[i].inner_ptr;
+    if (slot == nullptr || ptrs[i].small()) {
+      free(ptrs[i]);
+      continue;
+    }
+    if (trace) {
+      trace->record(TraceOp::Free, slot_id(slot));
+    }
+    nodes.push_back(slot->node);
+    release_ptr(slot);
+    ptrs[i].inner_ptr = nullptr;
+    ++counters.frees;
+  }
+  std::sort(nodes.begin(), nodes.end());
+
+  // One walk: nodes are used, so none is merged into a node freed before
+  AllocatorNode *prev = nullptr;
+  AllocatorNode *cur = first_node;
+  for (AllocatorNode *node : nodes) {
+    while (cur != node) {
+      prev = cur;
+      cur = cur->next();
+    }
+    cur = free_node(node, prev);
+  }
+}
+
+void *Allocator::alloc_raw(size_t N, size_t alignment) {
+  size_t log2 = alignment_log2(alignment);
+  if (!N) {
+    return nullptr;
+  }
+  mark_dirty();
+  align_log2 = std::max(align_log2, log2);
+
+  AllocatorNode *node;
+  try {
+    node = log2 ? find_aligned_node(N, log2) : force_find_free_node(N);
+  } catch (AllocError &) {
+    ++counters.failed_allocs;
+    throw;
+  }
+  alloc_node(node, N, log2);
+  node->setOwner(nullptr);
+  ++counters.allocs;
+  return node->data();
 }
 
+void Allocator::free_raw(void *p) {
+  if (p == nullptr) {
+    return;
+  }
+
+  AllocatorNode *node = (AllocatorNode *)((size_t *)p - 2);
+  if (!node->usage() || node->owner() != nullptr) {
+    throw AllocError(AllocErrorType::InvalidOperation,
+                     "free_raw() of not alloc_raw() memory");
+  }
+  mark_dirty();
+  free_node(node);
+  ++counters.frees;
+}
+
+size_t Allocator::size_raw(const void *p) const {
+  if (p == nullptr) {
+    return 0;
+  }
+  AllocatorNode *node = (AllocatorNode *)((size_t *)p - 2);
+  return (node->length() - 1 - tag_words) * sizeof(size_t);
+}
+
+bool Allocator::owns(const void *p) const {
+  return (char *)p >= (char *)base && (char *)p < (char *)ptr_last;
+}
+
+size_t Allocator::size(const Pointer &p) const {
+  if (p.inner_ptr == nullptr) {
+    return 0;
+  }
+  if (p.small()) {
+    return slab_of(p, "size() of a freed ptr")->size;
+  }
+  if (stale(p)) {
+    Pointer::stale("size() of a freed ptr");
+  }
+  return (p.inner_ptr->node->length() - 1 - tag_words) * sizeof(size_t);
+}
+
+// A stale handle may refer to slot words that went back to the wilderness
+// (squeze_ptrs) and hold user data now, so the slot is checked before its pin
+// counter is touched, and once more after: it may have been freed meanwhile
+Pointer::Pin Allocator::pin(const Pointer &p) {
+  if (p.inner_ptr == nullptr) {
+    return Pointer::Pin((AllocatorSlot *)nullptr, nullptr);
+  }
+  if (p.small()) { // a count per object, the slab itself is never moved
+    uint8_t *pins = slab_pins(p, "possibly it's pin(ptr) after free(ptr)");
+    if (__atomic_add_fetch(pins, 1, __ATOMIC_ACQUIRE) == 0) {
+      __atomic_sub_fetch(pins, 1, __ATOMIC_RELAXED);
+      throw AllocError(AllocErrorType::InvalidOperation, "too many pins");
+    }
+    return Pointer::Pin(pins, slab_object(p, "pin() of a freed ptr"));
+  }
+  if (!live(p)) {
+    Pointer::stale("possibly it's pin(ptr) after free(ptr)");
+  }
+  AllocatorNode *node = p.inner_ptr->pin();
+  if (stale(p)) {
+    p.inner_ptr->unpin();
+    Pointer::stale("possibly it's pin(ptr) after free(ptr)");
+  }
+  return Pointer::Pin(p.inner_ptr, node->data());
+}
+
+AllocatorStats Allocator::stats() const {
+  AllocatorStats stats = counters;
+  size_t heap_words = (size_t *)ptr_first - &first_node->head;
+  size_t wilderness = last_node->usage() ? 0 : last_node->length() + 1;
+
+  // Every node of the top class is a candidate, the rest are smaller
+  size_t largest = wilderness;
+  if (fl_bitmap) {
+    size_t fl = msb(fl_bitmap);
+    size_t sl = msb(sl_bitmap[fl]);
+    for (AllocatorNode *node = free_lists[fl][sl]; node != nullptr;
+         node = node->nextFree()) {
+      largest = std::max(largest, node->length() + 1);
+    }
+  }
+
+  stats.heap_bytes = heap_words * sizeof(size_t);
+  stats.free_bytes = (free_words + wilderness) * sizeof(size_t);
+  stats.free_blocks = free_nodes;
+  stats.live_bytes = stats.heap_bytes - stats.free_bytes;
+  stats.live_blocks = used_nodes;
+  stats.largest_free = largest * sizeof(size_t);
+  stats.wilderness = wilderness * sizeof(size_t);
+  stats.fragmentation =
+      stats.free_bytes ? 1 - double(stats.largest_free) / stats.free_bytes : 0;
+  stats.slots = ptr_last - ptr_first;
+  stats.used_slots = stats.slots - free_ptrs;
+  stats.committed_bytes = (char *)ptr_last - (char *)base;
+  if (reserved && heap_commit < table_commit) {
+    stats.committed_bytes -= table_commit - heap_commit;
+  }
+  stats.small_objects = small_objects;
+  stats.slabs = slab_count;
+  return stats;
+}
+
+std::string Allocator::dump() const { return stats().text(); }
+
 void Allocator::defrag() {
-  AllocatorNode *dst = first_node;
-  AllocatorNode *src = first_node;
+  mark_dirty();
+  if (trace) {
+    trace->record(TraceOp::Defrag);
+  }
+  compact();
+}
+
+size_t Allocator::defrag_step(size_t max_bytes_moved) {
+  mark_dirty();
+  if (trace) {
+    trace->record(TraceOp::DefragStep, 0, max_bytes_moved);
+  }
+  size_t moved = compact_step(max_bytes_moved);
+  if (moved == 0) {
+    trim();
+  }
+  return moved;
+}
+
+size_t Allocator::slot_id(AllocatorSlot *slot) const {
+  return ptr_last - slot - 1;
+}
+
+// Generations are atomic: ConcurrentAllocator bumps them without the lock
+inline bool Allocator::stale(const Pointer &p) {
+  return __builtin_expect(
+      p.generation != __atomic_load_n(&p.inner_ptr->generation, __ATOMIC_ACQUIRE),
+      0);
+}
+
+// Lock free as well (ConcurrentAllocator::free), hence the atomic ptr_first
+bool Allocator::live(const Pointer &p) const {
+  AllocatorSlot *slot = p.inner_ptr;
+  return slot >= __atomic_load_n(&ptr_first, __ATOMIC_ACQUIRE) && slot < ptr_last &&
+         ((char *)ptr_last - (char *)slot) % sizeof(AllocatorSlot) == 0 &&
+         !slot->vacant() && !stale(p);
+}
+
+size_t Allocator::id(const Pointer &p) const {
+  if (p.inner_ptr == nullptr || p.small()) {
+    throw AllocError(AllocErrorType::InvalidOperation,
+                     "null pointer or small object");
+  }
+  if (stale(p)) {
+    Pointer::stale("id() of a freed ptr");
+  }
+  return slot_id(p.inner_ptr);
+}
+
+Pointer Allocator::pointer(size_t id) {
+  if (id >= size_t(ptr_last - ptr_first)) {
+    return Pointer();
+  }
+  AllocatorSlot *slot = ptr_last - id - 1;
+  // the slot of a slab is not a handle
+  return slot->vacant() || slot->node == nullptr || slot->node->owner() != slot
+             ? Pointer()
+             : Pointer(slot);
+}
+
+void Allocator::set_root(const Pointer &p) {
+  root_id = p.inner_ptr ? id(p) : ~size_t(0);
+}
+
+Pointer Allocator::root() { return pointer(root_id); }
+
+void Allocator::compact() {
+  defrag_cursor = first_node;
+  defrag_deferred = nullptr;
+  while (compact_step(~size_t(0)) > 0) {
+  }
+  ++counters.defrags;
+  trim();
+}
 
-  while (src <= last_node) {
-    AllocatorNode *src_next = src->next();
-    if (src->usage()) {
-      memmove(dst, src, src->length() * sizeof(size_t));
-      *std::find(ptr_first, ptr_last, src) = dst;
-      dst = dst->next();
+size_t Allocator::compact_step(size_t max_bytes_moved) {
+  AllocatorNode *end = (AllocatorNode *)ptr_first;
+  size_t moved = 0;
+  bool wrapped = false;
+  ++counters.defrag_steps;
+
+  // Slide the lowest hole up by moving the used node right above it into
+  // its place. The hole then merges with whatever free space follows
+  for (;;) {
+    if (defrag_cursor >= end || defrag_cursor == last_node) {
+      // pass is over, give holes stuck in front of pinned nodes one more try
+      if (defrag_deferred == nullptr || wrapped) {
+        break;
+      }
+      defrag_cursor = defrag_deferred;
+      defrag_deferred = nullptr;
+      wrapped = true;
+      continue; // the hole may have been merged into the wilderness since
+    }
+
+    AllocatorNode *hole = defrag_cursor;
+    if (hole->usage()) {
+      defrag_cursor = hole->next();
+      continue;
+    }
+
+    AllocatorNode *node = hole->next(); // used, free neighbours are merged
+    size_t bytes = (node->length() + 1) * sizeof(size_t);
+    if (moved > 0 && moved + bytes > max_bytes_moved) {
+      break;
+    }
+    AllocatorSlot *slot = node->owner();
+    // an aligned node goes only as far down as its alignment allows, what is
+    // left above it must still make a free node
+    size_t skip = node->alignment() ? aligned_gap(hole, node->alignment()) : 0;
+    bool fits = skip + min_length + tag_words <= hole->length();
+    // raw, pinned or can't move, leave the hole and go on above it
+    if (slot == nullptr || !fits || !slot->lockMove()) {
+      if (defrag_deferred == nullptr || hole < defrag_deferred) {
+        defrag_deferred = hole;
+      }
+      defrag_cursor = node->next();
+      continue;
+    }
+
+    size_t gap = hole->length() - skip;
+    bool was_last = (node == last_node);
+    unlink_node(hole);
+    AllocatorNode *dst = (AllocatorNode *)(&hole->head + skip);
+    memmove(dst, node, bytes);
+    slot->node = dst;
+    slot->unlockMove();
+    moved += bytes;
+    ++counters.defrag_moves;
+    if (skip) { // the rest of the hole stays in front
+      hole->setUsage(false);
+      hole->setLength(skip - 1);
+      tag(hole);
+      link_node(hole);
+      if (defrag_deferred == nullptr || hole < defrag_deferred) {
+        defrag_deferred = hole;
+      }
+    }
+
+    AllocatorNode *tail = dst->next();
+    tail->setUsage(false);
+    tail->setLength(gap);
+    tag(tail);
+    if (was_last) {
+      last_node = tail;
+    }
+    if (defrag_deferred == node) {
+      defrag_deferred = tail;
     }
-    src = src_next;
+    if (rover == node) {
+      rover = tail;
+    }
+    defrag_cursor = tail;
+    merge_next(tail);
   }
 
-  static_assert(sizeof(*ptr_first) == sizeof(size_t), "");
-  static_assert(sizeof(*dst) == sizeof(size_t), "");
+  counters.defrag_bytes += moved;
+  return moved;
+}
+
+size_t Allocator::words(size_t N) const {
+  size_t length = 1 + N / sizeof(size_t) + (N % sizeof(size_t) != 0);
+  return std::max(length, min_length) + tag_words;
+}
+
+void Allocator::tag(AllocatorNode *node) {
+  if (tag_words) {
+    (&node->head)[node->length()] = node->head;
+  }
+}
+
+AllocatorNode *Allocator::prev_node(AllocatorNode *node) {
+  if (tag_words) {
+    size_t footer = (&node->head)[-1] & AllocatorNode::len_mask;
+    return (AllocatorNode *)(&node->head - footer - 1);
+  }
+
+  AllocatorNode *prev = first_node;
+  while (prev->next() != node)
+    prev = prev->next();
+  return prev;
+}
+
+void Allocator::mapping(size_t length, size_t &fl, size_t &sl) {
+  if (length < sl_count) {
+    fl = 0;
+    sl = length;
+    return;
+  }
+  size_t bit = msb(length);
+  fl = bit - sl_shift + 1;
+  sl = (length >> (bit - sl_shift)) - sl_count;
+}
+
+void Allocator::link_node(AllocatorNode *node) {
+  if (node == last_node) { // wilderness is never listed
+    return;
+  }
+
+  free_words += node->length() + 1;
+  ++free_nodes;
+
+  size_t fl, sl;
+  mapping(node->length(), fl, sl);
+  AllocatorNode *head = free_lists[fl][sl];
+  node->setPrevFree(nullptr);
+  node->setNextFree(head);
+  if (head != nullptr) {
+    head->setPrevFree(node);
+  }
+  free_lists[fl][sl] = node;
+  fl_bitmap |= size_t(1) << fl;
+  sl_bitmap[fl] |= size_t(1) << sl;
+}
+
+void Allocator::unlink_node(AllocatorNode *node) {
+  if (node == last_node) {
+    return;
+  }
+
+  free_words -= node->length() + 1;
+  --free_nodes;
+
+  size_t fl, sl;
+  mapping(node->length(), fl, sl);
+  AllocatorNode *prev = node->prevFree();
+  AllocatorNode *next = node->nextFree();
+  if (next != nullptr) {
+    next->setPrevFree(prev);
+  }
+  if (prev != nullptr) {
+    prev->setNextFree(next);
+    return;
+  }
 
-  if ((AllocatorNode *)ptr_first - dst > 0) {
-    dst->next()->setLength((AllocatorNode *)ptr_first - dst - 1);
-    dst->next()->setUsage(false);
+  free_lists[fl][sl] = next;
+  if (next == nullptr) {
+    sl_bitmap[fl] &= ~(size_t(1) << sl);
+    if (!sl_bitmap[fl]) {
+      fl_bitmap &= ~(size_t(1) << fl);
+    }
   }
 }
 
+void Allocator::reset_lists() {
+  fl_bitmap = 0;
+  std::fill_n(sl_bitmap, fl_count, 0);
+  std::fill_n(&free_lists[0][0], fl_count * sl_count, nullptr);
+}
+
 void Allocator::squeze_ptrs() {
   size_t extend_by = 0;
-  while (ptr_first != ptr_last && *ptr_first == nullptr) {
-    ++ptr_first;
+  while (ptr_first != ptr_last && ptr_first->vacant()) {
+    unlink_ptr(ptr_first);
+    __atomic_store_n(&ptr_first, ptr_first + 1, __ATOMIC_RELEASE);
     ++extend_by;
   }
-  if (last_node->usage() && extend_by > 0) {
+  if (extend_by == 0) {
+    return;
+  }
+  extend_by *= slot_words;
+  if (last_node->usage()) {
     last_node = last_node->next();
     last_node->setUsage(false);
-    last_node->setLength(extend_by);
+    last_node->setLength(extend_by - 1);
   } else {
     last_node->setLength(last_node->length() + extend_by);
   }
+  tag(last_node);
 }
 
-AllocatorNode **Allocator::place_ptr() {
-  AllocatorNode **ptr = ptr_last;
-  while (--ptr >= ptr_first) {
-    if (*ptr == nullptr) {
-      return ptr;
-    }
+AllocatorSlot *Allocator::place_ptr() {
+  if (vacant_ptrs != nullptr) {
+    AllocatorSlot *ptr = vacant_ptrs;
+    unlink_ptr(ptr);
+    ptr->node = nullptr;
+    ptr->pins = 0;
+    return ptr; // a new generation since release_ptr()
   }
 
-  if (last_node->usage()) {
+  if (last_node->usage() || last_node->length() < slot_words) {
     throw AllocError(AllocErrorType::NoMemory, "ptr placement failed");
   }
 
-  if (last_node->length() > 0) {
-    last_node->setLength(last_node->length() - 1);
+  commit_table((size_t *)(ptr_first - 1) - 1); // with the new footer
+  last_node->setLength(last_node->length() - slot_words);
+  tag(last_node);
+
+  AllocatorSlot *ptr = ptr_first - 1;
+  ptr->node = nullptr;
+  ptr->pins = 0;
+  // above any handle of a slot that was here before squeze_ptrs()
+  __atomic_store_n(&ptr->generation, ++generations, __ATOMIC_RELEASE);
+  __atomic_store_n(&ptr_first, ptr, __ATOMIC_RELEASE);
+  return ptr;
+}
+
+void Allocator::release_ptr(AllocatorSlot *slot) {
+  // ConcurrentAllocator bumps generations of cached slots on its own
+  generations = std::max(generations, slot->generation) + 1;
+  __atomic_store_n(&slot->generation, generations, __ATOMIC_RELEASE);
+  slot->setNextVacant(vacant_ptrs);
+  slot->setPrevVacant(nullptr);
+  if (vacant_ptrs != nullptr) {
+    vacant_ptrs->setPrevVacant(slot);
   }
+  vacant_ptrs = slot;
+  ++free_ptrs;
+  // trailing slots go back to the wilderness
+  squeze_ptrs();
+}
 
-  --ptr_first;
-  *ptr_first = nullptr;
-  return ptr_first;
+void Allocator::unlink_ptr(AllocatorSlot *slot) {
+  AllocatorSlot *prev = slot->prevVacant();
+  AllocatorSlot *next = slot->nextVacant();
+  if (next != nullptr) {
+    next->setPrevVacant(prev);
+  }
+  if (prev != nullptr) {
+    prev->setNextVacant(next);
+  } else {
+    vacant_ptrs = next;
+  }
+  --free_ptrs;
 }
 
 AllocatorNode *Allocator::find_free_node(size_t N) {
-  AllocatorNode *node = first_node;
-  for (;; node = node->next()) {
-    if (!node->usage() && (node->length() * sizeof(size_t) >= N)) {
+  size_t length = words(N);
+  if (large_length && length >= large_length) {
+    return top_fit(length);
+  }
+
+  switch (placement) {
+  case AllocatorPlacement::FirstFit:
+    return first_fit(first_node, length);
+  case AllocatorPlacement::NextFit:
+    return next_fit(length);
+  case AllocatorPlacement::BestFit:
+    return best_fit(length);
+  default:
+    return good_fit(length);
+  }
+}
+
+AllocatorNode *Allocator::fitting_list(size_t length) {
+  // Round the request up to the next class boundary: any node listed in that
+  // class or above fits, so the lookup is a couple of bit scans
+  size_t rounded = length;
+  if (length >= sl_count) {
+    rounded += (size_t(1) << (msb(length) - sl_shift)) - 1;
+  }
+  size_t fl, sl;
+  mapping(rounded, fl, sl);
+  if (fl >= fl_count) {
+    return nullptr;
+  }
+
+  size_t sl_map = sl_bitmap[fl] & (~size_t(0) << sl);
+  if (!sl_map && fl + 1 < fl_count) {
+    size_t fl_map = fl_bitmap & (~size_t(0) << (fl + 1));
+    if (fl_map) {
+      fl = lsb(fl_map);
+      sl_map = sl_bitmap[fl];
+    }
+  }
+  return sl_map ? free_lists[fl][lsb(sl_map)] : nullptr;
+}
+
+AllocatorNode *Allocator::good_fit(size_t length) {
+  size_t fl, sl;
+
+  // Nodes of the very request class may fit as well. Probe a few of them
+  // first: it keeps the fit tight and costs no more than max_probe steps
+  mapping(length, fl, sl);
+  AllocatorNode *node = free_lists[fl][sl];
+  for (size_t probe = 0; node != nullptr && probe < max_probe;
+       node = node->nextFree(), ++probe) {
+    if (node->length() >= length) {
+      return node;
+    }
+  }
+
+  AllocatorNode *found = fitting_list(length);
+  if (found != nullptr) {
+    return found;
+  }
+
+  if (!last_node->usage() && last_node->length() >= length) {
+    return last_node;
+  }
+
+  // Last resort: the rest of the request class list
+  for (; node != nullptr; node = node->nextFree()) {
+    if (node->length() >= length) {
+      return node;
+    }
+  }
+  return nullptr;
+}
+
+AllocatorNode *Allocator::first_fit(AllocatorNode *from, size_t length) {
+  AllocatorNode *end = (AllocatorNode *)ptr_first;
+  for (AllocatorNode *node = from; node < end; node = node->next()) {
+    if (!node->usage() && node->length() >= length) {
       return node;
     }
-    if (node == last_node) {
-      return nullptr;
+  }
+  return nullptr;
+}
+
+AllocatorNode *Allocator::next_fit(size_t length) {
+  AllocatorNode *found = first_fit(rover, length);
+  if (found == nullptr) {
+    found = first_fit(first_node, length);
+  }
+  if (found != nullptr) {
+    rover = found;
+  }
+  return found;
+}
+
+AllocatorNode *Allocator::best_fit(size_t length) {
+  size_t fl, sl;
+  mapping(length, fl, sl);
+  AllocatorNode *list = free_lists[fl][sl];
+  AllocatorNode *best = nullptr;
+
+  // The request class holds the tightest candidates, if none of them fits
+  // every node of the next nonempty class does
+  for (int pass = 0; pass < 2 && best == nullptr; pass++) {
+    for (AllocatorNode *node = list; node != nullptr; node = node->nextFree()) {
+      if (node->length() >= length
+          && (best == nullptr || node->length() < best->length())) {
+        best = node;
+      }
+    }
+    list = fitting_list(length);
+  }
+
+  if (best == nullptr && !last_node->usage() && last_node->length() >= length) {
+    best = last_node;
+  }
+  return best;
+}
+
+AllocatorNode *Allocator::top_fit(size_t length) {
+
+  // Large nodes are few, every class that may hold a fitting one is scanned
+  size_t fl, sl;
+  mapping(length, fl, sl);
+  AllocatorNode *top = nullptr;
+  for (; fl < fl_count; fl++, sl = 0) {
+    for (size_t sl_map = sl_bitmap[fl] & (~size_t(0) << sl); sl_map;
+         sl_map &= sl_map - 1) {
+      for (AllocatorNode *node = free_lists[fl][lsb(sl_map)]; node != nullptr;
+           node = node->nextFree()) {
+        if (node->length() >= length && node > top) {
+          top = node;
+        }
+      }
     }
   }
+  if (top == nullptr && !last_node->usage() && last_node->length() >= length) {
+    top = last_node;
+  }
+  return top;
 }
 
 AllocatorNode *Allocator::force_find_free_node(size_t N) {
   AllocatorNode *found = find_free_node(N);
 
-  if (found == nullptr) {
+  if (found == nullptr && defrag_on_failure) {
+    compact();
     found = find_free_node(N);
-    if (found == nullptr) {
-      throw AllocError(AllocErrorType::NoMemory, "no large enough free nodes");
-    }
+  }
+  if (found == nullptr) {
+    throw AllocError(AllocErrorType::NoMemory, "no large enough free nodes");
   }
 
   return found;
 }
 
-void Allocator::alloc_node(AllocatorNode *node, size_t N) {
-  size_t off = (N + sizeof(size_t) - 1) / sizeof(size_t);
-  AllocatorNode *tail = node + off + 1;
-  size_t tail_len = node->length() - off;
-  if (tail_len > 0) {
-    tail->setUsage(false);
-    tail->setLength(tail_len - 1);
-    if (node == last_node) {
-      last_node = tail;
-    } else if (!tail->next()->usage()) {
-      tail->setLength((tail_len - 1) + (tail->next()->length() + 1));
+// 0 for the default alignment
+size_t Allocator::alignment_log2(size_t alignment) {
+  if (alignment == 0 || (alignment & (alignment - 1))) {
+    throw AllocError(AllocErrorType::InvalidOperation,
+                     "alignment is not a power of two");
+  }
+  return alignment > sizeof(size_t) ? msb(alignment) : 0;
+}
+
+// Words to skip from the free node start, so that a node placed there has
+// aligned data. What is skipped must be able to make a free node of its own
+size_t Allocator::aligned_gap(AllocatorNode *node, size_t log2) const {
+  size_t alignment = size_t(1) << log2;
+  size_t data = (size_t)node->data();
+  size_t gap = ((alignment - data % alignment) % alignment) / sizeof(size_t);
+  while (gap != 0 && gap < min_length + tag_words + 1) {
+    gap += alignment / sizeof(size_t);
+  }
+  return gap;
+}
+
+// Free node with aligned data that holds N bytes: a node large enough for
+// any gap is found, the gap is split off
+AllocatorNode *Allocator::find_aligned_node(size_t N, size_t log2) {
+  size_t slack = (size_t(1) << log2) +
+                 (min_length + tag_words + 1) * sizeof(size_t);
+  AllocatorNode *node = force_find_free_node(N + slack);
+  size_t gap = aligned_gap(node, log2);
+  return gap ? split_free(node, gap) : node;
+}
+
+// Cuts a free node in two at offset words, both halves stay free
+AllocatorNode *Allocator::split_free(AllocatorNode *node, size_t offset) {
+  AllocatorNode *rest = (AllocatorNode *)(&node->head + offset);
+  if (node == last_node) { // see alloc_node
+    commit_heap(&rest->head + 1);
+  }
+  unlink_node(node);
+  rest->setUsage(false);
+  rest->setLength(node->length() - offset);
+  node->setLength(offset - 1);
+  tag(node);
+  tag(rest);
+  if (node == last_node) {
+    last_node = rest;
+  }
+  link_node(node);
+  link_node(rest);
+  return rest;
+}
+
+bool Allocator::slab_size(size_t N) const {
+  return small_slabs && N <= slab_classes * slab_step;
+}
+
+Pointer Allocator::slab_alloc(size_t N) {
+  size_t cls = (N - 1) / slab_step;
+  Slab *slab = slabs[cls];
+  if (slab == nullptr) {
+    // With its header, owner and footer the node takes slab_bytes, so slabs
+    // cut one after another from the wilderness need no padding
+    size_t bytes = slab_bytes - (2 + tag_words) * sizeof(size_t);
+    AllocatorSlot *slot;
+    AllocatorNode *node;
+    try {
+      slot = place_ptr();
+      try {
+        node = find_aligned_node(bytes, msb(slab_bytes));
+      } catch (AllocError &) {
+        release_ptr(slot);
+        throw;
+      }
+    } catch (AllocError &) {
+      ++counters.failed_allocs;
+      throw;
+    }
+    alloc_node(node, bytes, msb(slab_bytes));
+    node->setOwner(nullptr);
+    slot->node = node;
+    ++slab_count;
+
+    slab = (Slab *)node->data();
+    slab->next = slab->prev = nullptr;
+    slab->slot = slot;
+    slab->size = (cls + 1) * slab_step;
+    // room for the tags, pin counts and their padding up to the objects
+    slab->capacity = (bytes - sizeof(Slab) - 15) / (slab->size + 2);
+    slab->used = 0;
+    slab->hint = 0;
+    // bits past the capacity are never vacant
+    for (size_t i = 0; i < sizeof(slab->bitmap) * 8; i++) {
+      if (i % 64 == 0) {
+        slab->bitmap[i / 64] = 0;
+      }
+      if (i >= slab->capacity) {
+        slab->bitmap[i / 64] |= uint64_t(1) << (i % 64);
+      }
     }
+    memset(slab->tags(), 0, 2 * slab->capacity); // and pins()
+    slabs[cls] = slab;
   }
 
-  node->setUsage(true);
-  node->setLength(off);
+  size_t word = slab->hint;
+  while (!~slab->bitmap[word]) {
+    word = (word + 1) % (sizeof(slab->bitmap) / sizeof(slab->bitmap[0]));
+  }
+  size_t bit = lsb(~slab->bitmap[word]);
+  slab->bitmap[word] |= uint64_t(1) << bit;
+  slab->hint = word;
+  if (++slab->used == slab->capacity) { // full, out of the list
+    slabs[cls] = slab->next;
+    if (slab->next != nullptr) {
+      slab->next->prev = nullptr;
+    }
+  }
+  ++small_objects;
+  ++counters.allocs;
+  size_t index = word * 64 + bit;
+  return Pointer(slab->slot,
+                 index << small_index_shift |
+                     size_t(slab->tags()[index]) << small_tag_shift |
+                     (slab->slot->generation & small_generation_mask));
 }
 
-void Allocator::realloc_node(AllocatorNode *node, size_t N) {
-  size_t off = (N + sizeof(size_t) - 1) / sizeof(size_t);
-  AllocatorNode *tail = node + off + 1;
-  size_t tail_len = node->length() + node->next()->length() - off;
-  bool next_was_last = (node->next() == last_node);
-  if (tail_len > 0) {
-    tail->setUsage(false);
-    tail->setLength(tail_len - 1);
-    if (next_was_last) {
-      last_node = tail;
+// Slab of a small object handle. The slab slot generation is checked before
+// the slab is read: the slot outlives a freed slab, its memory may not
+Allocator::Slab *Allocator::slab_of(const Pointer &p, const char *what) {
+  AllocatorSlot *slot =
+      (AllocatorSlot *)((size_t)p.inner_ptr & ~Pointer::small_tag);
+  if (__builtin_expect((slot->generation & small_generation_mask) !=
+                           (p.generation & small_generation_mask),
+                       0)) {
+    Pointer::stale(what);
+  }
+  Slab *slab = (Slab *)slot->node->data();
+  size_t index = p.generation >> small_index_shift;
+  if (__builtin_expect(slab->tags()[index] !=
+                           uint8_t(p.generation >> small_tag_shift),
+                       0)) {
+    Pointer::stale(what);
+  }
+  return slab;
+}
+
+void *Allocator::slab_object(const Pointer &p, const char *what) {
+  Slab *slab = slab_of(p, what);
+  return slab->objects() + (p.generation >> small_index_shift) * slab->size;
+}
+
+uint8_t *Allocator::slab_pins(const Pointer &p, const char *what) {
+  return &slab_of(p, what)->pins()[p.generation >> small_index_shift];
+}
+
+void Allocator::slab_free(const Pointer &p) {
+  if (__atomic_load_n(slab_pins(p, "free() of a freed ptr"), __ATOMIC_ACQUIRE)) {
+    throw AllocError(AllocErrorType::InvalidOperation, "free() of pinned ptr");
+  }
+  Slab *slab = slab_of(p, "free() of a freed ptr");
+  size_t cls = slab->size / slab_step - 1;
+  size_t index = p.generation >> small_index_shift;
+  slab->bitmap[index / 64] &= ~(uint64_t(1) << (index % 64));
+  ++slab->tags()[index]; // handles of the object are stale now
+  --small_objects;
+
+  if (slab->used-- == slab->capacity) { // back to the list
+    slab->prev = nullptr;
+    slab->next = slabs[cls];
+    if (slab->next != nullptr) {
+      slab->next->prev = slab;
+    }
+    slabs[cls] = slab;
+  }
+  // an empty slab goes back to the heap unless it's the last one of its class
+  if (slab->used == 0 && (slab->next != nullptr || slab->prev != nullptr)) {
+    if (slab->prev != nullptr) {
+      slab->prev->next = slab->next;
+    } else {
+      slabs[cls] = slab->next;
+    }
+    if (slab->next != nullptr) {
+      slab->next->prev = slab->prev;
     }
+    release_ptr(slab->slot); // a new generation, so are the object handles
+    free_node((AllocatorNode *)((size_t *)slab - 2));
+    --slab_count;
   }
+}
 
+void Allocator::alloc_node(AllocatorNode *node, size_t N, size_t log2) {
+  if (node == last_node) { // with the header of what is left of it
+    commit_heap(&node->head + words(N) + 2);
+  }
+  unlink_node(node);
   node->setUsage(true);
-  node->setLength(off);
+  node->setAlignment(log2);
+  tag(node);
+  ++used_nodes;
+  shrink_node(node, words(N));
 }
 
-void Allocator::free_node(AllocatorNode *node) {
-  node->setUsage(false);
-  if (node != first_node) {
-    AllocatorNode *prev = first_node;
-    while (prev->next() != node)
-      prev = prev->next();
-    if (!prev->usage()) {
-      prev->setLength(prev->length() + node->length() + 1);
-      if (node == last_node) {
-        last_node = prev;
-      }
-      node = prev;
+void Allocator::realloc_node(AllocatorNode *node, size_t N) {
+  AllocatorNode *next = node->next();
+  if (next == last_node) {
+    commit_heap(&node->head + words(N) + 2);
+  }
+  unlink_node(next);
+  absorb_next(node);
+  shrink_node(node, words(N));
+}
+
+// prev is the free node in front of a used one: it takes the used node (and
+// the free one after, if any) over, the contents are moved down to it
+void Allocator::slide_node(AllocatorNode *prev, size_t N) {
+  AllocatorNode *node = prev->next();
+  size_t contents = node->length() - tag_words; // owner and data words
+  if (node != last_node && !node->next()->usage()) {
+    if (node->next() == last_node) { // see alloc_node
+      commit_heap(&prev->head + words(N) + 2);
     }
+    unlink_node(node->next());
+    absorb_next(node);
+  }
+  unlink_node(prev);
+  prev->setUsage(true);
+  absorb_next(prev);
+  memmove(&prev->head + 1, &node->head + 1, contents * sizeof(size_t));
+  shrink_node(prev, words(N));
+}
 
-    if (node != last_node && !node->next()->usage()) {
-      if (node->next() == last_node) {
-        last_node = node;
-      }
-      node->setLength(node->length() + node->next()->length() + 1);
+void Allocator::shrink_node(AllocatorNode *node, size_t length) {
+  size_t rest = node->length() - length;
+  if (rest == 0) {
+    return;
+  }
+  // too short tail can't live on its own, leave it as slack
+  if (node != last_node && rest < min_length + tag_words + 1
+      && node->next()->usage()) {
+    return;
+  }
+
+  AllocatorNode *tail = node + length + 1;
+  node->setLength(length);
+  tag(node);
+  tail->setUsage(false);
+  tail->setLength(rest - 1);
+  tag(tail);
+  if (node == last_node) {
+    last_node = tail;
+  }
+  merge_next(tail);
+}
+
+void Allocator::absorb_next(AllocatorNode *node) {
+  AllocatorNode *next = node->next();
+  // references to the next node now point into the middle of this one
+  if (next == last_node) {
+    last_node = node;
+  }
+  if (next == defrag_cursor) {
+    defrag_cursor = node;
+  }
+  if (next == defrag_deferred) {
+    defrag_deferred = node;
+  }
+  if (next == rover) {
+    rover = node;
+  }
+  node->setLength(node->length() + next->length() + 1);
+  tag(node);
+}
+
+void Allocator::merge_next(AllocatorNode *node) {
+  if (node < defrag_cursor) { // keep nodes below the cursor used
+    defrag_cursor = node;
+  }
+  if (node != last_node) {
+    AllocatorNode *next = node->next();
+    if (!next->usage()) {
+      unlink_node(next);
+      absorb_next(node);
     }
   }
+  link_node(node);
+}
+
+void Allocator::free_node(AllocatorNode *node) {
+  free_node(node, node != first_node ? prev_node(node) : nullptr);
+}
+
+// prev is the node in front (nullptr for the first one), returns the free
+// node the freed one ends up in
+AllocatorNode *Allocator::free_node(AllocatorNode *node, AllocatorNode *prev) {
+  node->setUsage(false);
+  tag(node);
+  --used_nodes;
+  if (prev != nullptr && !prev->usage()) {
+    unlink_node(prev);
+    absorb_next(prev);
+    node = prev;
+  }
+  merge_next(node);
+  return node;
 }
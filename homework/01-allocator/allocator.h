@@ -1,42 +1,254 @@
 #ifndef ALLOCATOR
 #define ALLOCATOR
+#include "allocator_pointer.h"
 #include <string>
 
+struct AllocatorSlot;
+class TraceWriter;
+
 struct AllocatorNode {
   static constexpr size_t flg_mask = size_t(1) << (sizeof(size_t) * 8 - 1);
+  static constexpr size_t align_shift = sizeof(size_t) * 8 - 8;
+  static constexpr size_t align_mask = size_t(0x7f) << align_shift;
+  static constexpr size_t len_mask = ~(flg_mask | align_mask);
   size_t head;
 
 public:
   AllocatorNode(const AllocatorNode &) = delete;
   AllocatorNode &operator=(const AllocatorNode &) = delete;
 
-  void setUsage(bool flag);
+  void setUsage(bool flag); // a free node drops its alignment
   void setLength(size_t length);
+  // log2 of the data alignment of a node placed by alloc_aligned, 0 otherwise
+  void setAlignment(size_t log2);
 
   bool usage();
   size_t length();
+  size_t alignment();
   AllocatorNode *
   next(int step = 1); // WRN: use step > 1 only for debug purposes
+
+  // Free nodes keep doubly linked size class lists in their first two words
+  AllocatorNode *nextFree();
+  AllocatorNode *prevFree();
+  void setNextFree(AllocatorNode *node);
+  void setPrevFree(AllocatorNode *node);
+
+  // Used nodes keep a back reference to their pointer table slot instead
+  AllocatorSlot *owner();
+  void setOwner(AllocatorSlot *slot);
+  void *data();
 };
 
-// Forward declaration. Do not include real class definition
-// to avoid expensive macros calculations and increase compile speed
+/**
+ * Pointer table entry. Pointer refers to a slot, the slot refers to the node.
+ *
+ * Slot also counts pins (see Allocator::pin): a pinned node is never moved, so
+ * its address may be used while it stays pinned. Pin/unpin are lock free and
+ * may race with a node move done under the allocator lock (ConcurrentAllocator)
+ *
+ * Vacant slots are kept in a doubly linked list: `node` holds the next one
+ * tagged with the low bit, `pins` holds the previous one.
+ *
+ * `generation` changes whenever the slot is given back, Pointer keeps a copy
+ * of it, so a Pointer that outlived its node is told apart in O(1) even when
+ * the slot already serves another allocation. It is read and written with
+ * atomics: ConcurrentAllocator::free bumps it without the lock.
+ */
+struct AllocatorSlot {
+  static constexpr size_t moving = AllocatorNode::flg_mask;
+  static constexpr size_t vacant_tag = 1;
+  AllocatorNode *node;
+  size_t pins; // pin counter, `moving` bit while the node is being moved
+  size_t generation;
+
+  bool vacant() const;
+  AllocatorSlot *nextVacant() const;
+  AllocatorSlot *prevVacant() const;
+  void setNextVacant(AllocatorSlot *slot);
+  void setPrevVacant(AllocatorSlot *slot);
+
+  AllocatorNode *pin(); // waits while the node is being moved
+  void unpin();
+  bool pinned() const;
+
+  // Succeeds only if the node isn't pinned. Pins wait until unlockMove()
+  bool lockMove();
+  void unlockMove();
+};
 
-class Pointer;
+/**
+ * Node layout of the allocator heap.
+ *
+ * Compact: 8 byte header only. Freeing a node has to walk the heap from the
+ * first node to find its predecessor for coalescing.
+ *
+ * BoundaryTags: each node also keeps a copy of its header (footer) in its last
+ * word, so the predecessor is found in O(1) at the cost of a word per node.
+ */
+enum class AllocatorLayout { Compact, BoundaryTags };
+
+/**
+ * Where alloc places a node among the free ones.
+ *
+ * GoodFit: segregated size classes, a node of the next class up is taken
+ * without a search. O(1), wastes less than one class step.
+ *
+ * FirstFit: the lowest fitting node, found by a heap walk.
+ *
+ * NextFit: the first fitting node after the one found last (roving pointer),
+ * found by a heap walk.
+ *
+ * BestFit: the smallest fitting node, a scan of one or two class lists.
+ *
+ * All but NextFit take the wilderness only if no other free node fits.
+ */
+enum class AllocatorPlacement { GoodFit, FirstFit, NextFit, BestFit };
+
+struct AllocatorOptions {
+  AllocatorLayout layout = AllocatorLayout::Compact;
+  AllocatorPlacement placement = AllocatorPlacement::GoodFit;
+
+  // Requests of at least that many bytes skip the placement policy and go
+  // top-down: into the highest fitting free node, the wilderness last. Large
+  // nodes gather at the top, small ones at the bottom. 0 disables
+  size_t large_threshold = 0;
+
+  // Run defrag() and retry once before an alloc fails with NoMemory. Note
+  // that Pointer::get() addresses don't survive such alloc then
+  bool defrag_on_failure = false;
+
+  // alloc() of up to 64 bytes takes an object from a slab instead of a node:
+  // slabs are 4KB raw nodes packed with objects of one size class, with an
+  // occupancy bitmap, a tag and a pin count byte per object. Such object has
+  // no header and no slot of its own (its slab takes one, stale handles are
+  // told by it and the tag), it is never moved by defrag (its slab is freed
+  // once empty) and has no id(). Not for files (see Allocator(path, ...)),
+  // nor traced
+  bool small_slabs = false;
+
+  // A file that can't be reattached (not saved after its last change, not an
+  // allocator file or of another layout) is formatted anew instead of being
+  // refused with AllocErrorType::BadFile. Whatever it held is lost
+  bool reset_bad_file = false;
+
+  // Handle calls are recorded here: alloc, alloc_aligned (without the
+  // alignment), alloc_many, realloc, free, free_many and defrag (see
+  // TraceReader and allocator_replay). Not recorded: alloc_raw/free_raw
+  // nodes and slab objects (small_slabs), so a replay of a workload with
+  // them runs on another heap layout. Must outlive the allocator
+  TraceWriter *trace = nullptr;
+};
+
+/**
+ * Snapshot of the allocator state, see Allocator::stats().
+ *
+ * Byte counts are in heap terms: node headers and footers are included, the
+ * pointer table is not. Counters are cumulative since construction.
+ */
+struct AllocatorStats {
+  size_t heap_bytes;    // nodes area, grows and shrinks with the table
+  size_t live_bytes;    // used nodes
+  size_t live_blocks;
+  size_t free_bytes;    // free nodes and the wilderness
+  size_t free_blocks;   // free nodes other than the wilderness
+  size_t largest_free;  // largest node an alloc can get without defrag
+  size_t wilderness;    // bytes
+  double fragmentation; // 1 - largest_free / free_bytes, 0 if no free bytes
+
+  size_t slots;      // pointer table entries
+  size_t used_slots; // entries that refer to a node
+
+  // Backed by memory: the whole caller buffer or committed reserved pages
+  size_t committed_bytes;
+
+  // Slab tier (AllocatorOptions::small_slabs): slabs count as live blocks
+  // and used slots, the objects in them don't
+  size_t small_objects;
+  size_t slabs;
+
+  size_t allocs;
+  size_t failed_allocs;
+  size_t frees;
+  size_t reallocs;
+  size_t realloc_in_place; // reallocs that shrank or grew the node in place
+  size_t realloc_slides;   // grew over the free node in front (BoundaryTags)
+  size_t realloc_moves;    // reallocs that copied the node elsewhere
+  size_t defrags;       // full passes, their steps are counted as well
+  size_t defrag_steps;
+  size_t defrag_moves; // nodes moved by defrag
+  size_t defrag_bytes; // bytes moved by defrag
+
+  /**
+   * One `name value` pair per line
+   */
+  std::string text() const;
+
+  /**
+   * Flat JSON object with the same names
+   */
+  std::string json() const;
+};
 
 /**
  * Wraps given memory area and provides defagmentation allocator interface on
  * the top of it.
  *
+ * Nodes grow from the bottom of the area, pointer table grows from the top.
+ * The last node (if free) is a "wilderness" that both of them are cut from.
+ * Used node starts with a back reference to its slot, so moving it is O(1).
+ * Raw nodes (alloc_raw) have no slot and are never moved.
+ * All other free nodes are kept in segregated lists (two level size classes),
+ * so a fitting node is found without walking the heap.
  *
+ * The area is either a caller buffer, a range reserved with mmap or a mapped
+ * file. Pages of a reserved range are committed as the heap and the table
+ * grow towards each other, the wilderness pages are given back after
+ * defrag(). A file keeps the allocator state across processes: handles are
+ * slot ids (see id()), so they stay valid wherever the file gets mapped.
  */
 class Allocator {
+  friend class ConcurrentAllocator; // live() on its lock free path
+  friend class Pointer; // small object handles are resolved by slab_object()
+
 public:
   static constexpr size_t pageSize = sizeof(size_t);
+  // Reserved pages are committed by that many bytes at once
+  static constexpr size_t commit_step = 64 * 1024;
+
+  Allocator(void *base, size_t size,
+            const AllocatorOptions &options = AllocatorOptions());
+
+  /**
+   * Reserves size bytes of address space (no memory is taken yet) and
+   * commits pages on demand, so there is no need to guess the buffer size:
+   * reserve much more than is going to be used
+   * @param size size_t, a multiple of commit_step
+   */
+  explicit Allocator(size_t size,
+                     const AllocatorOptions &options = AllocatorOptions());
 
-  Allocator(void *base, size_t size);
+  /**
+   * Heap in a file mapped with MAP_SHARED. A new file is created with the
+   * given size (sparse, so disk blocks are taken on demand), an existing one
+   * is reattached as is: all blocks and handles the previous owner left are
+   * there, no rebuild. The state is saved to the file by save() and the
+   * destructor. A file changed after its last save (its process died) is
+   * refused with AllocErrorType::BadFile, see AllocatorOptions::reset_bad_file.
+   *
+   * The file is mapped at its previous address if possible. Otherwise nodes
+   * and slots are rebased by one walk over them, and then only Pointer
+   * handles are valid: addresses stored inside raw (alloc_raw) nodes are not.
+   * The new address is off the old one by a multiple of the largest
+   * alignment ever asked of the heap, so aligned nodes stay aligned.
+   * @param path std::string
+   * @param size size_t, ignored for an existing file
+   */
+  Allocator(const std::string &path, size_t size,
+            const AllocatorOptions &options = AllocatorOptions());
   Allocator(const Allocator &) = delete;
   Allocator &operator=(const Allocator &) = delete;
+  ~Allocator();
 
   /**
    * TODO: semantics
@@ -58,31 +270,259 @@ public:
   void free(Pointer &p);
 
   /**
-   * TODO: semantics
+   * Like alloc, but the data address is a multiple of alignment (a power of
+   * two, page size included). The alignment is kept when the node is moved
+   * by defrag or realloc: it only goes to an aligned place. Padding in front
+   * is split off as a free node, so little is lost
+   * @param N size_t
+   * @param alignment size_t
+   */
+  Pointer alloc_aligned(size_t N, size_t alignment);
+
+  /**
+   * Allocates count nodes at once, all or none: out[i] gets sizes[i] bytes
+   * (null for 0). The nodes are carved one after another from a single free
+   * node found by one lookup, so they are adjacent; if no free node holds
+   * them all, they are placed one by one. Small sizes take slab objects just
+   * like alloc() (see AllocatorOptions::small_slabs)
+   * @param sizes const size_t*
+   * @param count size_t
+   * @param out Pointer*
+   */
+  void alloc_many(const size_t *sizes, size_t count, Pointer *out);
+
+  /**
+   * Frees count nodes, null pointers are skipped. Nothing is freed if any
+   * of them is pinned, stale or given twice. With the Compact layout the
+   * nodes are coalesced in address order by a single heap walk instead of
+   * one walk per node
+   * @param ptrs Pointer*
+   * @param count size_t
+   */
+  void free_many(Pointer *ptrs, size_t count);
+
+  /**
+   * Non relocating allocation for memory that is referenced by plain
+   * pointers (std containers, see AllocatorResource). The node takes no
+   * pointer slot and stays in place until free_raw(), defrag passes it by
+   * like a pinned one.
+   * @param N size_t
+   * @param alignment size_t, a power of two
+   * @return address aligned to alignment
+   */
+  void *alloc_raw(size_t N, size_t alignment = sizeof(size_t));
+
+  /**
+   * Frees the node returned by alloc_raw()
+   * @param p void*
+   */
+  void free_raw(void *p);
+
+  /**
+   * Usable size of the node returned by alloc_raw() (at least as requested)
+   * @param p void*
+   */
+  size_t size_raw(const void *p) const;
+
+  /**
+   * Whether p points into the area of this allocator, nodes or table
+   * @param p void*
+   */
+  bool owns(const void *p) const;
+
+  /**
+   * Compacts the heap: used nodes are moved down, free space is gathered
+   * into the wilderness. Pinned and raw nodes stay in place with holes in
+   * front. Pages of a reserved range that the wilderness covers are given
+   * back (so does defrag_step once it is done).
    */
   void defrag();
 
   /**
-   * TODO: semantics
+   * Incremental defrag: moves used nodes down into the lowest holes until
+   * about max_bytes_moved bytes are moved (a node larger than that is moved
+   * alone). Progress is kept between calls, alloc/free may be freely mixed in.
+   * Pinned and raw nodes are passed by, holes in front of them are retried
+   * once the pass is over.
+   * @param max_bytes_moved size_t
+   * @return bytes moved, 0 once the heap is compact (up to pinned nodes)
+   */
+  size_t defrag_step(size_t max_bytes_moved);
+
+  /**
+   * Usable size of the node behind p (at least as requested on alloc)
+   * @param p Pointer
+   */
+  size_t size(const Pointer &p) const;
+
+  /**
+   * Pins the node behind p (see Pointer::Pin). The slot is checked to be a
+   * live one of the table before the pin counter is touched, so a stale
+   * handle throws even if its slot went back to the wilderness
+   * @param p Pointer
+   */
+  Pointer::Pin pin(const Pointer &p);
+
+  /**
+   * Stable handle id: slot index counted from the top of the table. Ids are
+   * reused after free, just like slots are
+   * @param p Pointer
+   */
+  size_t id(const Pointer &p) const;
+
+  /**
+   * Handle by id(), null if no node is behind it
+   * @param id size_t
+   */
+  Pointer pointer(size_t id);
+
+  /**
+   * Entry handle of a persistent heap, kept across reattaches as an id
+   * @param p Pointer
+   */
+  void set_root(const Pointer &p);
+  Pointer root();
+
+  /**
+   * Current state and counters. Counters are maintained on the fly, the
+   * snapshot itself costs a scan of the largest nonempty size class only
+   */
+  AllocatorStats stats() const;
+
+  /**
+   * stats() as text
+   */
+  std::string dump() const;
+
+  /**
+   * Checkpoint of a file-backed allocator: the state is written to the file,
+   * so it can be reattached as of now even if the process dies without the
+   * destructor. The next change marks the file dirty until the following
+   * save(). A no-op for other allocators
    */
-  std::string dump() const { return ""; }
+  void save();
 
 private:
+  struct File; // mapped file header, defined in allocator.cpp
+  struct Slab; // small objects page, defined in allocator.cpp
+
+  static constexpr size_t slab_bytes = 4096;
+  static constexpr size_t slab_step = 8; // object size classes
+  static constexpr size_t slab_classes = 8;
+
+  // Free node must be able to hold its list links (and footer if any)
+  static constexpr size_t min_length = 2;
+
+  // Size classes: first level is a power of two, second level splits it
+  // linearly into sl_count parts. Lengths below sl_count map 1:1 into fl = 0
+  static constexpr size_t sl_shift = 3;
+  static constexpr size_t sl_count = size_t(1) << sl_shift;
+  static constexpr size_t fl_count = sizeof(size_t) * 8 - sl_shift;
+  // How many nodes of the request class are tried before the bitmap lookup
+  static constexpr size_t max_probe = 8;
+
   void *base;
+  size_t reserved;    // mmap'ed bytes, 0 for a caller buffer
+  char *heap_commit;  // end of the committed pages at the bottom
+  char *table_commit; // start of the committed pages at the top
+  File *file;         // nullptr unless the area is a mapped file
 
   AllocatorNode *first_node;
   AllocatorNode *last_node;
 
-  AllocatorNode **ptr_first;
-  AllocatorNode **ptr_last;
+  static constexpr size_t slot_words = sizeof(AllocatorSlot) / sizeof(size_t);
+
+  AllocatorSlot *ptr_first;
+  AllocatorSlot *ptr_last;
+  AllocatorSlot *vacant_ptrs; // list of vacant slots between them
+  size_t free_ptrs;           // its length
+
+  size_t tag_words; // footer words per node: 1 for BoundaryTags, 0 otherwise
+  AllocatorPlacement placement;
+  size_t large_length; // node length of large requests, 0 if disabled
+  bool defrag_on_failure;
+  AllocatorNode *rover; // NextFit position
+  TraceWriter *trace;
+  size_t root_id;
+  size_t generations; // the highest slot generation handed out
+  size_t align_log2;  // the largest alignment asked of alloc_aligned/alloc_raw
+
+  bool small_slabs;
+  Slab *slabs[slab_classes]; // slabs with vacant objects, per class
+  size_t small_objects;
+  size_t slab_count;
+
+  AllocatorNode *defrag_cursor;   // nodes below it are used or immovable
+  AllocatorNode *defrag_deferred; // lowest hole left in front of such node
+
+  // Listed free nodes (the wilderness is accounted separately) and used nodes
+  size_t free_words;
+  size_t free_nodes;
+  size_t used_nodes;
+  AllocatorStats counters; // only the cumulative part is kept up to date
+
+  size_t fl_bitmap;
+  size_t sl_bitmap[fl_count];
+  AllocatorNode *free_lists[fl_count][sl_count];
+
+  Allocator(void *base, size_t size, const AllocatorOptions &options,
+            bool format);
+  Allocator(File *file, const AllocatorOptions &options);
+
+  size_t words(size_t N) const;
+  static void *reserve(size_t size);
+  static File *open_file(const std::string &path, size_t size,
+                         const AllocatorOptions &options);
+  void load(const File *file);
+  void mark_dirty();
+  void commit_heap(void *end);
+  void commit_table(void *start);
+  void trim();
+  static void mapping(size_t length, size_t &fl, size_t &sl);
+
+  void tag(AllocatorNode *node);
+  AllocatorNode *prev_node(AllocatorNode *node);
+
+  void link_node(AllocatorNode *node);
+  void unlink_node(AllocatorNode *node);
+  void reset_lists();
+
+  size_t slot_id(AllocatorSlot *slot) const;
+  static bool stale(const Pointer &p); // its node was freed, slot may be reused
+  bool live(const Pointer &p) const; // slot in the table and not stale
+  void compact();
+  size_t compact_step(size_t max_bytes_moved);
 
   void squeze_ptrs();
-  AllocatorNode **place_ptr();
+  AllocatorSlot *place_ptr();
+  void release_ptr(AllocatorSlot *slot);
+  void unlink_ptr(AllocatorSlot *slot);
   AllocatorNode *find_free_node(size_t N);
+  AllocatorNode *fitting_list(size_t length);
+  AllocatorNode *good_fit(size_t length);
+  AllocatorNode *first_fit(AllocatorNode *from, size_t length);
+  AllocatorNode *next_fit(size_t length);
+  AllocatorNode *best_fit(size_t length);
+  AllocatorNode *top_fit(size_t length);
   AllocatorNode *force_find_free_node(size_t N);
-  void alloc_node(AllocatorNode *node, size_t N);
+  static size_t alignment_log2(size_t alignment);
+  size_t aligned_gap(AllocatorNode *node, size_t log2) const;
+  AllocatorNode *find_aligned_node(size_t N, size_t log2);
+  AllocatorNode *split_free(AllocatorNode *node, size_t offset);
+  bool slab_size(size_t N) const; // alloc() of N bytes takes a slab object
+  static Slab *slab_of(const Pointer &p, const char *what);
+  static void *slab_object(const Pointer &p, const char *what);
+  static unsigned char *slab_pins(const Pointer &p, const char *what);
+  Pointer slab_alloc(size_t N);
+  void slab_free(const Pointer &p);
+  void alloc_node(AllocatorNode *node, size_t N, size_t log2 = 0);
   void realloc_node(AllocatorNode *node, size_t N);
+  void slide_node(AllocatorNode *prev, size_t N);
+  void shrink_node(AllocatorNode *node, size_t length);
+  void absorb_next(AllocatorNode *node);
+  void merge_next(AllocatorNode *node);
   void free_node(AllocatorNode *node);
+  AllocatorNode *free_node(AllocatorNode *node, AllocatorNode *prev);
 };
 
 #endif // ALLOCATOR
@@ -0,0 +1,866 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <memory_resource>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "allocator.h"
+#include "allocator_error.h"
+#include "allocator_pointer.h"
+#include "allocator_resource.h"
+#include "concurrent_allocator.h"
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+// Upper bound of per block bookkeeping: header, owner, footer and pointer slot
+static const size_t overhead = 3 * sizeof(size_t) + sizeof(AllocatorSlot);
+
+static double nsPerOp(Clock::time_point start, size_t ops) {
+    return chrono::duration<double, nano>(Clock::now() - start).count() / ops;
+}
+
+/**
+ * Every printed row is also kept for --json, in the google benchmark output
+ * shape: {"context": {...}, "benchmarks": [{"name": "section/arg", <counter>: value, ...}]}
+ * so the usual compare tools can diff two runs.
+ */
+struct Result {
+    string name;
+    vector<pair<string, double>> counters;
+};
+static vector<Result> results;
+
+static void report(string name, initializer_list<pair<string, double>> counters)
+{
+    results.push_back({ move(name), counters });
+}
+
+static void writeJson(const char* path, const char* executable, size_t maxLive)
+{
+    FILE* out = fopen(path, "w");
+    if (out == nullptr) {
+        fprintf(stderr, "can't write %s\n", path);
+        exit(1);
+    }
+    char date[64], host[256] = "";
+    time_t now = time(nullptr);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", localtime(&now));
+    gethostname(host, sizeof(host) - 1);
+#ifdef NDEBUG
+    const char* build = "release";
+#else
+    const char* build = "debug";
+#endif
+
+    fprintf(out, "{\n  \"context\": {\n");
+    fprintf(out, "    \"date\": \"%s\",\n    \"host_name\": \"%s\",\n    \"executable\": \"%s\",\n", date, host, executable);
+    fprintf(out, "    \"num_cpus\": %u,\n    \"max_live\": %zu,\n    \"library_build_type\": \"%s\"\n  },\n",
+        thread::hardware_concurrency(), maxLive, build);
+    fprintf(out, "  \"benchmarks\": [");
+    for (size_t i = 0; i < results.size(); i++) {
+        fprintf(out, "%s\n    {\"name\": \"%s\", \"run_type\": \"iteration\"", i ? "," : "", results[i].name.c_str());
+        for (auto& counter : results[i].counters) {
+            fprintf(out, ", \"%s\": %.10g", counter.first.c_str(), counter.second);
+        }
+        fprintf(out, "}");
+    }
+    fprintf(out, "\n  ]\n}\n");
+    fclose(out);
+}
+
+/**
+ * Alloc latency vs number of live blocks.
+ *
+ * The heap is filled with `live` small blocks, then every other block is shrunk
+ * in place, which punches a small hole after it. "miss" requests are larger than
+ * any hole, so a first-fit walk would cross the whole heap before reaching the
+ * wilderness. "hit" requests fit into the holes.
+ */
+static void benchFindFree(size_t live)
+{
+    const size_t blockSize = 64, shrunkSize = 16, batch = 10000;
+    size_t size = live * (blockSize + overhead) + 2 * batch * (256 + overhead);
+    vector<char> arena(size);
+    Allocator a(arena.data(), arena.size());
+
+    vector<Pointer> ptrs;
+    ptrs.reserve(live + 2 * batch);
+    for (size_t i = 0; i < live; i++) {
+        ptrs.push_back(a.alloc(blockSize));
+    }
+    for (size_t i = 0; i < live; i += 2) {
+        a.realloc(ptrs[i], shrunkSize);
+    }
+
+    srand(1);
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < batch; i++) {
+        ptrs.push_back(a.alloc(blockSize + 1 + rand() % 192));
+    }
+    double miss = nsPerOp(start, batch);
+
+    size_t hits = min(batch, live / 2);
+    start = Clock::now();
+    for (size_t i = 0; i < hits; i++) {
+        ptrs.push_back(a.alloc(blockSize - shrunkSize - sizeof(size_t)));
+    }
+    double hit = nsPerOp(start, hits);
+
+    printf("%12zu %14.1f %14.1f\n", live, miss, hit);
+    report("find_free/" + to_string(live), { { "miss_ns", miss }, { "hit_ns", hit } });
+}
+
+/**
+ * Alloc+free latency with `live` long lived handles in front of the vacant
+ * ones: the handles allocated last (lowest in the pointer table) are freed,
+ * except the very last one that keeps the table from shrinking.
+ */
+static void benchSlots(size_t live)
+{
+    const size_t blockSize = 16, batch = 100000;
+    vector<char> arena(2 * live * (blockSize + overhead) + 64);
+    AllocatorOptions options;
+    options.layout = AllocatorLayout::BoundaryTags;
+    Allocator a(arena.data(), arena.size(), options);
+
+    vector<Pointer> ptrs;
+    for (size_t i = 0; i < 2 * live; i++) {
+        ptrs.push_back(a.alloc(blockSize));
+    }
+    for (size_t i = live; i + 1 < 2 * live; i++) {
+        a.free(ptrs[i]);
+    }
+
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < batch; i++) {
+        Pointer p = a.alloc(blockSize);
+        a.free(p);
+    }
+    double ns = nsPerOp(start, batch);
+    printf("%12zu %14.1f\n", live, ns);
+    report("slots/" + to_string(live), { { "ns", ns } });
+}
+
+/**
+ * free() throughput of the given layout: `live` blocks are released in random
+ * order, so roughly half of the frees coalesce with a free neighbour.
+ */
+static double benchFree(size_t live, AllocatorLayout layout)
+{
+    const size_t blockSize = 64;
+    vector<char> arena(live * (blockSize + overhead) + 64);
+    AllocatorOptions options;
+    options.layout = layout;
+    Allocator a(arena.data(), arena.size(), options);
+
+    vector<Pointer> ptrs;
+    ptrs.reserve(live);
+    for (size_t i = 0; i < live; i++) {
+        ptrs.push_back(a.alloc(blockSize));
+    }
+
+    srand(2);
+    for (size_t i = live - 1; i > 0; i--) {
+        swap(ptrs[i], ptrs[rand() % (i + 1)]);
+    }
+
+    Clock::time_point start = Clock::now();
+    for (Pointer& p : ptrs) {
+        a.free(p);
+    }
+    return 1e3 / nsPerOp(start, live);
+}
+
+/**
+ * Baseline that only moves a cursor: free is a no-op and the arena starts
+ * over when it runs out, so it bounds what any allocator can do.
+ */
+struct BumpAllocator {
+    vector<char> arena;
+    size_t top = 0;
+
+    explicit BumpAllocator(size_t size) : arena(size) {}
+
+    void* alloc(size_t n)
+    {
+        n = (n + 7) & ~size_t(7);
+        if (top + n > arena.size()) {
+            top = 0;
+        }
+        void* p = &arena[top];
+        top += n;
+        return p;
+    }
+};
+
+/**
+ * Steady state churn: `live` blocks of 16..1024 bytes, a random one is freed
+ * and replaced per op. Allocator (BoundaryTags) vs malloc vs bump, ns per
+ * alloc+free pair.
+ */
+static void benchChurn(size_t live)
+{
+    const size_t ops = 1000000;
+    mt19937 rnd(5);
+    vector<pair<size_t, size_t>> script(ops); // victim, new size
+    for (auto& op : script) {
+        op = { rnd() % live, 16 + rnd() % 1009 };
+    }
+    vector<size_t> sizes(live);
+    for (size_t& size : sizes) {
+        size = 16 + rnd() % 1009;
+    }
+
+    vector<char> arena(live * (1024 + overhead) * 2);
+    AllocatorOptions options;
+    options.layout = AllocatorLayout::BoundaryTags;
+    Allocator a(arena.data(), arena.size(), options);
+    vector<Pointer> ptrs;
+    for (size_t size : sizes) {
+        ptrs.push_back(a.alloc(size));
+    }
+    Clock::time_point start = Clock::now();
+    for (auto& op : script) {
+        a.free(ptrs[op.first]);
+        ptrs[op.first] = a.alloc(op.second);
+    }
+    double managed = nsPerOp(start, ops);
+    AllocatorStats stats = a.stats();
+
+    vector<void*> blocks;
+    for (size_t size : sizes) {
+        blocks.push_back(malloc(size));
+    }
+    start = Clock::now();
+    for (auto& op : script) {
+        free(blocks[op.first]);
+        blocks[op.first] = malloc(op.second);
+    }
+    double heap = nsPerOp(start, ops);
+    for (void* p : blocks) {
+        free(p);
+    }
+
+    BumpAllocator bump(arena.size());
+    for (size_t i = 0; i < live; i++) {
+        blocks[i] = bump.alloc(sizes[i]);
+    }
+    start = Clock::now();
+    for (auto& op : script) {
+        blocks[op.first] = bump.alloc(op.second);
+    }
+    double cursor = nsPerOp(start, ops);
+
+    printf("%12zu %14.1f %14.1f %14.1f %14.3f\n", live, managed, heap, cursor, stats.fragmentation);
+    report("churn/" + to_string(live),
+        { { "allocator_ns", managed }, { "malloc_ns", heap }, { "bump_ns", cursor }, { "fragmentation", stats.fragmentation } });
+}
+
+/**
+ * Growing buffers: `buffers` of them are grown in turns from 64 bytes to
+ * `limit`, either by 64 bytes ("append") or 2x ("double") per realloc. One
+ * buffer grows in place into the wilderness, several ones keep getting in
+ * each other's way. Allocator (BoundaryTags) vs libc realloc vs bump
+ * (alloc + copy), ns per realloc, and the share of Allocator reallocs that
+ * didn't copy.
+ */
+static void benchRealloc(const char* pattern, size_t buffers, size_t limit)
+{
+    bool doubling = strcmp(pattern, "double") == 0;
+    auto grow = [&](size_t size) { return doubling ? 2 * size : size + 64; };
+    size_t steps = 0;
+    for (size_t size = 64; size < limit; size = grow(size)) {
+        steps++;
+    }
+    const size_t rounds = max<size_t>(1, 20000 / (steps * buffers));
+
+    vector<char> arena(4 * buffers * (limit + overhead) + (1 << 20));
+    AllocatorOptions options;
+    options.layout = AllocatorLayout::BoundaryTags;
+    options.defrag_on_failure = true;
+    Allocator a(arena.data(), arena.size(), options);
+    vector<Pointer> ptrs(buffers);
+    Clock::time_point start = Clock::now();
+    for (size_t r = 0; r < rounds; r++) {
+        for (Pointer& p : ptrs) {
+            p = a.alloc(64);
+        }
+        for (size_t size = 64; size < limit;) {
+            size = grow(size);
+            for (Pointer& p : ptrs) {
+                a.realloc(p, size);
+            }
+        }
+        for (Pointer& p : ptrs) {
+            a.free(p);
+        }
+    }
+    double managed = nsPerOp(start, rounds * steps * buffers);
+    AllocatorStats stats = a.stats();
+    double inPlace = double(stats.realloc_in_place + stats.realloc_slides) / stats.reallocs;
+
+    vector<void*> blocks(buffers);
+    start = Clock::now();
+    for (size_t r = 0; r < rounds; r++) {
+        for (void*& p : blocks) {
+            p = malloc(64);
+        }
+        for (size_t size = 64; size < limit;) {
+            size = grow(size);
+            for (void*& p : blocks) {
+                p = realloc(p, size);
+            }
+        }
+        for (void* p : blocks) {
+            free(p);
+        }
+    }
+    double heap = nsPerOp(start, rounds * steps * buffers);
+
+    BumpAllocator bump(arena.size());
+    start = Clock::now();
+    for (size_t r = 0; r < rounds; r++) {
+        for (void*& p : blocks) {
+            p = bump.alloc(64);
+        }
+        for (size_t size = 64; size < limit;) {
+            size_t next = grow(size);
+            for (void*& p : blocks) {
+                void* q = bump.alloc(next);
+                memcpy(q, p, size);
+                p = q;
+            }
+            size = next;
+        }
+    }
+    double cursor = nsPerOp(start, rounds * steps * buffers);
+
+    printf("%12s %8zu %10zu %14.1f %14.1f %14.1f %10.2f\n", pattern, buffers, limit, managed, heap, cursor, inPlace);
+    report(string("realloc/") + pattern + "/" + to_string(buffers) + "/" + to_string(limit),
+        { { "allocator_ns", managed }, { "realloc_ns", heap }, { "bump_ns", cursor }, { "in_place", inPlace } });
+}
+
+/**
+ * Small objects with and without the slab tier: arena bytes per live object
+ * (nodes, slabs and pointer slots) and alloc+free throughput with 100k live.
+ */
+static void benchSmall(size_t size)
+{
+    const size_t live = 100000, ops = 1000000;
+    double bytes[2], ns[2];
+    for (int slabs = 0; slabs < 2; slabs++) {
+        vector<char> arena(live * (size + overhead) + (1 << 20));
+        AllocatorOptions options;
+        options.layout = AllocatorLayout::BoundaryTags; // O(1) node frees
+        options.small_slabs = slabs;
+        Allocator a(arena.data(), arena.size(), options);
+
+        vector<Pointer> ptrs;
+        for (size_t i = 0; i < live; i++) {
+            ptrs.push_back(a.alloc(size));
+        }
+        AllocatorStats stats = a.stats();
+        bytes[slabs] = double(stats.heap_bytes - stats.wilderness + stats.slots * sizeof(AllocatorSlot)) / live;
+
+        srand(4);
+        Clock::time_point start = Clock::now();
+        for (size_t i = 0; i < ops; i++) {
+            Pointer& p = ptrs[rand() % live];
+            a.free(p);
+            p = a.alloc(size);
+        }
+        ns[slabs] = nsPerOp(start, ops);
+    }
+    printf("%12zu %14.1f %14.1f %14.1f %14.1f\n", size, bytes[0], bytes[1], ns[0], ns[1]);
+    report("small/" + to_string(size),
+        { { "node_bytes_per_obj", bytes[0] }, { "slab_bytes_per_obj", bytes[1] }, { "node_ns", ns[0] }, { "slab_ns", ns[1] } });
+}
+
+/**
+ * Request scoped batches: 256 small blocks allocated and freed together on top
+ * of `live` long lived ones, one call per block vs alloc_many/free_many.
+ */
+static void benchBatch(size_t live, AllocatorLayout layout)
+{
+    const size_t batch = 256, rounds = 200;
+    vector<char> arena(live * (64 + overhead) + batch * (256 + overhead) + 4096);
+    AllocatorOptions options;
+    options.layout = layout;
+    Allocator a(arena.data(), arena.size(), options);
+
+    vector<Pointer> background;
+    for (size_t i = 0; i < live; i++) {
+        background.push_back(a.alloc(64));
+    }
+    vector<size_t> sizes(batch);
+    srand(3);
+    for (size_t& size : sizes) {
+        size = 8 + rand() % 248;
+    }
+    vector<Pointer> ptrs(batch);
+
+    Clock::time_point start = Clock::now();
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < batch; i++) {
+            ptrs[i] = a.alloc(sizes[i]);
+        }
+        for (Pointer& p : ptrs) {
+            a.free(p);
+        }
+    }
+    double single = nsPerOp(start, rounds * batch);
+
+    start = Clock::now();
+    for (size_t r = 0; r < rounds; r++) {
+        a.alloc_many(sizes.data(), batch, ptrs.data());
+        a.free_many(ptrs.data(), batch);
+    }
+    double many = nsPerOp(start, rounds * batch);
+
+    const char* name = layout == AllocatorLayout::Compact ? "compact" : "tags";
+    printf("%12zu %10s %14.1f %14.1f\n", live, name, single, many);
+    report(string("batch/") + name + "/" + to_string(live), { { "single_ns", single }, { "batch_ns", many } });
+}
+
+/**
+ * Pause of a full defrag() vs the longest defrag_step() of an incremental pass
+ * over the same heap (every other block freed). The arena is sized to fit the
+ * blocks, so the cost grows with the arena.
+ */
+static void benchDefrag(size_t live)
+{
+    const size_t blockSize = 64, stepBytes = 64 * 1024;
+    vector<char> arena(live * (blockSize + overhead) + 64);
+    double full = 0, maxStep = 0, total = 0;
+    size_t steps = 0;
+
+    AllocatorOptions options;
+    options.layout = AllocatorLayout::BoundaryTags; // O(1) frees while punching holes
+
+    for (int incremental = 0; incremental < 2; incremental++) {
+        Allocator a(arena.data(), arena.size(), options);
+        vector<Pointer> ptrs;
+        for (size_t i = 0; i < live; i++) {
+            ptrs.push_back(a.alloc(blockSize));
+        }
+        for (size_t i = 0; i < live; i += 2) {
+            a.free(ptrs[i]);
+        }
+
+        if (!incremental) {
+            Clock::time_point start = Clock::now();
+            a.defrag();
+            full = nsPerOp(start, 1) / 1e3;
+            continue;
+        }
+
+        for (;;) {
+            Clock::time_point start = Clock::now();
+            size_t moved = a.defrag_step(stepBytes);
+            double us = nsPerOp(start, 1) / 1e3;
+            if (!moved) {
+                break;
+            }
+            maxStep = max(maxStep, us);
+            total += us;
+            steps++;
+        }
+    }
+
+    printf("%12zu %12zu %14.1f %10zu %14.1f %14.1f\n", live, arena.size() >> 10, full, steps, maxStep, total);
+    report("defrag/" + to_string(live), { { "arena_bytes", (double)arena.size() }, { "full_us", full }, { "steps", (double)steps },
+                                            { "max_step_us", maxStep }, { "steps_us", total } });
+}
+
+/**
+ * Small object churn from `threads` threads: each keeps 64 live blocks of
+ * 16..256 bytes and replaces a random one per iteration. Reports Mops/s of the
+ * whole process for ConcurrentAllocator and for Allocator behind one mutex.
+ */
+template <class Heap, class Alloc, class Free>
+static double churnThreads(Heap& heap, size_t threads, Alloc alloc, Free release)
+{
+    const size_t ops = 200000, live = 64;
+    vector<thread> workers;
+    Clock::time_point start = Clock::now();
+    for (size_t t = 0; t < threads; t++) {
+        workers.emplace_back([&, t] {
+            mt19937 rnd(t);
+            vector<Pointer> ptrs;
+            for (size_t i = 0; i < live; i++) {
+                ptrs.push_back(alloc(heap, 16 + rnd() % 241));
+            }
+            for (size_t i = 0; i < ops; i++) {
+                Pointer& p = ptrs[rnd() % live];
+                release(heap, p);
+                p = alloc(heap, 16 + rnd() % 241);
+            }
+            for (Pointer& p : ptrs) {
+                release(heap, p);
+            }
+        });
+    }
+    for (thread& w : workers) {
+        w.join();
+    }
+    return 2 * ops * threads / nsPerOp(start, 1) * 1e3;
+}
+
+struct LockedAllocator {
+    mutex lock;
+    Allocator allocator;
+    LockedAllocator(void* base, size_t size) : allocator(base, size) {}
+};
+
+static void benchThreads(size_t threads)
+{
+    vector<char> arena(64 << 20);
+
+    ConcurrentAllocator concurrent(arena.data(), arena.size());
+    double magazines = churnThreads(concurrent, threads,
+        [](ConcurrentAllocator& h, size_t n) { return h.alloc(n); },
+        [](ConcurrentAllocator& h, Pointer& p) { h.free(p); });
+
+    LockedAllocator locked(arena.data(), arena.size());
+    double mutex = churnThreads(locked, threads,
+        [](LockedAllocator& h, size_t n) { lock_guard<std::mutex> g(h.lock); return h.allocator.alloc(n); },
+        [](LockedAllocator& h, Pointer& p) { lock_guard<std::mutex> g(h.lock); h.allocator.free(p); });
+
+    printf("%12zu %16.2f %16.2f\n", threads, magazines, mutex);
+    report("threads/" + to_string(threads), { { "magazine_mops", magazines }, { "mutex_mops", mutex } });
+}
+
+struct SyntheticOp {
+    size_t id; // index of the live pointer
+    size_t size; // 0 for free
+};
+
+/**
+ * Synthetic alloc/free trace: mostly small short lived blocks mixed with
+ * medium and a few large ones, live/2..live blocks live at once.
+ */
+static vector<SyntheticOp> makeTrace(size_t live, size_t ops)
+{
+    mt19937 rnd(4);
+    vector<SyntheticOp> trace;
+    vector<size_t> ids, vacant;
+    size_t next = 0;
+    for (size_t i = 0; i < ops; i++) {
+        if (ids.size() < live / 2 || (ids.size() < live && rnd() % 2)) {
+            size_t kind = rnd() % 100;
+            size_t size = kind < 70 ? 16 + rnd() % 112 : kind < 97 ? 128 + rnd() % 1920 : 4096 + rnd() % 61440;
+            size_t id = next++;
+            if (!vacant.empty()) {
+                id = vacant.back();
+                vacant.pop_back();
+                next--;
+            }
+            trace.push_back({ id, size });
+            ids.push_back(id);
+        } else {
+            // recent blocks die young
+            size_t k = rnd() % 4 ? ids.size() - 1 - rnd() % min<size_t>(ids.size(), 16) : rnd() % ids.size();
+            trace.push_back({ ids[k], 0 });
+            vacant.push_back(ids[k]);
+            ids.erase(ids.begin() + k);
+        }
+    }
+    return trace;
+}
+
+/**
+ * Replays the trace: returns ns per op, counts failed allocs. With `stats`
+ * also samples the heap footprint (used part below the wilderness) and
+ * fragmentation every 64 ops, which is too slow for the timed run.
+ */
+static double replay(Allocator& a, const vector<SyntheticOp>& trace, size_t& failed, AllocatorStats* stats, size_t* footprint, double* fragmentation)
+{
+    vector<Pointer> ptrs(trace.size());
+    size_t samples = 0;
+    failed = 0;
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < trace.size(); i++) {
+        const SyntheticOp& op = trace[i];
+        if (op.size) {
+            try {
+                ptrs[op.id] = a.alloc(op.size);
+            } catch (AllocError&) {
+                failed++;
+            }
+        } else {
+            a.free(ptrs[op.id]);
+        }
+        if (stats && i % 64 == 0) {
+            *stats = a.stats();
+            *footprint = max(*footprint, stats->heap_bytes - stats->wilderness);
+            *fragmentation += stats->fragmentation;
+            samples++;
+        }
+    }
+    double ns = nsPerOp(start, trace.size());
+    if (stats) {
+        *fragmentation /= samples;
+    }
+    for (Pointer& p : ptrs) {
+        a.free(p);
+    }
+    return ns;
+}
+
+static void benchPlacement(const vector<SyntheticOp>& trace, size_t live, size_t arenaSize, const char* name, AllocatorOptions options)
+{
+    vector<char> arena(arenaSize);
+    options.layout = AllocatorLayout::BoundaryTags;
+    size_t failed, footprint = 0;
+    double fragmentation = 0;
+    AllocatorStats stats;
+    double ns;
+    {
+        Allocator a(arena.data(), arena.size(), options);
+        ns = replay(a, trace, failed, nullptr, nullptr, nullptr);
+    }
+    {
+        Allocator a(arena.data(), arena.size(), options);
+        replay(a, trace, failed, &stats, &footprint, &fragmentation);
+    }
+    printf("%14s %12.1f %14zu %14.3f %10zu\n", name, ns, footprint >> 10, fragmentation, failed);
+    report(string("placement/") + name + "/" + to_string(live),
+        { { "ns", ns }, { "peak_used_bytes", (double)footprint }, { "avg_fragmentation", fragmentation }, { "failed", (double)failed } });
+}
+
+static void benchPlacements(size_t live)
+{
+    vector<SyntheticOp> trace = makeTrace(live, 20 * live);
+    // tight enough for the worse policies to run out of space
+    size_t arenaSize = live * 1536;
+
+    struct {
+        const char* name;
+        AllocatorPlacement placement;
+        size_t large;
+        bool defrag;
+    } policies[] = {
+        { "good_fit", AllocatorPlacement::GoodFit, 0, false },
+        { "first_fit", AllocatorPlacement::FirstFit, 0, false },
+        { "next_fit", AllocatorPlacement::NextFit, 0, false },
+        { "best_fit", AllocatorPlacement::BestFit, 0, false },
+        { "good_fit+large", AllocatorPlacement::GoodFit, 4096, false },
+        { "best_fit+large", AllocatorPlacement::BestFit, 4096, false },
+        { "good_fit+defrag", AllocatorPlacement::GoodFit, 0, true },
+    };
+    printf("\n%zu live blocks, %zu ops, %zu KB arena\n", live, trace.size(), arenaSize >> 10);
+    printf("%14s %12s %14s %14s %10s\n", "policy", "ns/op", "peak_used_KB", "avg_frag", "failed");
+    for (auto& policy : policies) {
+        AllocatorOptions options;
+        options.placement = policy.placement;
+        options.large_threshold = policy.large;
+        options.defrag_on_failure = policy.defrag;
+        benchPlacement(trace, live, arenaSize, policy.name, options);
+    }
+}
+
+/**
+ * Container heavy workloads on AllocatorResource vs the default heap
+ * (new_delete_resource), the same pmr code runs on both.
+ */
+static double vectorPushBack(std::pmr::memory_resource* resource, size_t n)
+{
+    Clock::time_point start = Clock::now();
+    for (int round = 0; round < 10; round++) {
+        std::pmr::vector<size_t> v(resource);
+        for (size_t i = 0; i < n; i++) {
+            v.push_back(i);
+        }
+    }
+    return nsPerOp(start, 10 * n);
+}
+
+static double stringChurn(std::pmr::memory_resource* resource, size_t n)
+{
+    std::pmr::vector<std::pmr::string> strings(resource);
+    strings.reserve(n);
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < n; i++) {
+        strings.emplace_back("a string that does not fit the small buffer");
+        strings.back() += to_string(i).c_str();
+    }
+    for (size_t i = 0; i < n; i += 2) {
+        strings[i] = std::pmr::string(resource);
+    }
+    for (size_t i = 0; i < n; i += 2) {
+        strings[i] = strings[i + 1];
+    }
+    return nsPerOp(start, 2 * n);
+}
+
+static double mapChurn(std::pmr::memory_resource* resource, size_t n)
+{
+    std::pmr::map<size_t, size_t> m(resource);
+    srand(3);
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < 4 * n; i++) {
+        size_t key = rand() % n;
+        if (i % 3 == 2) {
+            m.erase(key);
+        } else {
+            m[key] = i;
+        }
+    }
+    return nsPerOp(start, 4 * n);
+}
+
+static void benchContainers(size_t n)
+{
+    vector<char> arena(n * 256);
+    AllocatorOptions options;
+    options.layout = AllocatorLayout::BoundaryTags;
+
+    double (*workloads[])(std::pmr::memory_resource*, size_t) = { vectorPushBack, stringChurn, mapChurn };
+    const char* names[] = { "vector", "string", "map" };
+    for (size_t w = 0; w < 3; w++) {
+        Allocator a(arena.data(), arena.size(), options);
+        AllocatorResource resource(a);
+        double managed = workloads[w](&resource, n);
+        double heap = workloads[w](std::pmr::new_delete_resource(), n);
+        printf("%12s %12zu %14.1f %14.1f\n", names[w], n, managed, heap);
+        report(string("containers/") + names[w] + "/" + to_string(n), { { "arena_ns", managed }, { "heap_ns", heap } });
+    }
+}
+
+/**
+ *   allocator_bench [--json FILE] [--filter SECTION] [max_live]
+ *     --json FILE       also write the results as google benchmark style JSON
+ *     --filter SECTION  run the sections whose name contains SECTION only
+ *     max_live          upper bound of the live blocks sweeps, 1000000 by default
+ */
+static const char* filter = nullptr;
+
+static bool section(const char* name)
+{
+    return filter == nullptr || strstr(name, filter) != nullptr;
+}
+
+int main(int argc, char** argv)
+{
+    size_t maxLive = 1000000;
+    const char* json = nullptr;
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--json" && i + 1 < argc) {
+            json = argv[++i];
+        } else if (arg == "--filter" && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (arg[0] != '-') {
+            maxLive = strtoull(argv[i], nullptr, 10);
+        } else {
+            fprintf(stderr, "usage: allocator_bench [--json FILE] [--filter SECTION] [max_live]\n");
+            return 2;
+        }
+    }
+    if (section("find_free")) {
+        printf("%12s %14s %14s\n", "live_blocks", "miss_ns/alloc", "hit_ns/alloc");
+        for (size_t live = 100; live <= maxLive; live *= 10) {
+            benchFindFree(live);
+        }
+    }
+
+    if (section("slots")) {
+        printf("\n%12s %14s\n", "live_slots", "ns/alloc+free");
+        for (size_t live = 100; live <= maxLive; live *= 10) {
+            benchSlots(live);
+        }
+    }
+
+    // Compact layout frees are O(n), so its sweep stops early
+    if (section("free")) {
+        printf("\n%12s %16s %16s\n", "live_blocks", "compact_Mfree/s", "tags_Mfree/s");
+        for (size_t live = 100; live <= maxLive; live *= 10) {
+            double tags = benchFree(live, AllocatorLayout::BoundaryTags);
+            if (live <= 10000) {
+                double compact = benchFree(live, AllocatorLayout::Compact);
+                printf("%12zu %16.2f %16.2f\n", live, compact, tags);
+                report("free/" + to_string(live), { { "compact_mfree", compact }, { "tags_mfree", tags } });
+            } else {
+                printf("%12zu %16s %16.2f\n", live, "-", tags);
+                report("free/" + to_string(live), { { "tags_mfree", tags } });
+            }
+        }
+    }
+
+    // 2 KB per live block of arena, so the sweep stops at 100k
+    if (section("churn")) {
+        printf("\n%12s %14s %14s %14s %14s\n", "live_blocks", "allocator_ns", "malloc_ns", "bump_ns", "fragmentation");
+        for (size_t live = 100; live <= min<size_t>(maxLive, 100000); live *= 10) {
+            benchChurn(live);
+        }
+    }
+
+    if (section("realloc")) {
+        printf("\n%12s %8s %10s %14s %14s %14s %10s\n", "pattern", "buffers", "limit", "allocator_ns", "realloc_ns",
+            "bump_ns", "in_place");
+        for (size_t buffers = 1; buffers <= 16; buffers *= 4) {
+            benchRealloc("append", buffers, 64 << 10);
+            benchRealloc("double", buffers, 1 << 20);
+        }
+    }
+
+    if (section("small")) {
+        printf("\n%12s %14s %14s %14s %14s\n", "object_size", "node_B/obj", "slab_B/obj", "node_ns/op", "slab_ns/op");
+        for (size_t size = 8; size <= 64; size *= 2) {
+            benchSmall(size);
+        }
+    }
+
+    // The Compact layout single frees walk the heap, so its sweep stops early
+    if (section("batch")) {
+        printf("\n%12s %10s %14s %14s\n", "live_blocks", "layout", "single_ns/obj", "batch_ns/obj");
+        for (size_t live = 100; live <= maxLive; live *= 10) {
+            if (live <= 10000) {
+                benchBatch(live, AllocatorLayout::Compact);
+            }
+            benchBatch(live, AllocatorLayout::BoundaryTags);
+        }
+    }
+
+    if (section("defrag")) {
+        printf("\n%12s %12s %14s %10s %14s %14s\n", "live_blocks", "arena_KB", "full_us", "steps", "max_step_us", "steps_us");
+        for (size_t live = 100; live <= maxLive; live *= 10) {
+            benchDefrag(live);
+        }
+    }
+
+    // first/next fit walk the heap, larger traces take minutes
+    if (section("placement")) {
+        for (size_t live = 1000; live <= min<size_t>(maxLive / 10, 10000); live *= 10) {
+            benchPlacements(live);
+        }
+    }
+
+    if (section("containers")) {
+        printf("\n%12s %12s %14s %14s\n", "container", "elements", "arena_ns/op", "heap_ns/op");
+        for (size_t n = 1000; n <= maxLive; n *= 10) {
+            benchContainers(n);
+        }
+    }
+
+    if (section("threads")) {
+        printf("\n%12s %16s %16s\n", "threads", "magazine_Mops/s", "mutex_Mops/s");
+        for (size_t threads = 1; threads <= 16; threads *= 2) {
+            benchThreads(threads);
+        }
+    }
+
+    if (json) {
+        writeJson(json, argv[0], maxLive);
+    }
+    return 0;
+}
@@ -3,7 +3,9 @@
 
 #include <stdexcept>
 
-enum class AllocErrorType { NoMemory, Internal, InvalidOperation };
+// BadFile: an allocator file that can't be reattached, see
+// AllocatorOptions::reset_bad_file
+enum class AllocErrorType { NoMemory, Internal, InvalidOperation, BadFile };
 
 class AllocError : std::runtime_error {
 private:
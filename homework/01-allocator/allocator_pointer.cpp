@@ -1,18 +1,58 @@
 #include "allocator_pointer.h"
 #include "allocator.h"
 #include "allocator_error.h"
+#include <cstdio>
+#include <cstdlib>
 
-Pointer::Pointer() : inner_ptr(nullptr) {}
+Pointer::Pin::Pin(AllocatorSlot *slot, void *ptr)
+    : slot(slot), count(nullptr), ptr(ptr) {}
+
+Pointer::Pin::Pin(unsigned char *count, void *ptr)
+    : slot(nullptr), count(count), ptr(ptr) {}
+
+Pointer::Pin::Pin(Pin &&that) : slot(that.slot), count(that.count), ptr(that.ptr) {
+  that.slot = nullptr;
+  that.count = nullptr;
+  that.ptr = nullptr;
+}
+
+Pointer::Pin::~Pin() {
+  if (slot != nullptr)
+    slot->unpin();
+  if (count != nullptr)
+    __atomic_sub_fetch(count, 1, __ATOMIC_RELEASE);
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+
+Pointer::Pointer() : inner_ptr(nullptr), generation(0) {}
 
 void *Pointer::get() const {
   if (inner_ptr == nullptr)
     return nullptr;
 
-  if (*inner_ptr == nullptr || !(*inner_ptr)->usage()) {
-    throw AllocError(AllocErrorType::InvalidOperation,
-                     "possibly it's ptr.get() after free(ptr)");
-  }
-  return *inner_ptr + 1;
+  if (small())
+    return Allocator::slab_object(*this, "possibly it's ptr.get() after free(ptr)");
+
+  if (__builtin_expect(
+          __atomic_load_n(&inner_ptr->generation, __ATOMIC_ACQUIRE) != generation, 0))
+    stale("possibly it's ptr.get() after free(ptr)");
+
+  return inner_ptr->node->data();
 }
 
-Pointer::Pointer(AllocatorNode **ptr) : inner_ptr(ptr) {}
\ No newline at end of file
+Pointer::Pointer(AllocatorSlot *ptr)
+    : inner_ptr(ptr), generation(ptr ? ptr->generation : 0) {}
+
+Pointer::Pointer(AllocatorSlot *slab, size_t generation)
+    : inner_ptr((AllocatorSlot *)((size_t)slab | small_tag)),
+      generation(generation) {}
+
+void Pointer::stale(const char *what) {
+#ifdef ALLOCATOR_STALE_ABORT
+  fprintf(stderr, "stale Pointer: %s\n", what);
+  abort();
+#else
+  throw AllocError(AllocErrorType::InvalidOperation, what);
+#endif
+}
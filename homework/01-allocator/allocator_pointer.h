@@ -1,21 +1,81 @@
 #ifndef ALLOCATOR_POINTER
 #define ALLOCATOR_POINTER
+#include <cstddef>
 
 // Forward declaration. Do not include real class definition
 // to avoid expensive macros calculations and increase compile speed
 class Allocator;
-class AllocatorNode;
+class ConcurrentAllocator;
+struct AllocatorSlot;
 
+/**
+ * Handle of an Allocator node. A stale handle (its node was freed, even if the
+ * slot serves another node since) is detected in O(1) by get(), free(), realloc(),
+ * size() and Allocator::pin(): both the handle and the slot keep a generation.
+ *
+ * A small object handle (AllocatorOptions::small_slabs) is checked against the
+ * slot of its slab first, so a freed slab is never read, then against an 8 bit
+ * tag of the object in the slab: only a handle of an object that was freed
+ * and taken again a multiple of 256 times passes.
+ *
+ * It throws AllocError(InvalidOperation). Built with -DALLOCATOR_STALE_ABORT it
+ * reports to stderr and aborts instead, so the checks may stay on in release
+ * builds without any exception path behind them.
+ */
 class Pointer {
   friend class Allocator;
+  friend class ConcurrentAllocator;
 
 public:
+  /**
+   * Scoped access to the node memory, see Allocator::pin. While it lives the
+   * node is pinned: defrag passes it by and realloc/free of it fail, so get()
+   * stays valid. A small object keeps a pin count of its own in the slab, up
+   * to 255 pins; realloc of it fails only when it has to move.
+   */
+  class Pin {
+  public:
+    Pin(Pin &&that);
+    Pin(const Pin &) = delete;
+    Pin &operator=(const Pin &) = delete;
+    ~Pin();
+
+    void *get() const { return ptr; }
+
+  private:
+    friend class Allocator;
+    // slot or the small object count is pinned already
+    Pin(AllocatorSlot *slot, void *ptr);
+    Pin(unsigned char *count, void *ptr);
+
+    AllocatorSlot *slot;
+    unsigned char *count; // small objects
+    void *ptr;
+  };
+
   Pointer();
+
+  /**
+   * Raw address of the node memory, valid until the next defrag/realloc
+   */
   void *get() const;
 
 private:
-  Pointer(AllocatorNode **inner_ptr);
-  AllocatorNode **inner_ptr;
+  // Small objects (see AllocatorOptions::small_slabs) take no slot of their
+  // own: the pointer holds the slot of their slab tagged with the low bit,
+  // the generation packs the object index and tag (see Allocator::slab_of)
+  static constexpr size_t small_tag = 1;
+
+  Pointer(AllocatorSlot *inner_ptr);
+  Pointer(AllocatorSlot *slab, size_t generation); // small object
+  bool small() const { return (size_t)inner_ptr & small_tag; }
+
+  // Throws or aborts (ALLOCATOR_STALE_ABORT), out of line off the fast paths
+  [[noreturn]] __attribute__((cold, noinline)) static void
+  stale(const char *what);
+
+  AllocatorSlot *inner_ptr;
+  size_t generation; // of the slot as of the alloc
 };
 
 #endif // ALLOCATOR_POINTER
@@ -0,0 +1,378 @@
+#include "allocator.h"
+#include "allocator_error.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <malloc.h>
+#include <mutex>
+#include <new>
+#include <sys/resource.h>
+#include <unistd.h>
+
+/**
+ * malloc interposer: an unmodified program gets its heap from Allocator raw
+ * (non relocating) nodes.
+ *
+ *   make allocator_preload.so
+ *   LD_PRELOAD=./allocator_preload.so ls -l
+ *
+ * `make preload.done` runs allocator_preload_check.cpp under it.
+ *
+ * Every thread takes one of max_arenas reserved (mmap) arenas round robin and
+ * keeps allocating there, so threads don't contend unless there are more of
+ * them than arenas. free() finds the arena by address, a node freed by
+ * another thread goes back to its own arena. An arena that runs out of room
+ * is passed over to the next one.
+ *
+ * Counters, peak RSS and Allocator::stats() of every arena are written at
+ * exit to stderr or appended to the file named by ALLOCATOR_PRELOAD_STATS
+ * (nothing if it is empty), one block per process. Programs that close
+ * stderr at exit (coreutils) need the file. ALLOCATOR_PRELOAD_ARENA sets the
+ * arena reserve in bytes.
+ *
+ * Allocator may call malloc itself (exceptions, pthread_atfork), such nested
+ * calls are served by a small bump area that is never freed.
+ */
+
+namespace {
+
+constexpr size_t max_arenas = 64;
+constexpr size_t default_reserve = size_t(64) << 30;
+constexpr size_t malloc_alignment = 16; // alignof(max_align_t)
+constexpr size_t bootstrap_bytes = 256 * 1024;
+
+enum Call { Malloc, Calloc, Realloc, Memalign, Free, call_count };
+const char *call_names[call_count] = {"malloc", "calloc", "realloc",
+                                      "memalign", "free"};
+
+struct Arena {
+  std::mutex lock;
+  Allocator allocator;
+  size_t calls[call_count];
+
+  Arena(size_t size, const AllocatorOptions &options)
+      : allocator(size, options), calls() {}
+};
+
+alignas(Arena) char arena_storage[max_arenas][sizeof(Arena)];
+std::atomic<Arena *> arenas[max_arenas];
+std::mutex arenas_lock;
+std::atomic<size_t> threads(0);
+
+alignas(malloc_alignment) char bootstrap[bootstrap_bytes];
+std::atomic<size_t> bootstrap_used(0);
+
+std::atomic<size_t> foreign_frees(0); // not ours, or freed by a nested call
+std::atomic<size_t> failures(0);
+
+thread_local size_t home __attribute__((tls_model("initial-exec"))) = ~size_t(0);
+thread_local bool busy __attribute__((tls_model("initial-exec"))) = false;
+
+// Marks the calling thread as inside the allocator, see bootstrap
+struct Busy {
+  Busy() { busy = true; }
+  ~Busy() { busy = false; }
+};
+
+// Request size with the node data kept 16 byte aligned: with BoundaryTags
+// a node of N = 16k + 8 bytes takes 2k + 4 words, so nodes cut one after
+// another from the 16 byte aligned heap start all have aligned data
+size_t request(size_t N) { return ((N + 7) & ~size_t(15)) + 8; }
+
+void *bootstrap_alloc(size_t N, size_t alignment) {
+  alignment = std::max(alignment, malloc_alignment);
+  size_t used = bootstrap_used.load(std::memory_order_relaxed);
+  size_t start, end;
+  do {
+    // the size is kept in the word in front of the data
+    start = (used + sizeof(size_t) + alignment - 1) & ~(alignment - 1);
+    end = start + N;
+    if (N > bootstrap_bytes || end > bootstrap_bytes) {
+      return nullptr;
+    }
+  } while (!bootstrap_used.compare_exchange_weak(used, end));
+  ((size_t *)(bootstrap + start))[-1] = N;
+  return bootstrap + start;
+}
+
+bool in_bootstrap(const void *p) {
+  return (char *)p >= bootstrap && (char *)p < bootstrap + bootstrap_bytes;
+}
+
+Arena *arena(size_t i) {
+  Arena *found = arenas[i].load(std::memory_order_acquire);
+  if (found != nullptr) {
+    return found;
+  }
+
+  std::lock_guard<std::mutex> guard(arenas_lock);
+  found = arenas[i].load(std::memory_order_relaxed);
+  if (found == nullptr) {
+    const char *env = getenv("ALLOCATOR_PRELOAD_ARENA");
+    size_t size = env ? strtoull(env, nullptr, 10) : default_reserve;
+    size = std::max(size, 2 * Allocator::commit_step);
+    size -= size % Allocator::commit_step;
+
+    AllocatorOptions options;
+    options.layout = AllocatorLayout::BoundaryTags; // O(1) free
+    try {
+      found = new (arena_storage[i]) Arena(size, options);
+    } catch (AllocError &) {
+      return nullptr;
+    }
+    arenas[i].store(found, std::memory_order_release);
+  }
+  return found;
+}
+
+Arena *owner(const void *p) {
+  if (home < max_arenas) {
+    Arena *local = arenas[home].load(std::memory_order_acquire);
+    if (local != nullptr && local->allocator.owns(p)) {
+      return local;
+    }
+  }
+  for (size_t i = 0; i < max_arenas; i++) {
+    Arena *found = arenas[i].load(std::memory_order_acquire);
+    if (found != nullptr && found->allocator.owns(p)) {
+      return found;
+    }
+  }
+  return nullptr;
+}
+
+void *allocate(size_t N, size_t alignment, Call call) {
+  if (busy) {
+    return bootstrap_alloc(N, alignment);
+  }
+
+  Busy guard;
+  if (home >= max_arenas) {
+    home = threads++ % max_arenas;
+  }
+  size_t bytes = request(N);
+  for (size_t k = 0; k < max_arenas; k++) {
+    size_t i = (home + k) % max_arenas;
+    Arena *target = arena(i);
+    if (target == nullptr) {
+      break;
+    }
+
+    std::lock_guard<std::mutex> lock(target->lock);
+    try {
+      void *p = target->allocator.alloc_raw(
+          bytes, alignment > malloc_alignment ? alignment : sizeof(size_t));
+      if ((size_t)p % malloc_alignment) { // see request(), not expected
+        target->allocator.free_raw(p);
+        p = target->allocator.alloc_raw(bytes, malloc_alignment);
+      }
+      ++target->calls[call];
+      home = i;
+      return p;
+    } catch (AllocError &) {
+      // try the next arena
+    }
+  }
+  ++failures;
+  errno = ENOMEM;
+  return nullptr;
+}
+
+void deallocate(void *p) {
+  if (p == nullptr || in_bootstrap(p)) {
+    return;
+  }
+  Arena *target = busy ? nullptr : owner(p);
+  if (target == nullptr) {
+    ++foreign_frees;
+    return;
+  }
+
+  Busy guard;
+  std::lock_guard<std::mutex> lock(target->lock);
+  try {
+    target->allocator.free_raw(p);
+    ++target->calls[Free];
+  } catch (AllocError &) {
+    ++foreign_frees;
+  }
+}
+
+// 0 for memory that isn't ours
+size_t usable_size(void *p) {
+  if (p == nullptr) {
+    return 0;
+  }
+  if (in_bootstrap(p)) {
+    return ((size_t *)p)[-1];
+  }
+  Arena *target = owner(p);
+  return target ? target->allocator.size_raw(p) : 0;
+}
+
+void *aligned(size_t alignment, size_t N) {
+  if (alignment == 0 || (alignment & (alignment - 1))) {
+    errno = EINVAL;
+    return nullptr;
+  }
+  return allocate(N, alignment, Memalign);
+}
+
+// Locks every arena around fork(), so the child doesn't inherit a lock taken
+// by a thread it doesn't have
+void fork_prepare() {
+  arenas_lock.lock();
+  for (size_t i = 0; i < max_arenas; i++) {
+    if (Arena *found = arenas[i].load()) {
+      found->lock.lock();
+    }
+  }
+}
+
+void fork_release() {
+  for (size_t i = max_arenas; i-- > 0;) {
+    if (Arena *found = arenas[i].load()) {
+      found->lock.unlock();
+    }
+  }
+  arenas_lock.unlock();
+}
+
+__attribute__((constructor)) void init() {
+  pthread_atfork(fork_prepare, fork_release, fork_release);
+}
+
+__attribute__((destructor)) void report() {
+  const char *path = getenv("ALLOCATOR_PRELOAD_STATS");
+  if (path != nullptr && *path == 0) {
+    return;
+  }
+  FILE *out = path ? fopen(path, "a") : stderr;
+  if (out == nullptr) {
+    return;
+  }
+
+  // Snapshots are taken under the lock, formatted outside of it: formatting
+  // allocates
+  size_t totals[call_count] = {};
+  AllocatorStats stats[max_arenas];
+  size_t used[max_arenas] = {};
+  size_t count = 0, committed = 0;
+  for (size_t i = 0; i < max_arenas; i++) {
+    Arena *found = arenas[i].load();
+    if (found == nullptr) {
+      continue;
+    }
+    std::lock_guard<std::mutex> lock(found->lock);
+    stats[count] = found->allocator.stats();
+    for (size_t c = 0; c < call_count; c++) {
+      totals[c] += found->calls[c];
+    }
+    committed += stats[count].committed_bytes;
+    used[count++] = i;
+  }
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  fprintf(out, "allocator_preload pid %d\n", (int)getpid());
+  for (size_t c = 0; c < call_count; c++) {
+    fprintf(out, "%s %zu\n", call_names[c], totals[c]);
+  }
+  fprintf(out, "failures %zu\n", failures.load());
+  fprintf(out, "foreign_frees %zu\n", foreign_frees.load());
+  fprintf(out, "bootstrap_bytes %zu\n", bootstrap_used.load());
+  fprintf(out, "arenas %zu\n", count);
+  fprintf(out, "committed_bytes %zu\n", committed);
+  fprintf(out, "max_rss_kb %ld\n", usage.ru_maxrss);
+  for (size_t k = 0; k < count; k++) {
+    fprintf(out, "\narena %zu\n%s", used[k], stats[k].text().c_str());
+  }
+  if (out != stderr) {
+    fclose(out);
+  }
+}
+
+} // namespace
+
+extern "C" {
+
+void *malloc(size_t N) noexcept { return allocate(N, 0, Malloc); }
+
+void free(void *p) noexcept { deallocate(p); }
+
+void *calloc(size_t count, size_t size) noexcept {
+  size_t N;
+  if (__builtin_mul_overflow(count, size, &N)) {
+    errno = ENOMEM;
+    return nullptr;
+  }
+  void *p = allocate(N, 0, Calloc);
+  if (p != nullptr) {
+    memset(p, 0, N);
+  }
+  return p;
+}
+
+// Stays in place while the new size fits and takes at least half of the
+// node, otherwise moves
+void *realloc(void *p, size_t N) noexcept {
+  if (p == nullptr) {
+    return allocate(N, 0, Realloc);
+  }
+  if (N == 0) {
+    deallocate(p);
+    return nullptr;
+  }
+
+  size_t capacity = usable_size(p);
+  if (capacity == 0) {
+    errno = ENOMEM; // not ours, the size is unknown
+    return nullptr;
+  }
+  if (N <= capacity && N >= capacity / 2 && !in_bootstrap(p)) {
+    return p;
+  }
+  void *q = allocate(N, 0, Realloc);
+  if (q != nullptr) {
+    memcpy(q, p, std::min(N, capacity));
+    deallocate(p);
+  }
+  return q;
+}
+
+int posix_memalign(void **out, size_t alignment, size_t N) noexcept {
+  if (alignment % sizeof(void *)) {
+    return EINVAL;
+  }
+  int saved = errno;
+  void *p = aligned(alignment, N);
+  if (p == nullptr) {
+    int error = errno;
+    errno = saved;
+    return error;
+  }
+  *out = p;
+  return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t N) noexcept {
+  return aligned(alignment, N);
+}
+
+void *memalign(size_t alignment, size_t N) noexcept {
+  return aligned(alignment, N);
+}
+
+void *valloc(size_t N) noexcept { return aligned(getpagesize(), N); }
+
+void *pvalloc(size_t N) noexcept {
+  size_t page = getpagesize();
+  return aligned(page, (N + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void *p) noexcept { return usable_size(p); }
+
+} // extern "C"
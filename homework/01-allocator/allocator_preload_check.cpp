@@ -0,0 +1,192 @@
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <malloc.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * Exercises the malloc entry points allocator_preload.so replaces, run by
+ * `make preload.done` under LD_PRELOAD:
+ *
+ *   malloc/calloc/free with content checks, realloc growing and shrinking,
+ *   posix_memalign/aligned_alloc/memalign alignment, threads freeing each
+ *   other's blocks and fork() while other threads allocate.
+ *
+ * Prints "preload check ok" and exits with 0 if everything holds, the forked
+ * child writes its own exit report.
+ */
+
+namespace {
+
+std::atomic<size_t> errors(0);
+
+void check(bool ok, const char *what) {
+  if (!ok) {
+    fprintf(stderr, "preload check failed: %s\n", what);
+    ++errors;
+  }
+}
+
+void fill(void *p, size_t N, unsigned seed) {
+  for (size_t i = 0; i < N; i++) {
+    ((unsigned char *)p)[i] = (unsigned char)(seed + i);
+  }
+}
+
+bool filled(const void *p, size_t N, unsigned seed) {
+  for (size_t i = 0; i < N; i++) {
+    if (((const unsigned char *)p)[i] != (unsigned char)(seed + i)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool aligned_to(const void *p, size_t alignment) {
+  return (uintptr_t)p % alignment == 0;
+}
+
+void check_malloc() {
+  std::vector<void *> blocks;
+  for (size_t N = 0; N < 5000; N += 7) {
+    void *p = malloc(N);
+    check(p != nullptr, "malloc");
+    check(aligned_to(p, 16), "malloc alignment");
+    check(malloc_usable_size(p) >= N, "malloc_usable_size");
+    fill(p, N, N);
+    blocks.push_back(p);
+  }
+  for (size_t k = 0; k < blocks.size(); k++) {
+    check(filled(blocks[k], k * 7, k * 7), "malloc content");
+    free(blocks[k]);
+  }
+
+  unsigned char *zero = (unsigned char *)calloc(1000, 3);
+  check(zero != nullptr, "calloc");
+  for (size_t i = 0; zero && i < 3000; i++) {
+    check(zero[i] == 0, "calloc content");
+  }
+  free(zero);
+  free(nullptr);
+}
+
+void check_realloc() {
+  void *p = realloc(nullptr, 10);
+  check(p != nullptr, "realloc(nullptr)");
+  fill(p, 10, 1);
+  size_t N = 10;
+  for (size_t next = 17; next < 200000; next = next * 3 / 2) {
+    p = realloc(p, next);
+    check(p != nullptr, "realloc grow");
+    check(filled(p, N, 1), "realloc grow content");
+    fill(p, next, 1);
+    N = next;
+  }
+  for (size_t next = N / 3; next > 4; next /= 3) {
+    p = realloc(p, next);
+    check(p != nullptr, "realloc shrink");
+    check(filled(p, next, 1), "realloc shrink content");
+  }
+  free(p);
+}
+
+void check_aligned() {
+  for (size_t alignment = sizeof(void *); alignment <= 65536; alignment *= 2) {
+    void *p = nullptr;
+    check(posix_memalign(&p, alignment, 100) == 0, "posix_memalign");
+    check(aligned_to(p, alignment), "posix_memalign alignment");
+    fill(p, 100, 3);
+    void *q = aligned_alloc(alignment, alignment);
+    check(aligned_to(q, alignment), "aligned_alloc alignment");
+    void *r = memalign(alignment, 1);
+    check(aligned_to(r, alignment), "memalign alignment");
+    check(filled(p, 100, 3), "posix_memalign content");
+    free(r);
+    free(q);
+    free(p);
+  }
+  void *p = nullptr;
+  check(posix_memalign(&p, 3, 100) == EINVAL, "posix_memalign EINVAL");
+}
+
+// Every thread frees the blocks its neighbour allocated
+void check_threads() {
+  const size_t count = 8, rounds = 2000;
+  std::vector<std::atomic<void *>> mailbox(count);
+  std::vector<std::thread> workers;
+  for (size_t t = 0; t < count; t++) {
+    workers.emplace_back([t, &mailbox] {
+      for (size_t i = 0; i < rounds; i++) {
+        size_t N = 16 + (i * 37 + t * 101) % 3000;
+        void *p = malloc(N);
+        check(p != nullptr, "thread malloc");
+        fill(p, N, t);
+        ((size_t *)p)[0] = N;
+        void *prev = mailbox[t].exchange(p);
+        void *theirs = mailbox[(t + 1) % count].exchange(nullptr);
+        if (theirs != nullptr) {
+          size_t M = ((size_t *)theirs)[0];
+          check(M >= 16 && M < 3016, "thread block size");
+          theirs = realloc(theirs, M + 64);
+          check(theirs != nullptr, "thread realloc");
+          free(theirs);
+        }
+        free(prev);
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  for (auto &left : mailbox) {
+    free(left.load());
+  }
+}
+
+// The child must not inherit an arena lock held by a busy thread
+void check_fork() {
+  std::atomic<bool> stop(false);
+  std::thread busy([&stop] {
+    while (!stop) {
+      free(malloc(100));
+    }
+  });
+
+  for (size_t k = 0; k < 3; k++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      check_malloc();
+      check_realloc();
+      exit(errors ? 1 : 0); // exit, not _exit: the child writes its report
+    }
+    check(pid > 0, "fork");
+    int status = 0;
+    check(waitpid(pid, &status, 0) == pid, "waitpid");
+    check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "forked child");
+  }
+
+  stop = true;
+  busy.join();
+}
+
+} // namespace
+
+int main() {
+  check_malloc();
+  check_realloc();
+  check_aligned();
+  check_threads();
+  check_fork();
+  if (errors) {
+    printf("preload check failed: %zu errors\n", errors.load());
+    return 1;
+  }
+  printf("preload check ok\n");
+  return 0;
+}
@@ -0,0 +1,187 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "allocator.h"
+#include "allocator_error.h"
+#include "allocator_pointer.h"
+#include "allocator_trace.h"
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+/**
+ * Replays a trace recorded through AllocatorOptions::trace against Allocator
+ * and reports throughput, latency percentiles per op, peak footprint and
+ * fragmentation over time.
+ *
+ *   allocator_replay [options] trace
+ *     --arena BYTES          buffer size, the recorded one by default
+ *     --reserve              mmap reserved arena of that size instead of a buffer
+ *     --layout compact|tags  the recorded one by default
+ *     --placement good|first|next|best
+ *     --large BYTES          AllocatorOptions::large_threshold
+ *     --defrag-on-failure
+ *     --samples N            timeline rows, 20 by default
+ */
+
+static const char* opNames[] = { "init", "alloc", "alloc_fail", "realloc", "free", "defrag", "defrag_step" };
+static const size_t opCount = sizeof(opNames) / sizeof(opNames[0]);
+
+static void usage()
+{
+    fprintf(stderr, "usage: allocator_replay [--arena BYTES] [--reserve] [--layout compact|tags] "
+                    "[--placement good|first|next|best] [--large BYTES] "
+                    "[--defrag-on-failure] [--samples N] trace\n");
+    exit(2);
+}
+
+static double percentile(vector<double>& sorted, double p)
+{
+    return sorted[min(sorted.size() - 1, (size_t)(p * sorted.size()))];
+}
+
+int main(int argc, char** argv)
+{
+    AllocatorOptions options;
+    bool layoutSet = false, reserve = false;
+    size_t arenaSize = 0, samples = 20;
+    const char* path = nullptr;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--arena" && hasValue) {
+            arenaSize = strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--reserve") {
+            reserve = true;
+        } else if (arg == "--layout" && hasValue) {
+            string layout = argv[++i];
+            options.layout = layout == "tags" ? AllocatorLayout::BoundaryTags : AllocatorLayout::Compact;
+            layoutSet = true;
+        } else if (arg == "--placement" && hasValue) {
+            string placement = argv[++i];
+            options.placement = placement == "first" ? AllocatorPlacement::FirstFit
+                : placement == "next"                ? AllocatorPlacement::NextFit
+                : placement == "best"                ? AllocatorPlacement::BestFit
+                                                     : AllocatorPlacement::GoodFit;
+        } else if (arg == "--large" && hasValue) {
+            options.large_threshold = strtoull(argv[++i], nullptr, 10);
+        } else if (arg == "--defrag-on-failure") {
+            options.defrag_on_failure = true;
+        } else if (arg == "--samples" && hasValue) {
+            samples = max<size_t>(1, strtoull(argv[++i], nullptr, 10));
+        } else if (arg[0] != '-' && path == nullptr) {
+            path = argv[i];
+        } else {
+            usage();
+        }
+    }
+    if (path == nullptr) {
+        usage();
+    }
+
+    // The whole trace is loaded first, so file reads are not timed
+    vector<TraceRecord> trace;
+    try {
+        TraceReader reader(path);
+        TraceRecord record;
+        while (reader.next(record)) {
+            if (record.op == TraceOp::Init) {
+                arenaSize = arenaSize ? arenaSize : record.size;
+                if (!layoutSet) {
+                    options.layout = (AllocatorLayout)record.id;
+                }
+                continue;
+            }
+            trace.push_back(record);
+        }
+    } catch (AllocError&) {
+        fprintf(stderr, "can't read trace %s\n", path);
+        return 1;
+    }
+    if (arenaSize == 0) {
+        fprintf(stderr, "no buffer size recorded, use --arena\n");
+        return 1;
+    }
+
+    if (reserve) {
+        arenaSize = (arenaSize + Allocator::commit_step - 1) / Allocator::commit_step * Allocator::commit_step;
+    }
+    vector<char> arena(reserve ? 0 : arenaSize);
+    unique_ptr<Allocator> allocator(reserve ? new Allocator(arenaSize, options)
+                                            : new Allocator(arena.data(), arena.size(), options));
+    Allocator& a = *allocator;
+    vector<Pointer> ptrs, extra;
+    vector<double> latencies[opCount];
+    size_t failed = 0, peakFootprint = 0, peakCommitted = 0;
+    size_t every = max<size_t>(1, trace.size() / samples);
+    double total = 0;
+
+    printf("%12s %14s %14s %14s %14s\n", "op", "live_bytes", "footprint", "free_bytes", "fragmentation");
+    for (size_t i = 0; i < trace.size(); i++) {
+        const TraceRecord& record = trace[i];
+        if (record.id >= ptrs.size()) {
+            ptrs.resize(record.id + 1);
+        }
+
+        Clock::time_point start = Clock::now();
+        try {
+            switch (record.op) {
+            case TraceOp::Alloc:
+                ptrs[record.id] = a.alloc(record.size);
+                break;
+            case TraceOp::AllocFail: // may fit here, then it's kept till the end
+                extra.push_back(a.alloc(record.size));
+                break;
+            case TraceOp::Realloc:
+                a.realloc(ptrs[record.id], record.size);
+                break;
+            case TraceOp::Free:
+                a.free(ptrs[record.id]);
+                break;
+            case TraceOp::Defrag:
+                a.defrag();
+                break;
+            case TraceOp::DefragStep:
+                a.defrag_step(record.size);
+                break;
+            default:
+                break;
+            }
+        } catch (AllocError&) {
+            failed++;
+        }
+        double ns = chrono::duration<double, nano>(Clock::now() - start).count();
+        latencies[(size_t)record.op].push_back(ns);
+        total += ns;
+
+        AllocatorStats stats = a.stats();
+        peakFootprint = max(peakFootprint, stats.heap_bytes - stats.wilderness);
+        peakCommitted = max(peakCommitted, stats.committed_bytes);
+        if (i % every == 0 || i + 1 == trace.size()) {
+            printf("%12zu %14zu %14zu %14zu %14.3f\n", i, stats.live_bytes, stats.heap_bytes - stats.wilderness,
+                stats.free_bytes, stats.fragmentation);
+        }
+    }
+
+    printf("\n%zu ops, %.2f Mops/s, %zu failed, peak footprint %zu bytes of %zu, peak committed %zu\n",
+        trace.size(), trace.size() / total * 1e3, failed, peakFootprint, arenaSize, peakCommitted);
+    printf("\n%12s %10s %10s %10s %10s %10s %10s\n", "op", "count", "p50_ns", "p90_ns", "p99_ns", "p99.9_ns", "max_ns");
+    for (size_t op = 0; op < opCount; op++) {
+        vector<double>& sorted = latencies[op];
+        if (sorted.empty()) {
+            continue;
+        }
+        sort(sorted.begin(), sorted.end());
+        printf("%12s %10zu %10.0f %10.0f %10.0f %10.0f %10.0f\n", opNames[op], sorted.size(), percentile(sorted, 0.5),
+            percentile(sorted, 0.9), percentile(sorted, 0.99), percentile(sorted, 0.999), sorted.back());
+    }
+
+    printf("\n%s", a.dump().c_str());
+    return 0;
+}
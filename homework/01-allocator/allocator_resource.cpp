@@ -0,0 +1,25 @@
+#include "allocator_resource.h"
+#include "allocator_error.h"
+#include <algorithm>
+#include <new>
+
+void *AllocatorResource::do_allocate(size_t bytes, size_t alignment) {
+  try {
+    return allocator.alloc_raw(std::max<size_t>(bytes, 1),
+                               std::max(alignment, sizeof(size_t)));
+  } catch (AllocError &e) {
+    if (e.getType() == AllocErrorType::NoMemory) {
+      throw std::bad_alloc();
+    }
+    throw;
+  }
+}
+
+void AllocatorResource::do_deallocate(void *p, size_t, size_t) {
+  allocator.free_raw(p);
+}
+
+bool AllocatorResource::do_is_equal(
+    const std::pmr::memory_resource &other) const noexcept {
+  return this == &other;
+}
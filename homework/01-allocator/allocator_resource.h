@@ -0,0 +1,71 @@
+#ifndef ALLOCATOR_RESOURCE
+#define ALLOCATOR_RESOURCE
+#include "allocator.h"
+#include <cstddef>
+#include <memory_resource>
+
+/**
+ * std::pmr::memory_resource on the top of Allocator raw (non relocating)
+ * nodes, so std::pmr containers may live in the managed buffer:
+ *
+ *   AllocatorResource resource(allocator);
+ *   std::pmr::vector<int> v(&resource);
+ *
+ * Stricter alignments than sizeof(size_t) are placed aligned (see
+ * Allocator::alloc_aligned). Exhausted buffer is reported by std::bad_alloc.
+ * Containers free a lot, so AllocatorLayout::BoundaryTags suits them better.
+ */
+class AllocatorResource : public std::pmr::memory_resource {
+public:
+  explicit AllocatorResource(Allocator &allocator) : allocator(allocator) {}
+
+  Allocator &upstream() const { return allocator; }
+
+protected:
+  void *do_allocate(size_t bytes, size_t alignment) override;
+  void do_deallocate(void *p, size_t bytes, size_t alignment) override;
+  bool do_is_equal(const std::pmr::memory_resource &other) const
+      noexcept override;
+
+private:
+  Allocator &allocator;
+};
+
+/**
+ * Allocator requirements adapter over AllocatorResource, for containers
+ * that take the allocator as a template parameter:
+ *
+ *   std::map<int, int, std::less<int>, AllocatorAdapter<std::pair<const int, int>>>
+ *       m(AllocatorAdapter<std::pair<const int, int>>(resource));
+ */
+template <class T> class AllocatorAdapter {
+public:
+  using value_type = T;
+
+  explicit AllocatorAdapter(AllocatorResource &resource) : resource(&resource) {}
+
+  template <class U>
+  AllocatorAdapter(const AllocatorAdapter<U> &that) : resource(that.resource) {}
+
+  T *allocate(size_t n) {
+    return (T *)resource->allocate(n * sizeof(T), alignof(T));
+  }
+
+  void deallocate(T *p, size_t n) {
+    resource->deallocate(p, n * sizeof(T), alignof(T));
+  }
+
+  template <class U> bool operator==(const AllocatorAdapter<U> &that) const {
+    return resource == that.resource;
+  }
+
+  template <class U> bool operator!=(const AllocatorAdapter<U> &that) const {
+    return resource != that.resource;
+  }
+
+private:
+  template <class U> friend class AllocatorAdapter;
+  AllocatorResource *resource;
+};
+
+#endif // ALLOCATOR_RESOURCE
@@ -1,11 +1,23 @@
 #include "gtest/gtest.h"
+#include <atomic>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <memory_resource>
+#include <random>
 #include <set>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
 #include <vector>
 
 #include "allocator.h"
 #include "allocator_error.h"
 #include "allocator_pointer.h"
+#include "allocator_resource.h"
+#include "allocator_trace.h"
+#include "concurrent_allocator.h"
 
 using namespace std;
 char buf[65536];
@@ -273,6 +285,46 @@ TEST(Allocator, ReallocGrowInplace) {
     a.free(p2);
 }
 
+TEST(Allocator, ReallocSlideBack) {
+    AllocatorOptions options;
+    options.layout = AllocatorLayout::BoundaryTags;
+    Allocator a(buf, sizeof(buf), options);
+
+    int size = 136;
+    vector<Pointer> ptrs;
+    for (int i = 0; i < 6; i++) {
+        ptrs.push_back(a.alloc(size));
+        writeTo(ptrs.back(), size);
+    }
+    void* front = ptrs[0].get();
+    a.free(ptrs[0]);
+
+    // Takes the hole in front, the contents are moved down
+    a.realloc(ptrs[1], 2 * size);
+    EXPECT_EQ(ptrs[1].get(), front);
+    EXPECT_TRUE(isDataOk(ptrs[1], size));
+
+    // Takes the holes on both sides
+    void* hole = ptrs[2].get();
+    a.free(ptrs[2]);
+    a.free(ptrs[4]);
+    writeTo(ptrs[3], size);
+    a.realloc(ptrs[3], 3 * size);
+    EXPECT_EQ(ptrs[3].get(), hole);
+    EXPECT_TRUE(isDataOk(ptrs[3], size));
+    writeTo(ptrs[3], 3 * size);
+    EXPECT_TRUE(isDataOk(ptrs[1], size));
+
+    AllocatorStats stats = a.stats();
+    EXPECT_EQ(stats.realloc_slides, 2);
+    EXPECT_EQ(stats.realloc_moves, 0);
+    EXPECT_EQ(stats.live_bytes + stats.free_bytes, stats.heap_bytes);
+    a.free(ptrs[1]);
+    a.free(ptrs[3]);
+    a.free(ptrs[5]);
+    EXPECT_EQ(a.stats().free_bytes, a.stats().heap_bytes);
+}
+
 TEST(Allocator, ReallocShrink) {
     Allocator a(buf, sizeof(buf));
 
@@ -321,3 +373,1491 @@ TEST(Allocator, ReallocGrow) {
     a.free(p);
     a.free(p2);
 }
+
+TEST(Allocator, FreeListReuse) {
+    Allocator a(buf, sizeof(buf));
+
+    vector<Pointer> ptrs;
+    vector<void*> addrs;
+    size_t sizes[] = { 24, 135, 500, 1000, 4000 };
+    for (size_t size : sizes) {
+        ptrs.push_back(a.alloc(size));
+        addrs.push_back(ptrs.back().get());
+        ptrs.push_back(a.alloc(16)); // fence
+    }
+
+    for (size_t i = 0; i < ptrs.size(); i += 2) {
+        a.free(ptrs[i]);
+    }
+
+    // Holes are found again even though the wilderness fits as well
+    for (size_t i = 0; i < ptrs.size(); i += 2) {
+        ptrs[i] = a.alloc(sizes[i / 2]);
+        EXPECT_EQ(ptrs[i].get(), addrs[i / 2]);
+    }
+
+    for (Pointer& p : ptrs) {
+        a.free(p);
+    }
+}
+
+static void randomChurn(Allocator& a, size_t size) {
+    srand(42);
+    vector<Pointer> ptrs;
+    vector<size_t> sizes;
+    for (int i = 0; i < 20000; i++) {
+        int op = rand() % 8;
+        if (op < 4 || ptrs.empty()) {
+            size_t size = 1 + rand() % 700;
+            try {
+                ptrs.push_back(a.alloc(size));
+            } catch (AllocError& e) {
+                EXPECT_EQ(e.getType(), AllocErrorType::NoMemory);
+                continue;
+            }
+            sizes.push_back(size);
+            writeTo(ptrs.back(), size);
+        } else if (op < 7) {
+            size_t k = rand() % ptrs.size();
+            ASSERT_TRUE(isDataOk(ptrs[k], sizes[k]));
+            a.free(ptrs[k]);
+            ptrs.erase(ptrs.begin() + k);
+            sizes.erase(sizes.begin() + k);
+        } else {
+            size_t k = rand() % ptrs.size();
+            size_t size = 1 + rand() % 700;
+            try {
+                a.realloc(ptrs[k], size);
+            } catch (AllocError& e) {
+                EXPECT_EQ(e.getType(), AllocErrorType::NoMemory);
+                continue;
+            }
+            ASSERT_TRUE(isDataOk(ptrs[k], min(size, sizes[k])));
+            sizes[k] = size;
+            writeTo(ptrs[k], size);
+        }
+
+        if (i % 1000 == 999) {
+            a.defrag();
+        } else if (i % 100 == 99) {
+            a.defrag_step(512);
+        }
+
+        AllocatorStats stats = a.stats();
+        ASSERT_EQ(stats.live_blocks, ptrs.size());
+        ASSERT_EQ(stats.used_slots, ptrs.size());
+        ASSERT_EQ(stats.live_bytes + stats.free_bytes, stats.heap_bytes);
+        ASSERT_LE(stats.largest_free, stats.free_bytes);
+    }
+
+    for (size_t k = 0; k < ptrs.size(); k++) {
+        ASSERT_TRUE(isDataOk(ptrs[k], sizes[k]));
+        a.free(ptrs[k]);
+    }
+
+    // Everything is coalesced back, so the whole buffer is available again
+    Pointer p = a.alloc(size - 8 * sizeof(size_t));
+    a.free(p);
+}
+
+static void randomChurn(const AllocatorOptions& options) {
+    Allocator a(buf, sizeof(buf), options);
+    randomChurn(a, sizeof(buf));
+}
+
+TEST(Allocator, RandomChurn) {
+    randomChurn(AllocatorOptions());
+}
+
+TEST(Allocator, RandomChurnBoundaryTags) {
+    AllocatorOptions options;
+    options.layout = AllocatorLayout::BoundaryTags;
+    randomChurn(options);
+}
+
+TEST(Allocator, RandomChurnPlacements) {
+    AllocatorPlacement placements[] = { AllocatorPlacement::FirstFit, AllocatorPlacement::NextFit, AllocatorPlacement::BestFit };
+    for (AllocatorPlacement placement : placements) {
+        AllocatorOptions options;
+        options.layout = AllocatorLayout::BoundaryTags;
+        options.placement = placement;
+        options.large_threshold = 500;
+        randomChurn(options);
+    }
+}
+
+TEST(Allocator, RandomChurnDefragOnFailure) {
+    AllocatorOptions options;
+    options.defrag_on_failure = true;
+    randomChurn(options);
+}
+
+TEST(Allocator, RandomChurnReserved) {
+    AllocatorOptions options;
+    options.layout = AllocatorLayout::BoundaryTags;
+    Allocator a(4 * Allocator::commit_step, options);
+    randomChurn(a, 4 * Allocator::commit_step);
+}
+
+TEST(Allocator, Reserved) {
+    const size_t reserve = size_t(1) << 32; // far more than is ever touched
+    Allocator a(reserve);
+    size_t initial = a.stats().committed_bytes;
+    EXPECT_LE(initial, 2 * Allocator::commit_step);
+
+    // The heap and the table both grow past their first pages
+    vector<Pointer> ptrs;
+    for (int i = 0; i < 20000; i++) {
+        ptrs.push_back(a.alloc(1000));
+        writeTo(ptrs.back(), 1000);
+    }
+    AllocatorStats stats = a.stats();
+    EXPECT_GE(stats.committed_bytes, stats.live_bytes + stats.slots * 2 * sizeof(size_t));
+    EXPECT_LT(stats.committed_bytes, stats.live_bytes * 2);
+
+    // Freed and compacted, the pages are given back
+    for (size_t i = 0; i < ptrs.size(); i++) {
+        if (i % 10) {
+            a.free(ptrs[i]);
+        }
+    }
+    a.defrag();
+    stats = a.stats();
+    EXPECT_LT(stats.committed_bytes, stats.live_bytes * 2);
+    for (size_t i = 0; i < ptrs.size(); i += 10) {
+        ASSERT_TRUE(isDataOk(ptrs[i], 1000));
+    }
+
+    // And committed again on demand
+    Pointer p = a.alloc(10 * 1000 * 1000);
+    writeTo(p, 10 * 1000 * 1000);
+    EXPECT_GE(a.stats().committed_bytes, size_t(10 * 1000 * 1000));
+}
+
+TEST(Allocator, BoundaryTagsCoalesce) {
+    AllocatorOptions options;
+    options.layout = AllocatorLayout::BoundaryTags;
+    Allocator a(buf, sizeof(buf), options);
+
+    int size = 135;
+    Pointer p1 = a.alloc(size);
+    Pointer p2 = a.alloc(size);
+    Pointer p3 = a.alloc(size);
+    Pointer p4 = a.alloc(size);
+    writeTo(p4, size);
+    void* ptr = p1.get();
+
+    // p2 merges into free p1 on the left, p3 merges into both from the right
+    a.free(p1);
+    a.free(p3);
+    a.free(p2);
+
+    Pointer p = a.alloc(3 * size);
+    EXPECT_EQ(p.get(), ptr);
+    EXPECT_TRUE(isDataOk(p4, size));
+
+    a.free(p);
+    a.free(p4);
+}
+
+TEST(Allocator, DefragStep) {
+    Allocator a(buf, sizeof(buf));
+
+    vector<Pointer> ptrs;
+    int size = 135;
+
+    ASSERT_TRUE(fillUp(a, size, ptrs));
+    for (size_t i = 1; i < ptrs.size(); i += 2) {
+        a.free(ptrs[i]);
+    }
+    for (size_t i = 1; i < ptrs.size(); i++) {
+        ptrs.erase(ptrs.begin() + i);
+    }
+
+    size_t budget = 4 * size, steps = 0;
+    for (size_t moved; (moved = a.defrag_step(budget)) > 0; steps++) {
+        EXPECT_LE(moved, budget);
+        for (Pointer& p : ptrs) {
+            ASSERT_TRUE(isDataOk(p, size));
+        }
+
+        // allocations between the steps are fine
+        Pointer p = a.alloc(size);
+        writeTo(p, size);
+        a.free(p);
+    }
+    EXPECT_GT(steps, 1);
+
+    Pointer newPtr = a.alloc(size * ptrs.size() / 2);
+    a.free(newPtr);
+
+    for (Pointer& p : ptrs) {
+        EXPECT_TRUE(isDataOk(p, size));
+        a.free(p);
+    }
+}
+
+TEST(Allocator, DefragSkipsPinned) {
+    Allocator a(buf, sizeof(buf));
+
+    int size = 135;
+    vector<Pointer> holes, ptrs;
+    for (int i = 0; i < 4; i++) {
+        holes.push_back(a.alloc(size));
+        ptrs.push_back(a.alloc(size));
+        writeTo(ptrs.back(), size);
+    }
+    for (Pointer& h : holes) {
+        a.free(h);
+    }
+
+    vector<void*> before;
+    for (Pointer& p : ptrs) {
+        before.push_back(p.get());
+    }
+
+    {
+        Pointer::Pin pin = a.pin(ptrs[1]);
+        a.defrag();
+        EXPECT_EQ(pin.get(), before[1]);
+        EXPECT_NE(ptrs[0].get(), before[0]);
+        // compaction goes on above the pinned node
+        EXPECT_NE(ptrs[2].get(), before[2]);
+        EXPECT_NE(ptrs[3].get(), before[3]);
+
+        EXPECT_EQ(a.defrag_step(size), 0);
+    }
+
+    // the hole left in front of the unpinned node is picked up again
+    EXPECT_GT(a.defrag_step(size), 0);
+    EXPECT_NE(ptrs[1].get(), before[1]);
+
+    for (Pointer& p : ptrs) {
+        EXPECT_TRUE(isDataOk(p, size));
+        a.free(p);
+    }
+}
+
+TEST(Allocator, DeferredHoleMerged) {
+    Allocator a(buf, sizeof(buf));
+
+    Pointer hole = a.alloc(135);
+    Pointer p = a.alloc(135);
+    a.free(hole);
+    {
+        Pointer::Pin pin = a.pin(p);
+        EXPECT_EQ(a.defrag_step(1), 0);
+    }
+    // the deferred hole is now a part of the wilderness
+    a.free(p);
+    EXPECT_EQ(a.defrag_step(1), 0);
+
+    p = a.alloc(sizeof(buf) - 8 * sizeof(size_t));
+    a.free(p);
+}
+
+TEST(Allocator, PinnedFreeRealloc) {
+    Allocator a(buf, sizeof(buf));
+
+    int size = 135;
+    Pointer p = a.alloc(size);
+    Pointer fence = a.alloc(size);
+    {
+        Pointer::Pin pin = a.pin(p);
+        try {
+            a.free(p);
+            EXPECT_TRUE(false);
+        } catch (AllocError& e) {
+            EXPECT_EQ(e.getType(), AllocErrorType::InvalidOperation);
+        }
+        try {
+            a.realloc(p, size * 4);
+            EXPECT_TRUE(false);
+        } catch (AllocError& e) {
+            EXPECT_EQ(e.getType(), AllocErrorType::InvalidOperation);
+        }
+        // in place is fine
+        a.realloc(p, size / 2);
+        EXPECT_EQ(pin.get(), p.get());
+    }
+    a.realloc(p, size * 4);
+    a.free(p);
+    a.free(fence);
+}
+
+TEST(Allocator, SlotReuse) {
+    Allocator a(buf, sizeof(buf));
+
+    vector<Pointer> ptrs;
+    for (int i = 0; i < 100; i++) {
+        ptrs.push_back(a.alloc(8));
+    }
+    for (int i = 0; i < 100; i += 2) { // the last one is the table front
+        a.free(ptrs[i]);
+    }
+    EXPECT_EQ(a.stats().slots, 100);
+    EXPECT_EQ(a.stats().used_slots, 50);
+
+    // Vacant slots are taken before the table grows
+    for (int i = 0; i < 100; i += 2) {
+        ptrs[i] = a.alloc(8);
+    }
+    EXPECT_EQ(a.stats().slots, 100);
+
+    // A copy of the handle sees the slot is vacant now
+    Pointer stale = ptrs[0];
+    a.free(ptrs[0]);
+    try {
+        stale.get();
+        EXPECT_TRUE(false);
+    } catch (AllocError& e) {
+        EXPECT_EQ(e.getType(), AllocErrorType::InvalidOperation);
+    }
+
+    // The table shrinks back once trailing slots are vacant
+    for (int i = 1; i < 100; i++) {
+        a.free(ptrs[i]);
+    }
+    EXPECT_EQ(a.stats().slots, 0);
+    Pointer p = a.alloc(sizeof(buf) - 8 * sizeof(size_t));
+    a.free(p);
+}
+
+/**
+ * Holes of 200, 100 and 300 bytes (in address order) separated by used nodes,
+ * returns the address of the last used node
+ */
+static void* punchHoles(Allocator& a, vector<Pointer>& guards)
+{
+    size_t sizes[] = { 200, 100, 300 };
+    vector<Pointer> holes;
+    for (size_t size : sizes) {
+        holes.push_back(a.alloc(size));
+        guards.push_back(a.alloc(8));
+    }
+    for (Pointer& p : holes) {
+        a.free(p);
+    }
+    return guards.back().get();
+}
+
+static void* placeIn(AllocatorPlacement placement, size_t threshold, size_t size)
+{
+    AllocatorOptions options;
+    options.placement = placement;
+    options.large_threshold = threshold;
+    Allocator a(buf, sizeof(buf), options);
+    vector<Pointer> guards;
+    void* top = punchHoles(a, guards);
+    Pointer p = a.alloc(size);
+    return p.get() > top ? nullptr : p.get(); // nullptr for the wilderness
+}
+
+static void expectStale(function<void()> use)
+{
+    try {
+        use();
+        EXPECT_TRUE(false) << "stale handle passed";
+    } catch (AllocError& e) {
+        EXPECT_EQ(e.getType(), AllocErrorType::InvalidOperation);
+    }
+}
+
+TEST(Allocator, StaleHandles) {
+    Allocator a(buf, sizeof(buf));
+
+    // The slot serves another node already: the copy is stale anyway
+    Pointer p = a.alloc(64);
+    Pointer stale = p;
+    size_t id = a.id(p);
+    a.free(p);
+    Pointer q = a.alloc(64);
+    ASSERT_EQ(a.id(q), id);
+    writeTo(q, 64);
+
+    expectStale([&] { stale.get(); });
+    expectStale([&] { a.pin(stale); });
+    expectStale([&] { a.size(stale); });
+    expectStale([&] { a.realloc(stale, 128); });
+    expectStale([&] { a.free(stale); });
+    expectStale([&] { a.free_many(&stale, 1); });
+    EXPECT_TRUE(isDataOk(q, 64));
+    EXPECT_EQ(a.stats().used_slots, 1);
+
+    // So is a handle of a slot that went back to the wilderness and came again
+    Pointer last = a.alloc(64);
+    stale = last;
+    id = a.id(last);
+    a.free(last);
+    EXPECT_EQ(a.stats().slots, 1);
+    Pointer r = a.alloc(64);
+    ASSERT_EQ(a.id(r), id);
+    expectStale([&] { stale.get(); });
+
+    // pointer(id) gives the current generation
+    Pointer same = a.pointer(a.id(r));
+    EXPECT_EQ(same.get(), r.get());
+    a.free(same);
+    expectStale([&] { r.get(); });
+    a.free(q);
+}
+
+TEST(Allocator, StalePinShrunkTable) {
+    Allocator a(buf, sizeof(buf));
+
+    // The slot of the handle goes back to the wilderness with the table
+    vector<Pointer> ptrs;
+    for (int i = 0; i < 1000; i++) {
+        ptrs.push_back(a.alloc(8));
+    }
+    Pointer stale = ptrs.back();
+    for (Pointer& p : ptrs) {
+        a.free(p);
+    }
+    EXPECT_EQ(a.stats().slots, 0);
+
+    // and then into a node full of bits that look like a moving pin counter
+    Pointer big = a.alloc(sizeof(buf) - 8 * sizeof(size_t));
+    memset(big.get(), 0xff, a.size(big));
+    expectStale([&] { a.pin(stale); });
+    expectStale([&] { stale.get(); });
+    a.free(big);
+}
+
+TEST(Allocator, Placement) {
+    // holes start at buf + header + owner and so on
+    char* first = buf + 2 * sizeof(size_t);
+    char* second = first + 200 + 2 * sizeof(size_t) + 8 + 2 * sizeof(size_t);
+    char* third = second + 104 + 2 * sizeof(size_t) + 8 + 2 * sizeof(size_t);
+
+    EXPECT_EQ(placeIn(AllocatorPlacement::FirstFit, 0, 90), first);
+    EXPECT_EQ(placeIn(AllocatorPlacement::BestFit, 0, 90), second);
+    EXPECT_EQ(placeIn(AllocatorPlacement::BestFit, 0, 250), third);
+    EXPECT_EQ(placeIn(AllocatorPlacement::GoodFit, 0, 250), third);
+    EXPECT_EQ(placeIn(AllocatorPlacement::NextFit, 0, 90), nullptr);
+
+    // Large requests go to the highest hole
+    EXPECT_EQ(placeIn(AllocatorPlacement::BestFit, 90, 90), third);
+    EXPECT_EQ(placeIn(AllocatorPlacement::BestFit, 250, 90), second);
+    EXPECT_EQ(placeIn(AllocatorPlacement::BestFit, 250, 400), nullptr);
+}
+
+TEST(Allocator, NextFitRoves) {
+    AllocatorOptions options;
+    options.placement = AllocatorPlacement::NextFit;
+    Allocator a(buf, sizeof(buf), options);
+
+    vector<Pointer> ptrs;
+    ASSERT_TRUE(fillUp(a, 135, ptrs));
+    void* second = ptrs[5].get();
+    a.free(ptrs[2]);
+    a.free(ptrs[5]);
+    a.free(ptrs[8]);
+
+    Pointer p = a.alloc(135);
+    EXPECT_LT(p.get(), second);
+    Pointer q = a.alloc(135);
+    EXPECT_EQ(q.get(), second) << "the search goes on from the last hole";
+    a.free(p);
+    Pointer r = a.alloc(135);
+    EXPECT_GT(r.get(), second);
+}
+
+TEST(Allocator, DefragOnFailure) {
+    AllocatorOptions options;
+    options.defrag_on_failure = true;
+    Allocator a(buf, sizeof(buf), options);
+
+    vector<Pointer> ptrs;
+    int size = 135;
+    ASSERT_TRUE(fillUp(a, size, ptrs));
+    a.free(ptrs[1]);
+    a.free(ptrs[10]);
+    a.free(ptrs[15]);
+
+    // the alloc that ran out in fillUp may have had a try already
+    size_t defrags = a.stats().defrags;
+    Pointer p = a.alloc(size * 2);
+    EXPECT_EQ(a.stats().defrags, defrags + 1);
+    a.free(p);
+}
+
+static void allocMany(const AllocatorOptions& options)
+{
+    Allocator a(buf, sizeof(buf), options);
+
+    // Carved one after another
+    size_t sizes[] = { 10, 200, 0, 35, 1000 };
+    const size_t count = sizeof(sizes) / sizeof(sizes[0]);
+    Pointer ptrs[count];
+    a.alloc_many(sizes, count, ptrs);
+    EXPECT_EQ(ptrs[2].get(), nullptr);
+    char* prev = nullptr;
+    for (size_t i = 0; i < count; i++) {
+        if (sizes[i] == 0) {
+            continue;
+        }
+        char* v = reinterpret_cast<char*>(ptrs[i].get());
+        EXPECT_TRUE(prev == nullptr || v > prev);
+        EXPECT_TRUE(prev == nullptr || v - prev < 1100);
+        prev = v;
+        writeTo(ptrs[i], sizes[i]);
+    }
+    for (size_t i = 0; i < count; i++) {
+        EXPECT_TRUE(isDataOk(ptrs[i], sizes[i]));
+    }
+    EXPECT_EQ(a.stats().live_blocks, 4);
+
+    // Holes too small for the batch, so it is placed one by one
+    vector<Pointer> fill;
+    fillUp(a, 100, fill);
+    for (size_t i = 0; i < fill.size(); i += 2) {
+        a.free(fill[i]);
+    }
+    size_t small[] = { 50, 60, 70 };
+    Pointer smallPtrs[3];
+    a.alloc_many(small, 3, smallPtrs);
+    for (size_t i = 0; i < 3; i++) {
+        writeTo(smallPtrs[i], small[i]);
+    }
+    for (size_t i = 0; i < 3; i++) {
+        EXPECT_TRUE(isDataOk(smallPtrs[i], small[i]));
+    }
+
+    // All or none
+    AllocatorStats before = a.stats();
+    size_t huge[] = { 50, sizeof(buf) };
+    Pointer hugePtrs[2];
+    EXPECT_THROW(a.alloc_many(huge, 2, hugePtrs), AllocError);
+    EXPECT_EQ(hugePtrs[0].get(), nullptr);
+    EXPECT_EQ(a.stats().live_blocks, before.live_blocks);
+
+    a.free_many(smallPtrs, 3);
+    a.free_many(ptrs, count);
+    for (size_t i = 0; i < count; i++) {
+        EXPECT_EQ(ptrs[i].get(), nullptr);
+    }
+    a.free_many(fill.data(), fill.size());
+    AllocatorStats stats = a.stats();
+    EXPECT_EQ(stats.live_blocks, 0);
+    EXPECT_EQ(stats.free_bytes, stats.heap_bytes);
+    EXPECT_EQ(stats.largest_free, stats.free_bytes);
+}
+
+TEST(Allocator, AllocMany) {
+    allocMany(AllocatorOptions());
+}
+
+TEST(Allocator, AllocManyBoundaryTags) {
+    AllocatorOptions options;
+    options.layout = AllocatorLayout::BoundaryTags;
+    allocMany(options);
+}
+
+TEST(Allocator, AllocManySmallSlabs) {
+    AllocatorOptions options;
+    options.small_slabs = true;
+    Allocator a(buf, sizeof(buf), options);
+
+    // Small sizes take slab objects just like alloc() gives them
+    size_t sizes[] = { 16, 200, 8, 0, 64, 1000 };
+    const size_t count = sizeof(sizes) / sizeof(sizes[0]);
+    Pointer ptrs[count];
+    a.alloc_many(sizes, count, ptrs);
+    AllocatorStats stats = a.stats();
+    EXPECT_EQ(stats.small_objects, 3);
+    EXPECT_EQ(stats.live_blocks, 2 + stats.slabs);
+    EXPECT_EQ(a.size(ptrs[0]), 16);
+    EXPECT_THROW(a.id(ptrs[0]), AllocError);
+    EXPECT_NO_THROW(a.id(ptrs[1]));
+    for (size_t i = 0; i < count; i++) {
+        writeTo(ptrs[i], sizes[i]);
+    }
+    for (size_t i = 0; i < count; i++) {
+        EXPECT_TRUE(isDataOk(ptrs[i], sizes[i]));
+    }
+
+    // So they do when the batch is placed one by one
+    vector<Pointer> fill;
+    fillUp(a, 100, fill);
+    for (size_t i = 0; i < fill.size(); i += 2) {
+        a.free(fill[i]);
+    }
+    size_t mixed[] = { 16, 80, 90 }; // the 16 byte slab has room left
+    Pointer mixedPtrs[3];
+    a.alloc_many(mixed, 3, mixedPtrs);
+    EXPECT_EQ(a.stats().small_objects, 4);
+    EXPECT_THROW(a.id(mixedPtrs[0]), AllocError);
+
+    a.free_many(mixedPtrs, 3);
+    a.free_many(ptrs, count);
+    a.free_many(fill.data(), fill.size());
+    stats = a.stats();
+    EXPECT_EQ(stats.small_objects, 0);
+    EXPECT_EQ(stats.live_blocks, stats.slabs);
+}
+
+TEST(Allocator, FreeManyPinned) {
+    Allocator a(buf, sizeof(buf));
+    vector<Pointer> ptrs;
+    for (int i = 0; i < 10; i++) {
+        ptrs.push_back(a.alloc(64));
+    }
+    {
+        Pointer::Pin pin = a.pin(ptrs[5]);
+        EXPECT_THROW(a.free_many(ptrs.data(), ptrs.size()), AllocError);
+        EXPECT_EQ(a.stats().live_blocks, 10);
+    }
+    a.free_many(ptrs.data(), ptrs.size());
+    EXPECT_EQ(a.stats().live_blocks, 0);
+}
+
+TEST(Allocator, FreeManyTwice) {
+    for (AllocatorLayout layout : { AllocatorLayout::Compact, AllocatorLayout::BoundaryTags }) {
+        AllocatorOptions options;
+        options.layout = layout;
+        options.small_slabs = true;
+        Allocator a(buf, sizeof(buf), options);
+
+        Pointer p = a.alloc(100);
+        Pointer q = a.alloc(100);
+        Pointer s = a.alloc(16);
+        size_t live = a.stats().live_blocks;
+        Pointer twice[] = { p, q, p };
+        expectStale([&] { a.free_many(twice, 3); });
+        Pointer smallTwice[] = { s, q, s };
+        expectStale([&] { a.free_many(smallTwice, 3); });
+        EXPECT_EQ(a.stats().live_blocks, live);
+        EXPECT_EQ(a.stats().small_objects, 1);
+
+        Pointer once[] = { p, q, s };
+        a.free_many(once, 3);
+        EXPECT_EQ(a.stats().live_blocks, a.stats().slabs);
+        EXPECT_EQ(a.stats().small_objects, 0);
+    }
+}
+
+static bool isAligned(const Pointer& p, size_t alignment)
+{
+    return (size_t)p.get() % alignment == 0;
+}
+
+static void allocAligned(const AllocatorOptions& options)
+{
+    Allocator a(buf, sizeof(buf), options);
+    size_t alignments[] = { 16, 32, 64, 4096 };
+
+    // Unaligned nodes in between, so that aligned ones need padding
+    vector<Pointer> ptrs, aligned;
+    vector<size_t> sizes;
+    for (int i = 0; i < 24; i++) {
+        ptrs.push_back(a.alloc(24 + i * 8));
+        size_t alignment = alignments[i % 4];
+        sizes.push_back(40 + i * 16);
+        aligned.push_back(a.alloc_aligned(sizes.back(), alignment));
+        ASSERT_TRUE(isAligned(aligned.back(), alignment));
+        writeTo(aligned.back(), sizes.back());
+    }
+
+    // Moved down by defrag, only to aligned places
+    for (Pointer& p : ptrs) {
+        a.free(p);
+    }
+    a.defrag();
+    EXPECT_GT(a.stats().defrag_moves, 0);
+    for (size_t i = 0; i < aligned.size(); i++) {
+        EXPECT_TRUE(isAligned(aligned[i], alignments[i % 4]));
+        EXPECT_TRUE(isDataOk(aligned[i], sizes[i]));
+    }
+
+    // Moved by realloc
+    for (size_t i = 0; i < aligned.size(); i += 3) {
+        a.realloc(aligned[i], sizes[i] * 4);
+        EXPECT_TRUE(isAligned(aligned[i], alignments[i % 4]));
+        EXPECT_TRUE(isDataOk(aligned[i], sizes[i]));
+    }
+    EXPECT_GT(a.stats().realloc_moves, 0);
+
+    void* raw = a.alloc_raw(100, 64);
+    EXPECT_EQ((size_t)raw % 64, 0);
+    a.free_raw(raw);
+    for (Pointer& p : aligned) {
+        a.free(p);
+    }
+    AllocatorStats stats = a.stats();
+    EXPECT_EQ(stats.free_bytes, stats.heap_bytes);
+    EXPECT_EQ(stats.largest_free, stats.free_bytes);
+
+    EXPECT_THROW(a.alloc_aligned(10, 24), AllocError);
+}
+
+TEST(Allocator, AllocAligned) {
+    allocAligned(AllocatorOptions());
+}
+
+TEST(Allocator, AllocAlignedBoundaryTags) {
+    AllocatorOptions options;
+    options.layout = AllocatorLayout::BoundaryTags;
+    allocAligned(options);
+}
+
+TEST(Allocator, SmallSlabs) {
+    AllocatorOptions options;
+    options.small_slabs = true;
+    Allocator a(buf, sizeof(buf), options);
+
+    // Objects of a class are packed one after another, with no headers
+    size_t sizes[] = { 8, 16, 32, 64 };
+    vector<Pointer> ptrs;
+    for (size_t size : sizes) {
+        for (int i = 0; i < 200; i++) {
+            ptrs.push_back(a.alloc(size - i % 8));
+            writeTo(ptrs.back(), size - i % 8);
+            EXPECT_EQ(a.size(ptrs.back()), size);
+        }
+        char* first = reinterpret_cast<char*>(ptrs[ptrs.size() - 200].get());
+        char* second = reinterpret_cast<char*>(ptrs[ptrs.size() - 199].get());
+        EXPECT_EQ(second - first, size);
+    }
+    AllocatorStats stats = a.stats();
+    EXPECT_EQ(stats.small_objects, 800);
+    EXPECT_EQ(stats.live_blocks, stats.slabs);
+    EXPECT_EQ(stats.used_slots, stats.slabs); // a slot per slab
+    EXPECT_EQ(stats.slabs, 1 + 1 + 2 + 4); // 396, 220, 115 and 59 objects each
+    EXPECT_LT(stats.live_bytes, stats.slabs * 4200);
+
+    // Big ones still go to nodes, defrag passes slabs by
+    Pointer big = a.alloc(100);
+    EXPECT_EQ(a.stats().used_slots, stats.slabs + 1);
+    for (size_t i = 0; i < ptrs.size(); i += 2) {
+        a.free(ptrs[i]);
+    }
+    a.defrag();
+    for (size_t i = 1; i < ptrs.size(); i += 2) {
+        EXPECT_TRUE(isDataOk(ptrs[i], sizes[i / 200] - i % 8));
+        Pointer::Pin pin = a.pin(ptrs[i]);
+        EXPECT_EQ(pin.get(), ptrs[i].get());
+    }
+
+    // realloc moves between classes and out of the tier
+    a.realloc(ptrs[1], 30);
+    EXPECT_EQ(a.size(ptrs[1]), 32);
+    EXPECT_TRUE(isDataOk(ptrs[1], 7));
+    a.realloc(ptrs[1], 500);
+    EXPECT_TRUE(isDataOk(ptrs[1], 7));
+    EXPECT_GE(a.size(ptrs[1]), 500);
+    EXPECT_THROW(a.id(ptrs[3]), AllocError);
+
+    // Empty slabs go back, one per class is kept
+    for (size_t i = 1; i < ptrs.size(); i += 2) {
+        a.free(ptrs[i]);
+    }
+    a.free(big);
+    stats = a.stats();
+    EXPECT_EQ(stats.small_objects, 0);
+    EXPECT_LE(stats.slabs, 4);
+    EXPECT_EQ(stats.allocs, stats.frees);
+
+    EXPECT_THROW(Allocator("allocator_test.heap", 1 << 20, options), AllocError);
+}
+
+TEST(Allocator, SmallPinned) {
+    AllocatorOptions options;
+    options.small_slabs = true;
+    Allocator a(buf, sizeof(buf), options);
+
+    Pointer p = a.alloc(16);
+    Pointer q = a.alloc(16);
+    writeTo(p, 16);
+    {
+        Pointer::Pin pin = a.pin(p);
+        Pointer::Pin again = a.pin(p);
+        try {
+            a.free(p);
+            EXPECT_TRUE(false);
+        } catch (AllocError& e) {
+            EXPECT_EQ(e.getType(), AllocErrorType::InvalidOperation);
+        }
+        EXPECT_THROW(a.realloc(p, 64), AllocError); // would move
+        Pointer both[] = { q, p };
+        EXPECT_THROW(a.free_many(both, 2), AllocError);
+        EXPECT_EQ(a.stats().small_objects, 2);
+
+        a.realloc(p, 12); // stays in place
+        a.free(q); // the other objects of the slab aren't pinned
+        EXPECT_EQ(pin.get(), p.get());
+        EXPECT_TRUE(isDataOk(p, 12));
+    }
+    a.realloc(p, 64);
+    a.free(p);
+    EXPECT_EQ(a.stats().small_objects, 0);
+}
+
+TEST(Allocator, SmallStaleHandles) {
+    AllocatorOptions options;
+    options.small_slabs = true;
+    Allocator a(buf, sizeof(buf), options);
+
+    // The object is taken again: its tag tells the handles apart
+    Pointer p = a.alloc(16);
+    void* addr = p.get();
+    Pointer stale = p;
+    a.free(p);
+    Pointer q = a.alloc(16);
+    ASSERT_EQ(q.get(), addr);
+    writeTo(q, 16);
+
+    expectStale([&] { stale.get(); });
+    expectStale([&] { a.pin(stale); });
+    expectStale([&] { a.size(stale); });
+    expectStale([&] { a.realloc(stale, 8); });
+    expectStale([&] { a.free(stale); });
+    expectStale([&] { a.free_many(&stale, 1); });
+    EXPECT_TRUE(isDataOk(q, 16));
+    EXPECT_EQ(a.stats().small_objects, 1);
+
+    // The slab is freed and its memory is a node now: the slab slot tells
+    // stale handles apart, the node is not touched
+    vector<Pointer> ptrs, stales;
+    for (int i = 0; i < 300; i++) {
+        ptrs.push_back(a.alloc(64));
+    }
+    size_t slabs = a.stats().slabs;
+    stales = ptrs;
+    for (Pointer& p : ptrs) {
+        a.free(p);
+    }
+    EXPECT_LT(a.stats().slabs, slabs);
+    vector<Pointer> nodes;
+    for (int i = 0; i < 40; i++) {
+        nodes.push_back(a.alloc(500));
+        writeTo(nodes.back(), 500);
+    }
+    for (Pointer& p : stales) {
+        expectStale([&] { a.free(p); });
+        expectStale([&] { p.get(); });
+    }
+    for (Pointer& p : nodes) {
+        EXPECT_TRUE(isDataOk(p, 500));
+    }
+    EXPECT_EQ(a.stats().small_objects, 1);
+}
+
+TEST(Allocator, Stats) {
+    Allocator a(buf, sizeof(buf));
+
+    AllocatorStats empty = a.stats();
+    EXPECT_EQ(empty.live_blocks, 0);
+    EXPECT_EQ(empty.free_bytes, empty.heap_bytes);
+    EXPECT_EQ(empty.largest_free, empty.free_bytes);
+    EXPECT_EQ(empty.fragmentation, 0);
+
+    int size = 136;
+    vector<Pointer> ptrs;
+    for (int i = 0; i < 8; i++) {
+        ptrs.push_back(a.alloc(size));
+    }
+    for (int i = 0; i < 8; i += 2) {
+        a.free(ptrs[i]);
+    }
+    a.realloc(ptrs[1], 2 * size); // grows in place into the hole after it
+    a.realloc(ptrs[7], 100 * size); // last node, grows into the wilderness
+    a.realloc(ptrs[3], 3 * size); // moves
+
+    AllocatorStats stats = a.stats();
+    EXPECT_EQ(stats.allocs, 8);
+    EXPECT_EQ(stats.frees, 4);
+    EXPECT_EQ(stats.reallocs, 3);
+    EXPECT_EQ(stats.realloc_in_place, 2);
+    EXPECT_EQ(stats.realloc_slides, 0);
+    EXPECT_EQ(stats.realloc_moves, 1);
+    EXPECT_EQ(stats.live_blocks, 4);
+    EXPECT_EQ(stats.used_slots, 4);
+    EXPECT_EQ(stats.slots, 8);
+    EXPECT_EQ(stats.free_blocks, 3);
+    EXPECT_EQ(stats.live_bytes + stats.free_bytes, stats.heap_bytes);
+    EXPECT_EQ(stats.largest_free, stats.wilderness);
+    EXPECT_GT(stats.fragmentation, 0);
+
+    try {
+        a.alloc(sizeof(buf));
+        EXPECT_TRUE(false);
+    } catch (AllocError& e) {
+        EXPECT_EQ(e.getType(), AllocErrorType::NoMemory);
+    }
+
+    a.defrag();
+    stats = a.stats();
+    EXPECT_EQ(stats.failed_allocs, 1);
+    EXPECT_EQ(stats.defrags, 1);
+    EXPECT_EQ(stats.free_blocks, 0);
+    EXPECT_EQ(stats.fragmentation, 0);
+    EXPECT_EQ(stats.defrag_moves, 4);
+    EXPECT_GT(stats.defrag_bytes, 0);
+
+    EXPECT_NE(a.dump().find("live_blocks 4\n"), string::npos);
+    string json = stats.json();
+    EXPECT_EQ(json.front(), '{');
+    EXPECT_EQ(json.back(), '}');
+    EXPECT_NE(json.find("\"defrags\": 1"), string::npos);
+
+    for (Pointer& p : ptrs) {
+        a.free(p);
+    }
+}
+
+static bool inBuf(const void* p)
+{
+    return p >= buf && p < buf + sizeof(buf);
+}
+
+TEST(Allocator, RawNotMoved) {
+    Allocator a(buf, sizeof(buf));
+
+    Pointer hole = a.alloc(135);
+    void* raw = a.alloc_raw(135);
+    Pointer p = a.alloc(135);
+    a.free(hole);
+    memset(raw, 42, 135);
+    EXPECT_EQ(a.size_raw(raw), 136);
+    EXPECT_TRUE(a.owns(raw));
+    EXPECT_FALSE(a.owns(buf + sizeof(buf)));
+    EXPECT_FALSE(a.owns(&hole));
+
+    a.defrag();
+    EXPECT_EQ(a.stats().free_blocks, 1); // the hole in front of the raw node
+    void* moved = p.get();
+    EXPECT_EQ(((char*)raw)[134], 42);
+
+    try {
+        a.free_raw(moved);
+        EXPECT_TRUE(false);
+    } catch (AllocError& e) {
+        EXPECT_EQ(e.getType(), AllocErrorType::InvalidOperation);
+    }
+
+    a.free_raw(raw);
+    a.free(p);
+    p = a.alloc(sizeof(buf) - 8 * sizeof(size_t));
+    a.free(p);
+}
+
+TEST(Allocator, Containers) {
+    Allocator a(buf, sizeof(buf));
+    AllocatorResource resource(a);
+
+    {
+        std::pmr::vector<std::pmr::string> strings(&resource);
+        for (int i = 0; i < 100; i++) {
+            strings.emplace_back(std::to_string(i) + " is too long for the small string buffer");
+        }
+        EXPECT_TRUE(inBuf(strings.data()));
+        EXPECT_TRUE(inBuf(strings[50].data()));
+
+        struct alignas(64) Line {
+            char bytes[64];
+        };
+        std::pmr::vector<Line> lines(3, &resource);
+        EXPECT_TRUE(inBuf(lines.data()));
+        EXPECT_EQ((size_t)lines.data() % 64, 0);
+
+        typedef AllocatorAdapter<pair<const int, int>> MapAllocator;
+        map<int, int, less<int>, MapAllocator> squares{MapAllocator(resource)};
+        for (int i = 0; i < 300; i++) {
+            squares[i] = i * i;
+        }
+        for (int i = 0; i < 300; i += 2) {
+            squares.erase(i);
+        }
+        EXPECT_TRUE(inBuf(&*squares.begin()));
+
+        // Raw nodes stay in place, handles are compacted around them
+        a.defrag();
+        EXPECT_EQ(squares[299], 299 * 299);
+        EXPECT_EQ(strings[99], "99 is too long for the small string buffer");
+
+        try {
+            std::pmr::vector<char> huge(sizeof(buf), &resource);
+            EXPECT_TRUE(false);
+        } catch (std::bad_alloc&) {
+        }
+    }
+
+    EXPECT_EQ(a.stats().live_blocks, 0);
+    Pointer p = a.alloc(sizeof(buf) - 8 * sizeof(size_t));
+    a.free(p);
+}
+
+TEST(Allocator, TraceRoundTrip) {
+    string path = "allocator_test.trace";
+    AllocatorStats recorded;
+    {
+        TraceWriter writer(path);
+        AllocatorOptions options;
+        options.layout = AllocatorLayout::BoundaryTags;
+        options.trace = &writer;
+        Allocator a(buf, sizeof(buf), options);
+
+        Pointer p = a.alloc(100);
+        Pointer q = a.alloc(200);
+        a.realloc(p, 1000);
+        a.free(q);
+        try {
+            a.alloc(sizeof(buf));
+        } catch (AllocError&) {
+        }
+        a.defrag_step(4096);
+        a.defrag();
+        q = a.alloc(300); // takes the slot of the old q
+        recorded = a.stats();
+        a.free(p);
+        a.free(q);
+    }
+
+    TraceReader reader(path);
+    TraceRecord r;
+    vector<TraceRecord> trace;
+    while (reader.next(r)) {
+        trace.push_back(r);
+    }
+    ASSERT_EQ(trace.size(), 11);
+    EXPECT_EQ(trace[0].op, TraceOp::Init);
+    EXPECT_EQ(trace[0].size, sizeof(buf));
+    EXPECT_EQ(trace[0].id, (size_t)AllocatorLayout::BoundaryTags);
+    EXPECT_EQ(trace[1].op, TraceOp::Alloc);
+    EXPECT_EQ(trace[1].size, 100);
+    EXPECT_EQ(trace[3].op, TraceOp::Realloc);
+    EXPECT_EQ(trace[3].id, trace[1].id);
+    EXPECT_EQ(trace[4].op, TraceOp::Free);
+    EXPECT_EQ(trace[4].id, trace[2].id);
+    EXPECT_EQ(trace[5].op, TraceOp::AllocFail);
+    EXPECT_EQ(trace[5].size, sizeof(buf));
+    EXPECT_EQ(trace[6].op, TraceOp::DefragStep);
+    EXPECT_EQ(trace[6].size, 4096);
+    EXPECT_EQ(trace[7].op, TraceOp::Defrag);
+    EXPECT_EQ(trace[8].id, trace[2].id);
+
+    // Replayed on the same options the heap ends up the same
+    AllocatorOptions options;
+    options.layout = (AllocatorLayout)trace[0].id;
+    Allocator a(buf, trace[0].size, options);
+    vector<Pointer> ptrs;
+    for (size_t i = 1; i < 9; i++) {
+        TraceRecord& op = trace[i];
+        ptrs.resize(max(ptrs.size(), op.id + 1));
+        try {
+            switch (op.op) {
+            case TraceOp::Alloc:
+                ptrs[op.id] = a.alloc(op.size);
+                break;
+            case TraceOp::AllocFail:
+                a.alloc(op.size);
+                break;
+            case TraceOp::Realloc:
+                a.realloc(ptrs[op.id], op.size);
+                break;
+            case TraceOp::Free:
+                a.free(ptrs[op.id]);
+                break;
+            case TraceOp::Defrag:
+                a.defrag();
+                break;
+            default:
+                a.defrag_step(op.size);
+            }
+        } catch (AllocError&) {
+        }
+    }
+    AllocatorStats replayed = a.stats();
+    EXPECT_EQ(replayed.live_bytes, recorded.live_bytes);
+    EXPECT_EQ(replayed.wilderness, recorded.wilderness);
+    EXPECT_EQ(replayed.failed_allocs, 1);
+    remove(path.c_str());
+}
+
+// Root block lists live handles as (id, size) pairs after their count
+static void checkPersisted(Allocator& a, size_t liveBlocks)
+{
+    Pointer root = a.root();
+    ASSERT_NE(root.get(), nullptr);
+    size_t* index = reinterpret_cast<size_t*>(root.get());
+    ASSERT_EQ(index[0], liveBlocks);
+    for (size_t i = 0; i < index[0]; i++) {
+        Pointer p = a.pointer(index[1 + 2 * i]);
+        ASSERT_NE(p.get(), nullptr);
+        ASSERT_GE(a.size(p), index[2 + 2 * i]);
+        ASSERT_TRUE(isDataOk(p, index[2 + 2 * i]));
+    }
+    ASSERT_EQ(a.stats().live_blocks, liveBlocks + 1);
+}
+
+TEST(Allocator, Persistent) {
+    string path = "allocator_test.heap";
+    remove(path.c_str());
+    AllocatorOptions options;
+    options.layout = AllocatorLayout::BoundaryTags;
+    size_t liveBlocks = 0;
+    void* rootAddr;
+    {
+        Allocator a(path, 1 << 20, options);
+        vector<Pointer> ptrs;
+        vector<size_t> sizes;
+        for (size_t i = 0; i < 300; i++) {
+            sizes.push_back(1 + i * 7 % 500);
+            ptrs.push_back(a.alloc(sizes.back()));
+            writeTo(ptrs.back(), sizes.back());
+        }
+        Pointer root = a.alloc((1 + 2 * ptrs.size()) * sizeof(size_t));
+        size_t* index = reinterpret_cast<size_t*>(root.get());
+        for (size_t i = 0; i < ptrs.size(); i++) {
+            if (i % 3 == 0) {
+                a.free(ptrs[i]);
+                continue;
+            }
+            index[1 + 2 * liveBlocks] = a.id(ptrs[i]);
+            index[2 + 2 * liveBlocks] = sizes[i];
+            liveBlocks++;
+        }
+        index[0] = liveBlocks;
+        a.set_root(root);
+        rootAddr = root.get();
+    }
+
+    // Reattached in place
+    {
+        Allocator a(path, 0, options);
+        EXPECT_EQ(a.root().get(), rootAddr);
+        checkPersisted(a, liveBlocks);
+    }
+
+    // The old address is taken, so the heap is rebased
+    size_t page = 4096;
+    void* blocker = mmap((void*)((size_t)rootAddr & ~(page - 1)), page, PROT_READ,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    ASSERT_NE(blocker, MAP_FAILED);
+    {
+        Allocator a(path, 0, options);
+        EXPECT_NE(a.root().get(), rootAddr);
+        checkPersisted(a, liveBlocks);
+
+        // Free lists and the vacant slot list are rebased as well
+        vector<Pointer> ptrs;
+        for (int i = 0; i < 200; i++) {
+            ptrs.push_back(a.alloc(1 + i * 13 % 300));
+        }
+        for (Pointer& p : ptrs) {
+            a.free(p);
+        }
+        a.defrag();
+        checkPersisted(a, liveBlocks);
+    }
+    munmap(blocker, page);
+    {
+        Allocator a(path, 0, options);
+        checkPersisted(a, liveBlocks);
+    }
+
+    // Opened with another layout
+    EXPECT_THROW(Allocator(path, 0, AllocatorOptions()), AllocError);
+    remove(path.c_str());
+}
+
+TEST(Allocator, PersistentAligned) {
+    string path = "allocator_test.heap";
+    remove(path.c_str());
+    const size_t alignment = 65536;
+    void* addr;
+    {
+        Allocator a(path, 1 << 20);
+        a.alloc(100); // so that the block needs padding
+        Pointer p = a.alloc_aligned(1000, alignment);
+        ASSERT_TRUE(isAligned(p, alignment));
+        writeTo(p, 1000);
+        a.set_root(p);
+        addr = p.get();
+    }
+
+    // Rebased by more than a page, still aligned
+    size_t page = 4096;
+    void* blocker = mmap(addr, page, PROT_READ,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    ASSERT_NE(blocker, MAP_FAILED);
+    {
+        Allocator a(path, 0);
+        Pointer p = a.root();
+        EXPECT_NE(p.get(), addr);
+        EXPECT_TRUE(isAligned(p, alignment));
+        EXPECT_TRUE(isDataOk(p, 1000));
+        a.realloc(p, 50000);
+        EXPECT_TRUE(isAligned(p, alignment));
+        EXPECT_TRUE(isDataOk(p, 1000));
+    }
+    munmap(blocker, page);
+    remove(path.c_str());
+}
+
+// Runs work on the file in a child process that dies without the destructor
+static void dieWith(const string& path, function<void(Allocator&)> work)
+{
+    pid_t pid = fork();
+    if (pid == 0) {
+        work(*new Allocator(path, 1 << 20));
+        _exit(0);
+    }
+    int status;
+    ASSERT_EQ(waitpid(pid, &status, 0), pid);
+    ASSERT_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+static void expectBadFile(const string& path)
+{
+    try {
+        Allocator a(path, 1 << 20);
+        EXPECT_TRUE(false) << "bad file reattached";
+    } catch (AllocError& e) {
+        EXPECT_EQ(e.getType(), AllocErrorType::BadFile);
+    }
+}
+
+TEST(Allocator, PersistentDirty) {
+    string path = "allocator_test.heap";
+    remove(path.c_str());
+
+    // Nothing changed after save(), so the file is reattached as of then
+    dieWith(path, [](Allocator& a) {
+        Pointer root = a.alloc(100);
+        writeTo(root, 100);
+        a.set_root(root);
+        a.save();
+    });
+    {
+        Allocator a(path, 0);
+        Pointer root = a.root();
+        ASSERT_NE(root.get(), nullptr);
+        EXPECT_TRUE(isDataOk(root, 100));
+    }
+
+    // Changed after save()
+    dieWith(path, [](Allocator& a) {
+        a.save();
+        a.alloc(100);
+    });
+    expectBadFile(path);
+
+    AllocatorOptions options;
+    options.reset_bad_file = true;
+    {
+        Allocator a(path, 0, options);
+        EXPECT_EQ(a.root().get(), nullptr);
+        EXPECT_EQ(a.stats().live_blocks, 0);
+        a.set_root(a.alloc(10));
+    }
+    {
+        Allocator a(path, 0);
+        EXPECT_NE(a.root().get(), nullptr) << "saved by the destructor";
+    }
+
+    // Not an allocator file at all
+    FILE* f = fopen(path.c_str(), "w");
+    fputs("not a heap", f);
+    fclose(f);
+    expectBadFile(path);
+    {
+        Allocator a(path, 1 << 20, options);
+        EXPECT_EQ(a.stats().live_blocks, 0);
+    }
+    remove(path.c_str());
+}
+
+static void stamp(ConcurrentAllocator& a, const Pointer& p, size_t size, int seed) {
+    Pointer::Pin pin = a.pin(p);
+    char* v = reinterpret_cast<char*>(pin.get());
+    for (size_t i = 0; i < size; i++) {
+        v[i] = (seed + i) % 127;
+    }
+}
+
+static bool isStamped(ConcurrentAllocator& a, const Pointer& p, size_t size, int seed) {
+    Pointer::Pin pin = a.pin(p);
+    char* v = reinterpret_cast<char*>(pin.get());
+    for (size_t i = 0; i < size; i++) {
+        if (v[i] != char((seed + i) % 127)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+TEST(ConcurrentAllocator, Stress) {
+    static char big[1 << 22];
+    ConcurrentAllocator a(big, sizeof(big));
+
+    // Published nodes are read by every thread while defrag moves things around
+    vector<Pointer> published;
+    for (int i = 0; i < 16; i++) {
+        published.push_back(a.alloc(100 + i));
+        stamp(a, published.back(), 100 + i, i);
+    }
+
+    atomic<bool> stop(false);
+    atomic<int> failures(0);
+    thread defragger([&] {
+        while (!stop) {
+            a.defrag_step(4096);
+            this_thread::yield();
+        }
+    });
+
+    vector<thread> workers;
+    for (int t = 0; t < 4; t++) {
+        workers.emplace_back([&, t] {
+            mt19937 rnd(t);
+            vector<Pointer> own;
+            vector<size_t> sizes;
+            for (int i = 0; i < 20000; i++) {
+                size_t k = own.empty() ? 0 : rnd() % own.size();
+                switch (own.size() < 32 ? 0 : rnd() % 3) {
+                case 0: {
+                    size_t size = 1 + rnd() % (rnd() % 8 ? 200 : 2000);
+                    own.push_back(a.alloc(size));
+                    sizes.push_back(size);
+                    stamp(a, own.back(), size, t);
+                    break;
+                }
+                case 1:
+                    failures += !isStamped(a, own[k], sizes[k], t);
+                    a.free(own[k]);
+                    own.erase(own.begin() + k);
+                    sizes.erase(sizes.begin() + k);
+                    break;
+                case 2: {
+                    size_t size = 1 + rnd() % 1000;
+                    a.realloc(own[k], size);
+                    failures += !isStamped(a, own[k], min(size, sizes[k]), t);
+                    sizes[k] = size;
+                    stamp(a, own[k], size, t);
+                    break;
+                }
+                }
+
+                size_t s = rnd() % published.size();
+                failures += !isStamped(a, published[s], 100 + s, s);
+            }
+
+            for (size_t k = 0; k < own.size(); k++) {
+                failures += !isStamped(a, own[k], sizes[k], t);
+                a.free(own[k]);
+            }
+            a.flush();
+        });
+    }
+
+    for (thread& w : workers) {
+        w.join();
+    }
+    stop = true;
+    defragger.join();
+
+    EXPECT_EQ(failures, 0);
+    for (size_t s = 0; s < published.size(); s++) {
+        EXPECT_TRUE(isStamped(a, published[s], 100 + s, s));
+        a.free(published[s]);
+    }
+    a.flush();
+
+    // Nothing is left cached or leaked
+    a.defrag();
+    Pointer p = a.alloc(sizeof(big) - 64 * sizeof(size_t));
+    a.free(p);
+}
+
+TEST(ConcurrentAllocator, StaleHandles) {
+    ConcurrentAllocator a(buf, sizeof(buf));
+
+    // The node stays in the thread magazine and comes back to the next alloc
+    Pointer p = a.alloc(32);
+    Pointer stale = p;
+    void* node = p.get();
+    a.free(p);
+    Pointer q = a.alloc(32);
+    ASSERT_EQ(q.get(), node);
+    expectStale([&] { stale.get(); });
+    expectStale([&] { a.free(stale); });
+    q.get();
+    a.free(q);
+    a.flush();
+}
+
+TEST(ConcurrentAllocator, RacingDoubleFree) {
+    ConcurrentAllocator a(buf, sizeof(buf));
+
+    // Of two threads freeing the same handle only one caches the slot
+    atomic<int> freed(0), stale(0);
+    for (int i = 0; i < 200; i++) {
+        Pointer p = a.alloc(32);
+        atomic<bool> go(false);
+        vector<thread> threads;
+        for (int t = 0; t < 2; t++) {
+            threads.emplace_back([&a, &go, &freed, &stale, p]() mutable {
+                while (!go) {
+                }
+                try {
+                    a.free(p);
+                    ++freed;
+                } catch (AllocError& e) {
+                    EXPECT_EQ(e.getType(), AllocErrorType::InvalidOperation);
+                    ++stale;
+                }
+                a.flush();
+            });
+        }
+        go = true;
+        for (thread& t : threads) {
+            t.join();
+        }
+    }
+    EXPECT_EQ(freed, 200);
+    EXPECT_EQ(stale, 200);
+    a.flush();
+    EXPECT_EQ(a.stats().live_blocks, 0);
+}
+
+TEST(ConcurrentAllocator, SmallSlabs) {
+    AllocatorOptions options;
+    options.small_slabs = true;
+    ConcurrentAllocator a(buf, sizeof(buf), options);
+
+    // Magazines are refilled by alloc_many, so they hold slab objects too
+    vector<Pointer> ptrs;
+    for (size_t i = 0; i < 300; i++) {
+        ptrs.push_back(a.alloc(16 + i % 3 * 40));
+        writeTo(ptrs.back(), 16 + i % 3 * 40);
+    }
+    EXPECT_GT(a.stats().small_objects, 0);
+    for (size_t i = 0; i < ptrs.size(); i++) {
+        EXPECT_TRUE(isDataOk(ptrs[i], 16 + i % 3 * 40));
+        a.free(ptrs[i]);
+    }
+    a.flush();
+    EXPECT_EQ(a.stats().small_objects, 0);
+}
+
+TEST(ConcurrentAllocator, PinnedNotMoved) {
+    ConcurrentAllocator a(buf, sizeof(buf));
+
+    Pointer hole = a.alloc(1000);
+    Pointer p = a.alloc(1000);
+    a.free(hole);
+
+    void* before;
+    {
+        Pointer::Pin pin = a.pin(p);
+        before = pin.get();
+        a.defrag();
+        EXPECT_EQ(pin.get(), before);
+    }
+
+    a.defrag();
+    EXPECT_NE(a.pin(p).get(), before);
+    a.free(p);
+}
@@ -0,0 +1,99 @@
+#include "allocator_trace.h"
+#include "allocator_error.h"
+#include <cstring>
+
+static const char magic[4] = {'A', 'T', 'R', 'C'};
+
+static bool hasId(TraceOp op) {
+  return op == TraceOp::Init || op == TraceOp::Alloc ||
+         op == TraceOp::Realloc || op == TraceOp::Free;
+}
+
+static bool hasSize(TraceOp op) {
+  return op != TraceOp::Free && op != TraceOp::Defrag;
+}
+
+TraceWriter::TraceWriter(const std::string &path)
+    : file(fopen(path.c_str(), "wb")) {
+  if (file == nullptr) {
+    throw AllocError(AllocErrorType::Internal, "can't open trace " + path);
+  }
+  buffer.reserve(buffer_size);
+  buffer.insert(buffer.end(), magic, magic + sizeof(magic));
+}
+
+TraceWriter::~TraceWriter() {
+  flush();
+  fclose(file);
+}
+
+void TraceWriter::record(TraceOp op, size_t id, size_t size) {
+  buffer.push_back((uint8_t)op);
+  if (hasId(op)) {
+    put(id);
+  }
+  if (hasSize(op)) {
+    put(size);
+  }
+  if (buffer.size() + 32 > buffer_size) {
+    flush();
+  }
+}
+
+void TraceWriter::flush() {
+  fwrite(buffer.data(), 1, buffer.size(), file);
+  fflush(file);
+  buffer.clear();
+}
+
+void TraceWriter::put(size_t value) {
+  while (value >= 0x80) {
+    buffer.push_back((uint8_t)(value | 0x80));
+    value >>= 7;
+  }
+  buffer.push_back((uint8_t)value);
+}
+
+/////////////////////////////////////////////////////////////////////////////////
+
+TraceReader::TraceReader(const std::string &path)
+    : file(fopen(path.c_str(), "rb")) {
+  if (file == nullptr) {
+    throw AllocError(AllocErrorType::Internal, "can't open trace " + path);
+  }
+  char head[sizeof(magic)];
+  if (fread(head, 1, sizeof(head), file) != sizeof(head) ||
+      memcmp(head, magic, sizeof(magic)) != 0) {
+    fclose(file);
+    throw AllocError(AllocErrorType::Internal, path + " is not a trace");
+  }
+}
+
+TraceReader::~TraceReader() { fclose(file); }
+
+bool TraceReader::next(TraceRecord &record) {
+  int op = fgetc(file);
+  if (op == EOF || op > (int)TraceOp::DefragStep) {
+    return false;
+  }
+  record.op = (TraceOp)op;
+  record.id = 0;
+  record.size = 0;
+  return (!hasId(record.op) || get(record.id)) &&
+         (!hasSize(record.op) || get(record.size));
+}
+
+bool TraceReader::get(size_t &value) {
+  value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    int byte = getc(file);
+    if (byte == EOF) {
+      return false;
+    }
+    value |= size_t(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
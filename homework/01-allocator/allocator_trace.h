@@ -0,0 +1,80 @@
+#ifndef ALLOCATOR_TRACE
+#define ALLOCATOR_TRACE
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/**
+ * Allocator call trace, see AllocatorOptions::trace.
+ *
+ * File is a "ATRC" magic followed by records: an op byte, then the handle
+ * id and the size as LEB128 varints (only the ones the op has). Handle id is
+ * the pointer slot index counted from the top of the table, so ids are
+ * reused after free just like slots are.
+ */
+enum class TraceOp : uint8_t {
+  Init,       // size: buffer size, id: layout
+  Alloc,      // id, size
+  AllocFail,  // size
+  Realloc,    // id, size
+  Free,       // id
+  Defrag,     //
+  DefragStep, // size: max_bytes_moved
+};
+
+struct TraceRecord {
+  TraceOp op;
+  size_t id;
+  size_t size;
+};
+
+class TraceWriter {
+public:
+  /**
+   * Truncates the file, throws AllocError(Internal) if it can't be opened
+   * @param path std::string
+   */
+  explicit TraceWriter(const std::string &path);
+  TraceWriter(const TraceWriter &) = delete;
+  TraceWriter &operator=(const TraceWriter &) = delete;
+  ~TraceWriter();
+
+  void record(TraceOp op, size_t id = 0, size_t size = 0);
+
+  /**
+   * Writes buffered records out
+   */
+  void flush();
+
+private:
+  static constexpr size_t buffer_size = 64 * 1024;
+  FILE *file;
+  std::vector<uint8_t> buffer;
+
+  void put(size_t value);
+};
+
+class TraceReader {
+public:
+  /**
+   * Throws AllocError(Internal) if the file can't be opened or isn't a trace
+   * @param path std::string
+   */
+  explicit TraceReader(const std::string &path);
+  TraceReader(const TraceReader &) = delete;
+  TraceReader &operator=(const TraceReader &) = delete;
+  ~TraceReader();
+
+  /**
+   * @return false at the end of the trace
+   */
+  bool next(TraceRecord &record);
+
+private:
+  FILE *file;
+
+  bool get(size_t &value);
+};
+
+#endif // ALLOCATOR_TRACE
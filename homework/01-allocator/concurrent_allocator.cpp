@@ -0,0 +1,161 @@
+#include "concurrent_allocator.h"
+#include "allocator_error.h"
+#include <atomic>
+
+static std::atomic<size_t> next_id(1);
+
+thread_local std::vector<std::pair<size_t, ConcurrentAllocator::ThreadCache *>>
+    ConcurrentAllocator::thread_caches;
+
+ConcurrentAllocator::ConcurrentAllocator(void *base, size_t size,
+                                         const AllocatorOptions &options)
+    : id(next_id++), allocator(base, size, options) {}
+
+Pointer ConcurrentAllocator::alloc(size_t N) {
+  if (N == 0 || N > class_step * class_count) {
+    std::lock_guard<std::mutex> guard(lock);
+    return allocator.alloc(N);
+  }
+
+  size_t cls = (N - 1) / class_step;
+  std::vector<Pointer> &magazine = cache().magazines[cls];
+  if (magazine.empty()) {
+    refill(magazine, cls);
+  }
+  Pointer p = magazine.back();
+  magazine.pop_back();
+  return p;
+}
+
+Pointer ConcurrentAllocator::alloc_aligned(size_t N, size_t alignment) {
+  std::lock_guard<std::mutex> guard(lock);
+  return allocator.alloc_aligned(N, alignment);
+}
+
+void ConcurrentAllocator::realloc(Pointer &p, size_t N) {
+  std::lock_guard<std::mutex> guard(lock);
+  allocator.realloc(p, N);
+}
+
+void ConcurrentAllocator::free(Pointer &p) {
+  if (p.inner_ptr == nullptr) {
+    return;
+  }
+  if (p.small()) { // slab objects have no slot to cache, see small_slabs
+    std::lock_guard<std::mutex> guard(lock);
+    allocator.free(p);
+    return;
+  }
+  if (!allocator.live(p)) { // the slot is not touched unless it is live
+    Pointer::stale("free() of a freed ptr");
+  }
+
+  // node may be moved by a concurrent defrag step, pin it to read the size
+  p.inner_ptr->pin();
+  size_t capacity = allocator.size(p);
+  p.inner_ptr->unpin();
+
+  if (capacity < class_step || capacity >= class_step * (class_count + 1)) {
+    std::lock_guard<std::mutex> guard(lock);
+    allocator.free(p);
+    return;
+  }
+  if (p.inner_ptr->pinned()) {
+    throw AllocError(AllocErrorType::InvalidOperation, "free() of pinned ptr");
+  }
+
+  std::vector<Pointer> &magazine = cache().magazines[capacity / class_step - 1];
+  if (magazine.size() >= magazine_size) {
+    drain(magazine, magazine_size / 2);
+  }
+  // the slot stays allocated, handles to it go stale all the same. Of two
+  // threads freeing the same handle only one gets the slot
+  size_t generation = p.generation;
+  if (!__atomic_compare_exchange_n(&p.inner_ptr->generation, &generation,
+                                   generation + 1, false, __ATOMIC_ACQ_REL,
+                                   __ATOMIC_RELAXED)) {
+    Pointer::stale("free() of a freed ptr");
+  }
+  Pointer cached;
+  cached.inner_ptr = p.inner_ptr;
+  cached.generation = generation + 1;
+  magazine.push_back(cached);
+  p = Pointer();
+}
+
+Pointer::Pin ConcurrentAllocator::pin(const Pointer &p) {
+  std::lock_guard<std::mutex> guard(lock);
+  return allocator.pin(p);
+}
+
+void ConcurrentAllocator::defrag() {
+  while (defrag_step(defrag_budget) > 0) {
+  }
+}
+
+size_t ConcurrentAllocator::defrag_step(size_t max_bytes_moved) {
+  std::lock_guard<std::mutex> guard(lock);
+  return allocator.defrag_step(max_bytes_moved);
+}
+
+void ConcurrentAllocator::flush() {
+  ThreadCache &thread_cache = cache();
+  for (std::vector<Pointer> &magazine : thread_cache.magazines) {
+    drain(magazine, 0);
+  }
+}
+
+AllocatorStats ConcurrentAllocator::stats() {
+  std::lock_guard<std::mutex> guard(lock);
+  return allocator.stats();
+}
+
+std::string ConcurrentAllocator::dump() { return stats().text(); }
+
+ConcurrentAllocator::ThreadCache &ConcurrentAllocator::cache() {
+  for (auto &ref : thread_caches) {
+    if (ref.first == id) {
+      return *ref.second;
+    }
+  }
+
+  std::lock_guard<std::mutex> guard(lock);
+  caches.emplace_back(new ThreadCache());
+  thread_caches.emplace_back(id, caches.back().get());
+  return *caches.back();
+}
+
+void ConcurrentAllocator::refill(std::vector<Pointer> &magazine, size_t cls) {
+  std::lock_guard<std::mutex> guard(lock);
+  std::vector<size_t> sizes(magazine_size / 2, (cls + 1) * class_step);
+  magazine.resize(sizes.size());
+  try {
+    allocator.alloc_many(sizes.data(), sizes.size(), magazine.data());
+    return;
+  } catch (AllocError &e) {
+    magazine.clear();
+    if (e.getType() != AllocErrorType::NoMemory) {
+      throw;
+    }
+  }
+  // not enough memory for the whole batch, take what is left
+  for (size_t i = 0; i < magazine_size / 2; i++) {
+    try {
+      magazine.push_back(allocator.alloc((cls + 1) * class_step));
+    } catch (AllocError &e) {
+      if (e.getType() != AllocErrorType::NoMemory || magazine.empty()) {
+        throw;
+      }
+      break;
+    }
+  }
+}
+
+void ConcurrentAllocator::drain(std::vector<Pointer> &magazine, size_t keep) {
+  if (magazine.size() <= keep) {
+    return;
+  }
+  std::lock_guard<std::mutex> guard(lock);
+  allocator.free_many(magazine.data() + keep, magazine.size() - keep);
+  magazine.resize(keep);
+}
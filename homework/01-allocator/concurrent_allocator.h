@@ -0,0 +1,83 @@
+#ifndef ALLOCATOR_CONCURRENT
+#define ALLOCATOR_CONCURRENT
+#include "allocator.h"
+#include "allocator_pointer.h"
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+/**
+ * Thread safe front end of Allocator: many threads share one buffer.
+ *
+ * Small requests are served from per-thread magazines: stacks of nodes (with
+ * their pointer slots) that are already allocated in the shared heap at a size
+ * class. free() of such node puts it back to the magazine of the calling
+ * thread. The shared Allocator is locked only to refill or flush a magazine,
+ * for large requests, realloc() and defrag steps.
+ *
+ * Nodes may be moved by defrag() while other threads allocate, so memory is
+ * accessed through pin(): defrag passes pinned nodes by.
+ */
+class ConcurrentAllocator {
+public:
+  static constexpr size_t class_step = 16;
+  static constexpr size_t class_count = 16; // magazines serve up to 256 bytes
+  static constexpr size_t magazine_size = 64;
+  static constexpr size_t defrag_budget = 64 * 1024; // bytes per lock hold
+
+  ConcurrentAllocator(void *base, size_t size,
+                      const AllocatorOptions &options = AllocatorOptions());
+  ConcurrentAllocator(const ConcurrentAllocator &) = delete;
+  ConcurrentAllocator &operator=(const ConcurrentAllocator &) = delete;
+
+  Pointer alloc(size_t N);
+  Pointer alloc_aligned(size_t N, size_t alignment); // bypasses magazines
+  void realloc(Pointer &p, size_t N);
+  void free(Pointer &p);
+
+  /**
+   * Allocator::pin, the handle is checked under the lock. The pin itself is
+   * released without it
+   */
+  Pointer::Pin pin(const Pointer &p);
+
+  /**
+   * Compacts the heap step by step, the lock is released between the steps.
+   * Pinned nodes are passed by
+   */
+  void defrag();
+  size_t defrag_step(size_t max_bytes_moved);
+
+  /**
+   * Returns nodes cached by the calling thread to the shared heap. Threads
+   * should call it before exit, otherwise their nodes stay allocated.
+   */
+  void flush();
+
+  /**
+   * Allocator::stats() of the shared heap. Nodes cached in magazines are
+   * counted as live
+   */
+  AllocatorStats stats();
+  std::string dump();
+
+private:
+  struct ThreadCache {
+    std::vector<Pointer> magazines[class_count];
+  };
+
+  // (allocator id, cache) of every allocator the thread has used
+  static thread_local std::vector<std::pair<size_t, ThreadCache *>> thread_caches;
+
+  const size_t id;
+  std::mutex lock;
+  Allocator allocator;
+  std::vector<std::unique_ptr<ThreadCache>> caches;
+
+  ThreadCache &cache();
+  void refill(std::vector<Pointer> &magazine, size_t cls);
+  void drain(std::vector<Pointer> &magazine, size_t keep);
+};
+
+#endif // ALLOCATOR_CONCURRENT
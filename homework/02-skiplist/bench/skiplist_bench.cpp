@@ -0,0 +1,375 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <malloc.h>
+#include <mutex>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include <skiplist/concurrent_skiplist.h>
+#include <skiplist/skiplist.h>
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+/**
+ * SkipList benchmarks, one section per aspect:
+ *
+ *   skiplist_bench [--filter SECTION]
+ *
+ * single: SkipList Put and Get latency and heap bytes per entry, values
+ * referenced and owned
+ *
+ * scan: SkipList lookup and full iteration throughput
+ *
+ * alloc: OwningSkipList with the default NodeArena against HeapNodeAllocator,
+ * insert throughput, heap and resident bytes per entry, scan and destruction
+ *
+ * concurrent: ConcurrentSkipList against SkipList behind a mutex, read heavy
+ * and write heavy mixes at 1..16 threads
+ */
+
+static const int keyRange = 1 << 16;
+static vector<int> values(keyRange);
+
+// Heap bytes in use, malloc rounding included
+static atomic<size_t> heapBytes(0);
+
+// Kept out of line: once inlined into operator new/delete, gcc pairs the
+// new-expressions with free() and warns -Wmismatched-new-delete
+__attribute__((noinline)) static void* heapAlloc(size_t size)
+{
+    void* p = malloc(size);
+    if (p != nullptr) {
+        heapBytes.fetch_add(malloc_usable_size(p), memory_order_relaxed);
+    }
+    return p;
+}
+
+__attribute__((noinline)) static void heapFree(void* p)
+{
+    if (p != nullptr) {
+        heapBytes.fetch_sub(malloc_usable_size(p), memory_order_relaxed);
+        free(p);
+    }
+}
+
+void* operator new(size_t size)
+{
+    void* p = heapAlloc(size);
+    if (p == nullptr) {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    heapFree(p);
+}
+
+static double seconds(Clock::time_point start)
+{
+    return chrono::duration<double>(Clock::now() - start).count();
+}
+
+static double nsPerOp(Clock::time_point start, size_t ops)
+{
+    return seconds(start) * 1e9 / ops;
+}
+
+static void put(SkipList<int, int, 16>& list, int key, int& value)
+{
+    list.Put(key, value);
+}
+
+static void put(OwningSkipList<int, int, 16>& list, int key, int& value)
+{
+    list.InsertOrAssign(key, value);
+}
+
+template <class List>
+static void benchSingle(const char* name)
+{
+    const size_t counts[] = { 1 << 10, 1 << 14, 1 << 18 };
+
+    printf("single: %s, ns per op, bytes per entry\n", name);
+    printf("%10s %10s %10s %10s %10s\n", "entries", "put", "get-hit", "get-miss", "bytes");
+    for (size_t count : counts) {
+        vector<int> keys(count);
+        for (size_t i = 0; i < count; i++) {
+            keys[i] = int(i * 2);
+        }
+        shuffle(keys.begin(), keys.end(), mt19937(1));
+        int value = 0;
+
+        size_t before = heapBytes;
+        auto list = new List();
+        size_t empty = heapBytes;
+        Clock::time_point start = Clock::now();
+        for (int key : keys) {
+            put(*list, key, value);
+        }
+        double put = nsPerOp(start, count);
+        double bytes = double(heapBytes - empty) / count;
+
+        // the same number of lookups whatever the size
+        size_t lookups = 1 << 20;
+        size_t found = 0;
+        start = Clock::now();
+        for (size_t i = 0; i < lookups; i++) {
+            found += list->Get(keys[i % count]) != nullptr;
+        }
+        double hit = nsPerOp(start, lookups);
+        start = Clock::now();
+        for (size_t i = 0; i < lookups; i++) {
+            found += list->Get(keys[i % count] + 1) != nullptr;
+        }
+        double miss = nsPerOp(start, lookups);
+        if (found != lookups) {
+            fprintf(stderr, "single: lookups failed\n");
+            exit(1);
+        }
+
+        delete list;
+        if (heapBytes != before) {
+            fprintf(stderr, "single: %zd bytes leaked\n", heapBytes - before);
+        }
+        printf("%10zu %10.1f %10.1f %10.1f %10.1f\n", count, put, hit, miss, bytes);
+    }
+}
+
+static void benchScan()
+{
+    const size_t counts[] = { 1 << 10, 1 << 16, 1 << 20 };
+
+    printf("scan: SkipList<int, int, 16>, million lookups and scanned entries per second\n");
+    printf("%10s %10s %10s\n", "entries", "lookup", "scan");
+    for (size_t count : counts) {
+        vector<int> keys(count);
+        for (size_t i = 0; i < count; i++) {
+            keys[i] = int(i);
+        }
+        shuffle(keys.begin(), keys.end(), mt19937(1));
+        vector<int> data(keys);
+
+        SkipList<int, int, 16> list;
+        for (size_t i = 0; i < count; i++) {
+            list.Put(keys[i], data[i]);
+        }
+
+        size_t lookups = 1 << 21;
+        long sum = 0;
+        Clock::time_point start = Clock::now();
+        for (size_t i = 0; i < lookups; i++) {
+            sum += *list.Get(keys[i % count]);
+        }
+        double lookup = lookups / seconds(start) / 1e6;
+
+        size_t passes = (1 << 23) / count, scanned = 0;
+        start = Clock::now();
+        for (size_t pass = 0; pass < passes; pass++) {
+            for (auto it = list.cbegin(); it != list.cend(); ++it) {
+                sum += *it;
+                scanned++;
+            }
+        }
+        double scan = scanned / seconds(start) / 1e6;
+        if (scanned != passes * count || sum == 0) {
+            fprintf(stderr, "scan: wrong count\n");
+            exit(1);
+        }
+        printf("%10zu %10.2f %10.2f\n", count, lookup, scan);
+    }
+}
+
+// Resident set size from /proc
+static size_t rssBytes()
+{
+    size_t pages = 0, resident = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (f != nullptr) {
+        if (fscanf(f, "%zu %zu", &pages, &resident) != 2) {
+            resident = 0;
+        }
+        fclose(f);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+template <class Alloc>
+static void benchAlloc(const char* name, size_t count)
+{
+    typedef OwningSkipList<int, int, 16, less<int>, Alloc> List;
+    vector<int> keys(count);
+    for (size_t i = 0; i < count; i++) {
+        keys[i] = int(i);
+    }
+    shuffle(keys.begin(), keys.end(), mt19937(1));
+
+    malloc_trim(0);
+    size_t heap = heapBytes, rss = rssBytes();
+    Clock::time_point start = Clock::now();
+    List* list = new List();
+    for (int key : keys) {
+        list->InsertOrAssign(key, key);
+    }
+    double insert = count / seconds(start) / 1e6;
+    double heapPer = double(heapBytes - heap) / count;
+    double rssPer = double(rssBytes() - rss) / count;
+
+    size_t passes = (1 << 23) / count, scanned = 0;
+    long sum = 0;
+    start = Clock::now();
+    for (size_t pass = 0; pass < passes; pass++) {
+        for (auto it = list->cbegin(); it != list->cend(); ++it) {
+            sum += *it;
+            scanned++;
+        }
+    }
+    double scan = scanned / seconds(start) / 1e6;
+
+    start = Clock::now();
+    delete list;
+    double destroy = seconds(start) * 1e3;
+    if (scanned != passes * count || sum == 0 || heapBytes != heap) {
+        fprintf(stderr, "alloc: wrong count or leak\n");
+        exit(1);
+    }
+    printf("%-10s %10zu %10.2f %10.1f %10.1f %10.2f %10.2f\n", name, count, insert, heapPer,
+        rssPer, scan, destroy);
+}
+
+static void benchAllocators()
+{
+    const size_t counts[] = { 1 << 14, 1 << 20 };
+
+    printf("alloc: OwningSkipList<int, int, 16>, Mops/s, bytes per entry, ms\n");
+    printf("%-10s %10s %10s %10s %10s %10s %10s\n", "allocator", "entries", "insert", "heap",
+        "rss", "scan", "destroy");
+    for (size_t count : counts) {
+        benchAlloc<NodeArena>("arena", count);
+        benchAlloc<HeapNodeAllocator>("new", count);
+    }
+}
+
+// SkipList behind one lock, the baseline of the concurrent section
+class LockedSkipList {
+public:
+    int* Put(int key, int& value)
+    {
+        lock_guard<mutex> guard(lock);
+        return list.Put(key, value);
+    }
+
+    int* Get(int key)
+    {
+        lock_guard<mutex> guard(lock);
+        return list.Get(key);
+    }
+
+    int* Delete(int key)
+    {
+        lock_guard<mutex> guard(lock);
+        return list.Delete(key);
+    }
+
+private:
+    mutex lock;
+    SkipList<int, int, 16> list;
+};
+
+struct Mix {
+    const char* name;
+    int getPercent;
+    int putPercent; // the rest are deletes
+};
+
+// Million ops per second of all threads together, ops split between them
+template <class List>
+static double runMix(List& list, const Mix& mix, int threads, size_t ops)
+{
+    for (int key = 0; key < keyRange; key += 2) {
+        list.Put(key, values[key]);
+    }
+
+    vector<thread> workers;
+    Clock::time_point start = Clock::now();
+    for (int t = 0; t < threads; t++) {
+        workers.emplace_back([&, t]() {
+            mt19937 rnd(t + 1);
+            for (size_t i = 0; i < ops / threads; i++) {
+                unsigned r = rnd();
+                int key = (r >> 8) % keyRange;
+                int op = r % 100;
+                if (op < mix.getPercent) {
+                    list.Get(key);
+                } else if (op < mix.getPercent + mix.putPercent) {
+                    list.Put(key, values[key]);
+                } else {
+                    list.Delete(key);
+                }
+            }
+        });
+    }
+    for (auto& w : workers) {
+        w.join();
+    }
+    return ops / seconds(start) / 1e6;
+}
+
+static void benchConcurrent()
+{
+    const size_t ops = 2000000;
+    const Mix mixes[] = { { "read-heavy", 90, 5 }, { "write-heavy", 20, 40 } };
+
+    printf("concurrent: Mops/s, %d keys, %u cpus\n", keyRange, thread::hardware_concurrency());
+    printf("%-12s %8s %12s %12s\n", "mix", "threads", "lock-free", "mutex");
+    for (auto& mix : mixes) {
+        for (int threads = 1; threads <= 16; threads *= 2) {
+            ConcurrentSkipList<int, int, 16> lockFree;
+            LockedSkipList locked;
+            double a = runMix(lockFree, mix, threads, ops);
+            double b = runMix(locked, mix, threads, ops);
+            printf("%-12s %8d %12.2f %12.2f\n", mix.name, threads, a, b);
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    const char* filter = nullptr;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--filter") && i + 1 < argc) {
+            filter = argv[++i];
+        } else {
+            fprintf(stderr, "usage: skiplist_bench [--filter SECTION]\n");
+            return 2;
+        }
+    }
+    for (int i = 0; i < keyRange; i++) {
+        values[i] = i;
+    }
+
+    if (filter == nullptr || !strcmp(filter, "single")) {
+        benchSingle<SkipList<int, int, 16>>("SkipList<int, int, 16>");
+        benchSingle<OwningSkipList<int, int, 16>>("OwningSkipList<int, int, 16>");
+    }
+    if (filter == nullptr || !strcmp(filter, "scan")) {
+        benchScan();
+    }
+    if (filter == nullptr || !strcmp(filter, "alloc")) {
+        benchAllocators();
+    }
+    if (filter == nullptr || !strcmp(filter, "concurrent")) {
+        benchConcurrent();
+    }
+    return 0;
+}
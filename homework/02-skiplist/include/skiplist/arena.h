@@ -0,0 +1,124 @@
+#ifndef __ARENA_H
+#define __ARENA_H
+#include <cassert>
+#include <cstddef>
+#include <new>
+#include <vector>
+
+/**
+ * SkipList node allocators. An allocator is owned by its list and provides:
+ *
+ *   void *allocate(size_t bytes, size_t alignment);
+ *   void deallocate(void *p, size_t bytes);
+ *   static const bool releases_all; // its destructor frees every allocation
+ *
+ * With releases_all the list doesn't free nodes one by one on destruction,
+ * it only runs the key and value destructors if there are any.
+ */
+
+/**
+ * Per-list arena: nodes are cut from chunks taken from the global heap, a
+ * freed node goes to a free list of its size and is reused by the next node
+ * of that size. Chunks double in size up to max_chunk, so most inserts don't
+ * touch the global heap, nodes inserted one after another are adjacent, and
+ * the whole list is released by freeing its chunks.
+ */
+class NodeArena {
+public:
+  static const bool releases_all = true;
+  static const size_t min_chunk = 4096;
+  static const size_t max_chunk = 1 << 20;
+
+  NodeArena() : pChunks(nullptr), pCur(nullptr), pEnd(nullptr), next_chunk(min_chunk) {}
+  NodeArena(const NodeArena &) = delete;
+  NodeArena &operator=(const NodeArena &) = delete;
+
+  ~NodeArena() {
+    while (pChunks != nullptr) {
+      Chunk *next = pChunks->pNext;
+      ::operator delete(pChunks);
+      pChunks = next;
+    }
+  }
+
+  void *allocate(size_t bytes, size_t alignment) {
+    size_t cls = size_class(bytes);
+    if (cls < aFree.size() && aFree[cls] != nullptr) {
+      FreeNode *node = aFree[cls];
+      aFree[cls] = node->pNext;
+      return node;
+    }
+
+    char *p = align(pCur, alignment);
+    if (pCur == nullptr || p + bytes > pEnd) {
+      grow(bytes + alignment);
+      p = align(pCur, alignment);
+    }
+    pCur = p + bytes;
+    return p;
+  }
+
+  void deallocate(void *p, size_t bytes) {
+    size_t cls = size_class(bytes);
+    if (cls >= aFree.size()) {
+      aFree.resize(cls + 1, nullptr);
+    }
+    FreeNode *node = static_cast<FreeNode *>(p);
+    node->pNext = aFree[cls];
+    aFree[cls] = node;
+  }
+
+private:
+  struct Chunk {
+    Chunk *pNext;
+  };
+
+  struct FreeNode {
+    FreeNode *pNext;
+  };
+
+  Chunk *pChunks;
+  char *pCur;
+  char *pEnd;
+  size_t next_chunk;
+  std::vector<FreeNode *> aFree; // by size in words
+
+  static size_t size_class(size_t bytes) {
+    assert(bytes >= sizeof(FreeNode));
+    return (bytes + sizeof(void *) - 1) / sizeof(void *);
+  }
+
+  static char *align(char *p, size_t alignment) {
+    return (char *)(((size_t)p + alignment - 1) & ~(alignment - 1));
+  }
+
+  // The rest of the current chunk is dropped, it is less than a node
+  void grow(size_t bytes) {
+    size_t size = next_chunk;
+    if (size < bytes + sizeof(Chunk)) {
+      size = bytes + sizeof(Chunk);
+    }
+    if (next_chunk < max_chunk) {
+      next_chunk *= 2;
+    }
+
+    Chunk *chunk = static_cast<Chunk *>(::operator new(size));
+    chunk->pNext = pChunks;
+    pChunks = chunk;
+    pCur = (char *)(chunk + 1);
+    pEnd = (char *)chunk + size;
+  }
+};
+
+/**
+ * Every node is a separate global heap allocation
+ */
+class HeapNodeAllocator {
+public:
+  static const bool releases_all = false;
+
+  void *allocate(size_t bytes, size_t) { return ::operator new(bytes); }
+  void deallocate(void *p, size_t) { ::operator delete(p); }
+};
+
+#endif // __ARENA_H
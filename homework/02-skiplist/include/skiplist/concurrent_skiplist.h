@@ -0,0 +1,393 @@
+#ifndef __CONCURRENT_SKIPLIST_H
+#define __CONCURRENT_SKIPLIST_H
+#include "epoch.h"
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <new>
+#include <type_traits>
+
+/**
+ * Lock-free skiplist with the SkipList interface, safe to use from many
+ * threads at once.
+ *
+ * Every key is one tower node with an array of atomic next pointers, one per
+ * level. The key is present while its node holds a non-null value: Delete
+ * nulls the value (that is its linearization point), marks the next pointers
+ * (low bit) top-down, and every traversal that meets a marked pointer helps
+ * to unlink the node. Put and PutIfAbsent either swap the value of the live
+ * node or link a new node at level 0 with a CAS, upper levels are linked
+ * afterwards. Unlinked nodes are freed through Epoch, so readers never touch
+ * freed memory.
+ *
+ * A key may have several nodes for a moment: a deleted node stays linked
+ * until it is unlinked, a new one is linked in front of it. At most one of
+ * them is live.
+ */
+template <class Key, class Value, size_t MAXHEIGHT, class Less = std::less<Key>>
+class ConcurrentSkipList {
+private:
+  static const size_t levels = MAXHEIGHT + 1; // data level and index levels
+
+  enum { Inserting = 1, Removed = 2 };
+
+  struct Node {
+    std::atomic<Value *> value;
+    std::atomic<unsigned> state; // Inserting while upper levels are linked
+    size_t height;
+    typename std::aligned_storage<sizeof(Key), alignof(Key)>::type storage;
+    std::atomic<uintptr_t> next[1]; // height entries, low bit marks deletion
+
+    const Key &key() const { return *reinterpret_cast<const Key *>(&storage); }
+  };
+
+  Node *pHead;
+
+public:
+  /**
+   * Const iterator over live keys, keeps the calling thread pinned (see Epoch)
+   */
+  class Iterator {
+  private:
+    Epoch::Guard guard;
+    Node *pCurrent;
+    Value *pValue;
+
+    // stops at the first live node starting with p
+    void settle(Node *p) {
+      for (; p != nullptr; p = unmark(p->next[0].load(std::memory_order_acquire))) {
+        pValue = p->value.load(std::memory_order_acquire);
+        if (pValue != nullptr) {
+          break;
+        }
+      }
+      pCurrent = p;
+    }
+
+  public:
+    explicit Iterator(Node *p) : pValue(nullptr) { settle(p); }
+
+    const Key &key() const {
+      assert(pCurrent != nullptr);
+      return pCurrent->key();
+    }
+
+    const Value &value() const {
+      assert(pCurrent != nullptr);
+      return *pValue;
+    }
+
+    const Value &operator*() const { return value(); }
+
+    bool operator==(const Iterator &it) const { return pCurrent == it.pCurrent; }
+    bool operator!=(const Iterator &it) const { return pCurrent != it.pCurrent; }
+
+    Iterator &operator++() {
+      assert(pCurrent != nullptr);
+      settle(unmark(pCurrent->next[0].load(std::memory_order_acquire)));
+      return *this;
+    }
+
+    Iterator operator++(int) {
+      Iterator it(*this);
+      ++*this;
+      return it;
+    }
+  };
+
+  /**
+   * Creates new empty skiplist
+   */
+  ConcurrentSkipList() {
+    static_assert(std::is_copy_constructible<Key>(), "");
+    pHead = allocate(levels);
+  }
+
+  ConcurrentSkipList(const ConcurrentSkipList &that) = delete;
+
+  /**
+   * Destructor, no other thread may use the list by then. Deleted nodes are
+   * already unlinked and retired, the rest is reachable at level 0
+   */
+  ~ConcurrentSkipList() {
+    Node *p = unmark(pHead->next[0].load());
+    while (p != nullptr) {
+      Node *next = unmark(p->next[0].load());
+      destroy(p);
+      p = next;
+    }
+    pHead->~Node();
+    ::operator delete(pHead);
+  }
+
+  /**
+   * Assign new value for the key. If a such key already has
+   * association then old value returns, otherwise nullptr
+   *
+   * @param key key to be assigned with value
+   * @param value to be added
+   * @return old value for the given key or nullptr
+   */
+  Value *Put(const Key &key, Value &value) { return insert(key, value, true); }
+
+  /**
+   * Put value only if there is no association with key in
+   * the list and returns nullptr
+   *
+   * If there is an established association with the key already
+   * method doesn't nothing and returns existing value
+   *
+   * @param key key to be assigned with value
+   * @param value to be added
+   * @return existing value for the given key or nullptr
+   */
+  Value *PutIfAbsent(const Key &key, Value &value) {
+    return insert(key, value, false);
+  }
+
+  /**
+   * Returns value assigned for the given key or nullptr
+   * if there is no established association with the given key
+   *
+   * @param key to find
+   * @return value associated with given key or nullptr
+   */
+  Value *Get(const Key &key) const {
+    Epoch::Guard guard;
+    for (Node *p = lower_bound(key); p != nullptr && !Less()(key, p->key());
+         p = unmark(p->next[0].load(std::memory_order_acquire))) {
+      Value *value = p->value.load(std::memory_order_acquire);
+      if (value != nullptr) {
+        return value;
+      }
+    }
+    return nullptr;
+  }
+
+  /**
+   * Remove given key from the skiplist and returns value
+   * it has or nullptr in case if key wasn't associated with
+   * any value
+   *
+   * @param key to be added
+   * @return value for the removed key or nullptr
+   */
+  Value *Delete(const Key &key) {
+    Epoch::Guard guard;
+    Node *preds[levels], *succs[levels];
+    find(key, preds, succs);
+    for (Node *p = succs[0]; p != nullptr && !Less()(key, p->key());
+         p = unmark(p->next[0].load(std::memory_order_acquire))) {
+      Value *value = p->value.load(std::memory_order_acquire);
+      while (value != nullptr) {
+        if (p->value.compare_exchange_weak(value, nullptr)) {
+          remove(p);
+          return value;
+        }
+      }
+    }
+    return nullptr;
+  }
+
+  /**
+   * Same as Get
+   */
+  Value *operator[](const Key &key) const { return Get(key); }
+
+  /**
+   * Return iterator onto very first key in the skiplist
+   */
+  Iterator cbegin() const {
+    Epoch::Guard guard; // until the iterator takes its own
+    return Iterator(unmark(pHead->next[0].load(std::memory_order_acquire)));
+  }
+
+  /**
+   * Returns iterator to the first key that is greater or equals to
+   * the given key
+   */
+  Iterator cfind(const Key &min) const {
+    Epoch::Guard guard;
+    return Iterator(lower_bound(min));
+  }
+
+  /**
+   * Returns iterator on the skiplist tail
+   */
+  Iterator cend() const { return Iterator(nullptr); }
+
+private:
+  static Node *unmark(uintptr_t p) { return (Node *)(p & ~uintptr_t(1)); }
+  static bool marked(uintptr_t p) { return p & 1; }
+
+  static Node *allocate(size_t height) {
+    void *mem = ::operator new(sizeof(Node) + (height - 1) * sizeof(std::atomic<uintptr_t>));
+    Node *node = new (mem) Node;
+    node->value.store(nullptr, std::memory_order_relaxed);
+    node->state.store(0, std::memory_order_relaxed);
+    node->height = height;
+    for (size_t i = 0; i < height; i++) {
+      new (&node->next[i]) std::atomic<uintptr_t>(0);
+    }
+    return node;
+  }
+
+  static void destroy(void *p) {
+    Node *node = (Node *)p;
+    node->key().~Key();
+    node->~Node();
+    ::operator delete(p);
+  }
+
+  // 1 + the number of coin flips in a row, like put_new of SkipList
+  static size_t random_height() {
+    static thread_local uint64_t seed = 0;
+    if (seed == 0) {
+      seed = (uint64_t)(uintptr_t)&seed * 0x9E3779B97F4A7C15ull | 1;
+    }
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    size_t height = 1;
+    for (uint64_t bits = seed; height < levels && (bits & 1); bits >>= 1) {
+      height++;
+    }
+    return height;
+  }
+
+  // First node at level 0 that is not less than key, dead or not. Read only
+  Node *lower_bound(const Key &key) const {
+    Node *pred = pHead;
+    Node *cur = nullptr;
+    for (size_t i = levels; i-- > 0;) {
+      cur = unmark(pred->next[i].load(std::memory_order_acquire));
+      while (cur != nullptr && Less()(cur->key(), key)) {
+        pred = cur;
+        cur = unmark(cur->next[i].load(std::memory_order_acquire));
+      }
+    }
+    return cur;
+  }
+
+  /**
+   * Fills preds with the last node less than key and succs with the next one
+   * at every level, unlinking marked nodes on the way. With target set it
+   * goes on through the nodes equal to key until the target, so the target
+   * is unlinked wherever it is among them
+   */
+  void find(const Key &key, Node **preds, Node **succs,
+            Node *target = nullptr) const {
+  retry:
+    Node *pred = pHead;
+    for (size_t i = levels; i-- > 0;) {
+      Node *cur = unmark(pred->next[i].load(std::memory_order_acquire));
+      while (cur != nullptr) {
+        uintptr_t succ = cur->next[i].load(std::memory_order_acquire);
+        if (marked(succ)) {
+          uintptr_t expected = (uintptr_t)cur;
+          if (!pred->next[i].compare_exchange_strong(expected, succ & ~uintptr_t(1))) {
+            goto retry;
+          }
+          cur = unmark(succ);
+          continue;
+        }
+        if (!Less()(cur->key(), key)
+            && (target == nullptr || cur == target || Less()(key, cur->key()))) {
+          break;
+        }
+        pred = cur;
+        cur = unmark(succ);
+      }
+      preds[i] = pred;
+      succs[i] = cur;
+    }
+  }
+
+  Value *insert(const Key &key, Value &value, bool replace) {
+    Epoch::Guard guard;
+    Node *preds[levels], *succs[levels];
+    Node *node = nullptr;
+    for (;;) {
+      find(key, preds, succs);
+      for (Node *p = succs[0]; p != nullptr && !Less()(key, p->key());
+           p = unmark(p->next[0].load(std::memory_order_acquire))) {
+        Value *old = p->value.load(std::memory_order_acquire);
+        while (old != nullptr) {
+          if (!replace || p->value.compare_exchange_weak(old, &value)) {
+            if (node != nullptr) {
+              destroy(node); // never published
+            }
+            return old;
+          }
+        }
+      }
+
+      if (node == nullptr) {
+        node = allocate(random_height());
+        new (&node->storage) Key(key);
+        node->value.store(&value, std::memory_order_relaxed);
+        node->state.store(Inserting, std::memory_order_relaxed);
+      }
+      for (size_t i = 0; i < node->height; i++) {
+        node->next[i].store((uintptr_t)succs[i], std::memory_order_relaxed);
+      }
+      uintptr_t expected = (uintptr_t)succs[0];
+      if (preds[0]->next[0].compare_exchange_strong(expected, (uintptr_t)node)) {
+        break;
+      }
+    }
+
+    link_upper(node, preds, succs);
+    return nullptr;
+  }
+
+  // Links the index levels of a node already linked at level 0. Stops once
+  // the node is being deleted, whoever finishes last retires it
+  void link_upper(Node *node, Node **preds, Node **succs) {
+    for (size_t i = 1; i < node->height; i++) {
+      for (;;) {
+        uintptr_t next = node->next[i].load(std::memory_order_acquire);
+        if (marked(next)) {
+          goto done;
+        }
+        if (unmark(next) != succs[i]
+            && !node->next[i].compare_exchange_strong(next, (uintptr_t)succs[i])) {
+          goto done; // marked meanwhile
+        }
+        uintptr_t expected = (uintptr_t)succs[i];
+        if (preds[i]->next[i].compare_exchange_strong(expected, (uintptr_t)node)) {
+          break;
+        }
+        find(node->key(), preds, succs);
+        if (node->value.load(std::memory_order_acquire) == nullptr) {
+          goto done;
+        }
+      }
+    }
+  done:
+    if (node->state.fetch_and(~unsigned(Inserting)) & Removed) {
+      find(node->key(), preds, succs, node);
+      Epoch::retire(node, destroy);
+    }
+  }
+
+  // Physical removal of a node whose value was nulled by the caller
+  void remove(Node *node) {
+    for (size_t i = node->height; i-- > 0;) {
+      uintptr_t next = node->next[i].load(std::memory_order_acquire);
+      while (!marked(next)
+          && !node->next[i].compare_exchange_weak(next, next | 1)) {
+      }
+    }
+
+    Node *preds[levels], *succs[levels];
+    unsigned state = node->state.fetch_or(Removed);
+    find(node->key(), preds, succs, node);
+    if (!(state & Inserting)) {
+      Epoch::retire(node, destroy);
+    }
+  }
+};
+
+#endif // __CONCURRENT_SKIPLIST_H
@@ -0,0 +1,145 @@
+#ifndef __EPOCH_H
+#define __EPOCH_H
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Epoch based memory reclamation for lock-free structures.
+ *
+ * A thread pins the current epoch for as long as it may hold pointers into
+ * a shared structure. Nodes unlinked from the structure are retired instead
+ * of deleted: a node retired in epoch e is freed once the global epoch has
+ * reached e + 2, that is when every thread that could still see it has
+ * unpinned. The global epoch advances only when all pinned threads are in it.
+ */
+class Epoch {
+public:
+  /**
+   * Keeps the calling thread pinned while any copy of it is alive
+   */
+  class Guard {
+  public:
+    Guard() { Epoch::enter(); }
+    Guard(const Guard &) { Epoch::enter(); }
+    ~Guard() { Epoch::exit(); }
+    Guard &operator=(const Guard &) { return *this; }
+  };
+
+  /**
+   * Frees p with deleter once no pinned thread can reach it. p must be
+   * unlinked already
+   */
+  static void retire(void *p, void (*deleter)(void *)) {
+    Record *record = local();
+    record->retired.push_back(
+        Retired{ global().load(std::memory_order_acquire), p, deleter });
+    if (record->retired.size() >= collect_threshold) {
+      collect(record);
+    }
+  }
+
+private:
+  static const size_t collect_threshold = 64;
+
+  struct Retired {
+    uint64_t epoch;
+    void *p;
+    void (*deleter)(void *);
+  };
+
+  // Per thread state, reused by a new thread once its owner has exited
+  struct Record {
+    std::atomic<uint64_t> epoch; // (epoch << 1) | 1 while pinned, 0 otherwise
+    std::atomic<bool> used;
+    unsigned nesting;
+    std::vector<Retired> retired;
+    Record *next;
+  };
+
+  struct Local {
+    Record *record;
+    Local() : record(claim()) {}
+    ~Local() { record->used.store(false, std::memory_order_release); }
+  };
+
+  static std::atomic<uint64_t> &global() {
+    static std::atomic<uint64_t> epoch(1);
+    return epoch;
+  }
+
+  static std::atomic<Record *> &records() {
+    static std::atomic<Record *> head(nullptr);
+    return head;
+  }
+
+  static Record *claim() {
+    for (Record *r = records().load(); r != nullptr; r = r->next) {
+      bool used = false;
+      if (r->used.compare_exchange_strong(used, true)) {
+        return r;
+      }
+    }
+
+    Record *r = new Record();
+    r->epoch.store(0);
+    r->used.store(true);
+    r->nesting = 0;
+    r->next = records().load();
+    while (!records().compare_exchange_weak(r->next, r)) {
+    }
+    return r;
+  }
+
+  static Record *local() {
+    static thread_local Local l;
+    return l.record;
+  }
+
+  static void enter() {
+    Record *record = local();
+    if (record->nesting++ == 0) {
+      // announce, then check the epoch didn't move on meanwhile
+      uint64_t e;
+      do {
+        e = global().load();
+        record->epoch.store((e << 1) | 1);
+      } while (global().load() != e);
+    }
+  }
+
+  static void exit() {
+    Record *record = local();
+    if (--record->nesting == 0) {
+      record->epoch.store(0, std::memory_order_release);
+    }
+  }
+
+  static void try_advance() {
+    uint64_t e = global().load();
+    for (Record *r = records().load(); r != nullptr; r = r->next) {
+      uint64_t pinned = r->epoch.load();
+      if ((pinned & 1) && (pinned >> 1) != e) {
+        return;
+      }
+    }
+    global().compare_exchange_strong(e, e + 1);
+  }
+
+  static void collect(Record *record) {
+    try_advance();
+    uint64_t e = global().load();
+    std::vector<Retired> &retired = record->retired;
+    size_t kept = 0;
+    for (size_t i = 0; i < retired.size(); i++) {
+      if (retired[i].epoch + 2 <= e) {
+        retired[i].deleter(retired[i].p);
+      } else {
+        retired[kept++] = retired[i];
+      }
+    }
+    retired.resize(kept);
+  }
+};
+
+#endif // __EPOCH_H
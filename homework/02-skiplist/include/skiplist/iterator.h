@@ -7,54 +7,43 @@
 /**
  * Skiplist const iterator
  */
-template <class Key, class Value> class Iterator {
+template <class Key, class Value, bool OWNING = false> class Iterator {
 private:
-  Node<Key, Value> *pCurrent;
+  Node<Key, Value, OWNING> *pCurrent;
 
 public:
-  Iterator(Node<Key, Value> *p) : pCurrent(p) {}
-  virtual ~Iterator() {}
+  Iterator(Node<Key, Value, OWNING> *p) : pCurrent(p) {}
 
-  virtual const Key &key() const {
+  const Key &key() const {
     assert(pCurrent != nullptr);
     return pCurrent->key();
   };
 
-  virtual const Value &value() const {
+  const Value &value() const {
     assert(pCurrent != nullptr);
     return pCurrent->value();
   };
 
-  virtual const Value &operator*() {
+  const Value &operator*() {
     assert(pCurrent != nullptr);
     return pCurrent->value();
   };
 
-  virtual const Value &operator->() {
+  const Value &operator->() {
     assert(pCurrent != nullptr);
     return pCurrent->value();
   };
 
-  virtual bool operator==(const Iterator &it) const {
-    typedef DataNode<Key, Value> *data_ptr_t;
-    assert(dynamic_cast<data_ptr_t>(pCurrent) != nullptr);
-    assert(dynamic_cast<data_ptr_t>(it.pCurrent) != nullptr);
-    return pCurrent == it.pCurrent;
-  };
-
-  virtual bool operator!=(const Iterator &it) const { return !operator==(it); };
+  bool operator==(const Iterator &it) const { return pCurrent == it.pCurrent; };
 
-  virtual Iterator &operator=(const Iterator &it) {
-    pCurrent = it.pCurrent;
-    return *this;
-  };
+  bool operator!=(const Iterator &it) const { return !operator==(it); };
 
-  virtual Iterator &operator++() {
+  Iterator &operator++() {
     pCurrent = &pCurrent->next();
     return *this;
   };
 
-  virtual Iterator operator++(int) {
+  Iterator operator++(int) {
     Iterator it(pCurrent);
     pCurrent = &pCurrent->next();
     return it;
@@ -1,116 +1,157 @@
 #ifndef __NODE_H
 #define __NODE_H
 #include <cassert>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
 
 /**
- * Skiplist Node
+ * Skiplist node: one tower per key that holds the key, the value and the
+ * next pointers of all levels the key is linked at, in one allocation.
+ *
+ * The value is a pointer to caller memory, or with OWNING the value itself,
+ * constructed in place.
+ *
+ * Head and tail sentinels are towers of full height without a key.
+ * There are no virtual functions, so every access inlines.
+ *
+ * Memory comes from the node allocator of the list, see arena.h.
  */
-template <class Key, class Value> class Node {
+template <class Key, class Value, bool OWNING = false> class Node {
+  template <class, class, size_t, class, bool, class> friend class SkipList;
+
+private:
+  typedef typename std::conditional<OWNING,
+      typename std::aligned_storage<sizeof(Value), alignof(Value)>::type,
+      Value *>::type ValueStorage;
+
+  typename std::aligned_storage<sizeof(Key), alignof(Key)>::type keyStorage;
+  ValueStorage valueStorage;
+  size_t height;
+  Node *aNext[1]; // height entries, allocated past the end of the node
+
+  explicit Node(size_t height) : valueStorage(), height(height) {
+    for (size_t i = 0; i < height; i++) {
+      aNext[i] = nullptr;
+    }
+  }
+
+  Value *valuePtr(std::true_type) const {
+    return reinterpret_cast<Value *>(const_cast<ValueStorage *>(&valueStorage));
+  }
+  Value *valuePtr(std::false_type) const { return valueStorage; }
+
+  void destroyValue(std::true_type) { valuePtr(std::true_type())->~Value(); }
+  void destroyValue(std::false_type) {}
+
 public:
-  Node() {}
-  virtual ~Node() {}
+  Node(const Node &) = delete;
+  Node &operator=(const Node &) = delete;
 
   /**
-   * Return key assosiated with the given node
+   * Bytes taken by a tower of the given height
    */
-  virtual const Key &key() const = 0;
+  static size_t size(size_t height) {
+    return sizeof(Node) + (height - 1) * sizeof(Node *);
+  }
 
   /**
-   * Returns value assosiated with the given node
+   * Allocates a sentinel tower
    */
-  virtual Value &value() = 0;
+  template <class Alloc> static Node *create(Alloc &alloc, size_t height) {
+    assert(height > 0);
+    void *mem = alloc.allocate(size(height), alignof(Node));
+    return new (mem) Node(height);
+  }
 
   /**
-   * Returns next node in the sequence
+   * Allocates a tower for the key that refers to value
    */
-  virtual Node &next() const = 0;
-};
-
-/**
- * Skiplist data nodes that holds actual key/value pair
- */
-template <class Key, class Value> class DataNode : public Node<Key, Value> {
-  template <class, class, size_t, class> friend class SkipList;
-
-private:
-  const Key *pKey;
-  Value *pValue;
-  DataNode<Key, Value> *pNext;
-
-public:
-  DataNode(const Key *pKey, Value *pValue)
-      : pKey(pKey), pValue(pValue), pNext(nullptr) {}
-
-  virtual ~DataNode() {}
+  template <class Alloc>
+  static Node *create(Alloc &alloc, size_t height, const Key &key, Value *value) {
+    static_assert(!OWNING, "owning nodes construct their value");
+    Node *node = create(alloc, height);
+    try {
+      new (&node->keyStorage) Key(key);
+    } catch (...) {
+      destroy(alloc, node, false);
+      throw;
+    }
+    node->valueStorage = value;
+    return node;
+  }
 
   /**
-   * Return key assosiated with the given node
+   * Allocates a tower for the key with the value constructed from args
    */
-  virtual const Key &key() const {
-    assert(pKey != nullptr);
-    return *pKey;
+  template <class Alloc, class K, class... Args>
+  static Node *emplace(Alloc &alloc, size_t height, K &&key, Args &&... args) {
+    static_assert(OWNING, "only owning nodes hold their value");
+    Node *node = create(alloc, height);
+    try {
+      new (&node->keyStorage) Key(std::forward<K>(key));
+    } catch (...) {
+      destroy(alloc, node, false);
+      throw;
+    }
+    try {
+      new (&node->valueStorage) Value(std::forward<Args>(args)...);
+    } catch (...) {
+      reinterpret_cast<Key *>(&node->keyStorage)->~Key();
+      destroy(alloc, node, false);
+      throw;
+    }
+    return node;
   }
 
   /**
-   * Returns value assosiated with the given node
+   * Whether destruct does anything for a keyed tower
    */
-  virtual Value &value() {
-    assert(pValue != nullptr);
-    return *pValue;
-  };
+  static const bool trivial = std::is_trivially_destructible<Key>::value &&
+      (!OWNING || std::is_trivially_destructible<Value>::value);
 
   /**
-   * Returns next node in the sequence
+   * Destroys the key and the value of a tower but keeps its memory,
+   * keyed says whether it was created with a key
    */
-  virtual Node<Key, Value> &next() const { return *pNext; };
+  static void destruct(Node *node, bool keyed = true) {
+    if (keyed) {
+      node->destroyValue(std::integral_constant<bool, OWNING>());
+      reinterpret_cast<Key *>(&node->keyStorage)->~Key();
+    }
+    node->~Node();
+  }
 
   /**
-   * Set next pointer
+   * Destroys and frees a tower
    */
-  virtual void next(DataNode<Key, Value> *next) { pNext = next; };
-};
-
-/**
- * Skiplist index nodes that keep references onto data layer
- */
-template <class Key, class Value> class IndexNode : public Node<Key, Value> {
-  template <class, class, size_t, class> friend class SkipList;
-
-private:
-  Node<Key, Value> *pDown;
-  DataNode<Key, Value> *pRoot;
-  IndexNode<Key, Value> *pNext;
-
-public:
-  IndexNode(Node<Key, Value> *down, DataNode<Key, Value> *root)
-      : pDown(down), pRoot(root), pNext(nullptr) {}
-
-  virtual ~IndexNode() {}
+  template <class Alloc>
+  static void destroy(Alloc &alloc, Node *node, bool keyed = true) {
+    size_t bytes = size(node->height);
+    destruct(node, keyed);
+    alloc.deallocate(node, bytes);
+  }
 
   /**
    * Return key assosiated with the given node
    */
-  virtual const Key &key() const {
-    assert(pRoot != nullptr);
-    return pRoot->key();
+  const Key &key() const {
+    return *reinterpret_cast<const Key *>(&keyStorage);
   }
 
   /**
    * Returns value assosiated with the given node
    */
-  virtual Value &value() {
-    assert(pRoot != nullptr);
-    return pRoot->value();
-  };
+  Value &value() const {
+    Value *p = valuePtr(std::integral_constant<bool, OWNING>());
+    assert(p != nullptr);
+    return *p;
+  }
 
   /**
    * Returns next node in the sequence
    */
-  virtual Node<Key, Value> &next() const { return *pNext; };
-
-  /**
-   * Set next pointer
-   */
-  virtual void next(IndexNode<Key, Value> *next) { pNext = next; };
+  Node &next() const { return *aNext[0]; }
 };
 #endif // __NODE_H
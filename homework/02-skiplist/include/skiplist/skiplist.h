@@ -1,5 +1,6 @@
 #ifndef __SKIPLIST_H
 #define __SKIPLIST_H
+#include "arena.h"
 #include "iterator.h"
 #include "node.h"
 #include <algorithm>
@@ -8,36 +9,44 @@
 #include <fstream>
 #include <functional>
 #include <type_traits>
+#include <utility>
 
 /**
  * Skiplist interface
+ *
+ * By default values stay in caller memory, the list keeps pointers to them.
+ * With OWNING (see OwningSkipList) values are kept in the nodes: they are
+ * inserted with Emplace or InsertOrAssign and removed with Erase, Put,
+ * PutIfAbsent and Delete are not available.
+ *
+ * Nodes come from Alloc, by default an arena of the list: inserts rarely
+ * reach the global heap and the list is freed chunk by chunk.
  */
-template <class Key, class Value, size_t MAXHEIGHT, class Less = std::less<Key>>
+template <class Key, class Value, size_t MAXHEIGHT, class Less = std::less<Key>,
+    bool OWNING = false, class Alloc = NodeArena>
 class SkipList {
+public:
+  typedef Iterator<Key, Value, OWNING> ConstIterator;
+
 private:
-  DataNode<Key, Value> *pHead;
-  DataNode<Key, Value> *pTail;
+  typedef Node<Key, Value, OWNING> Tower;
 
-  IndexNode<Key, Value> *pTailIdx;
-  IndexNode<Key, Value> *aHeadIdx[MAXHEIGHT];
+  // data level and MAXHEIGHT index levels
+  static const size_t levels = MAXHEIGHT + 1;
+
+  Alloc alloc;
+  Tower *pHead;
+  Tower *pTail;
 
 public:
   /**
    * Creates new empty skiplist
    */
   SkipList() {
-    static_assert(std::is_copy_constructible<Key>(), "");
-
-    pHead = new DataNode<Key, Value>(nullptr, nullptr);
-    pTail = new DataNode<Key, Value>(nullptr, nullptr);
-    pHead->pNext = pTail;
-
-    Node<Key, Value> *below = pHead;
-    pTailIdx = new IndexNode<Key, Value>(pTail, pTail);
-    for (size_t i = 0; i < MAXHEIGHT; i++) {
-      aHeadIdx[i] = new IndexNode<Key, Value>(below, pHead);
-      aHeadIdx[i]->pNext = pTailIdx;
-      below = aHeadIdx[i];
+    pHead = Tower::create(alloc, levels);
+    pTail = Tower::create(alloc, levels);
+    for (size_t i = 0; i < levels; i++) {
+      pHead->aNext[i] = pTail;
     }
   }
 
@@ -47,20 +56,25 @@ public:
   SkipList(const SkipList &that) = delete;
 
   /**
-   * Destructor
+   * Destructor, the nodes are only walked if they have to be freed one by
+   * one or have destructors to run
    */
-  virtual ~SkipList() {
-    // Idx cleanup
-    for (size_t i = 0; i < MAXHEIGHT; i++) {
-      for (auto pIdx = aHeadIdx[i]; pIdx != pTailIdx; pIdx = delIdx(pIdx)) {
+  ~SkipList() {
+    if (!Alloc::releases_all) {
+      for (Tower *pNode = pHead->aNext[0]; pNode != pTail;) {
+        Tower *pNext = pNode->aNext[0];
+        Tower::destroy(alloc, pNode);
+        pNode = pNext;
+      }
+      Tower::destroy(alloc, pHead, false);
+      Tower::destroy(alloc, pTail, false);
+    } else if (!Tower::trivial) {
+      for (Tower *pNode = pHead->aNext[0]; pNode != pTail;) {
+        Tower *pNext = pNode->aNext[0];
+        Tower::destruct(pNode);
+        pNode = pNext;
       }
     }
-    delIdx(pTailIdx);
-
-    // Data cleanup
-    for (auto pData = pHead; pData != pTail; pData = delData(pData, true)) {
-    }
-    delData(pTail);
   }
 
   /**
@@ -71,15 +85,16 @@ public:
    * @param value to be added
    * @return old value for the given key or nullptr
    */
-  virtual Value *Put(const Key &key, Value &value) {
+  Value *Put(const Key &key, Value &value) {
+    static_assert(!OWNING, "use InsertOrAssign");
     Path pp;
     if (search(key, pp)) {
-      auto data_node = pp.pData->pNext;
-      auto old_value = data_node->pValue;
-      pp.pData->pValue = &value;
+      auto node = pp.aPrev[0]->aNext[0];
+      auto old_value = node->valueStorage;
+      node->valueStorage = &value;
       return old_value;
     }
-    put_new(pp, key, value);
+    link(pp, Tower::create(alloc, random_height(), key, &value));
     return nullptr;
   };
 
@@ -94,13 +109,13 @@ public:
    * @param value to be added
    * @return existing value for the given key or nullptr
    */
-  virtual Value *PutIfAbsent(const Key &key, Value &value) {
+  Value *PutIfAbsent(const Key &key, Value &value) {
+    static_assert(!OWNING, "use Emplace");
     Path pp;
     if (search(key, pp)) {
-      auto data_node = pp.pData->pNext;
-      return data_node->pValue;
+      return pp.aPrev[0]->aNext[0]->valueStorage;
     }
-    put_new(pp, key, value);
+    link(pp, Tower::create(alloc, random_height(), key, &value));
     return nullptr;
   };
 
@@ -111,10 +126,9 @@ public:
    * @param key to find
    * @return value associated with given key or nullptr
    */
-  virtual Value *Get(const Key &key) const {
+  Value *Get(const Key &key) const {
     Path pp;
-    volatile bool found = search(key, pp);
-    return found ? pp.pData->pNext->pValue : nullptr;
+    return search(key, pp) ? &pp.aPrev[0]->aNext[0]->value() : nullptr;
   };
 
   /**
@@ -125,58 +139,105 @@ public:
    * @param key to be added
    * @return value for the removed key or nullptr
    */
-  virtual Value *Delete(const Key &key) {
+  Value *Delete(const Key &key) {
+    static_assert(!OWNING, "use Erase");
     Path pp;
     if (search(key, pp)) {
-      for (int i = 0; i <= pp.match_at; ++i) {
-        pp.aIdx[i]->pNext = delIdx(pp.aIdx[i]->pNext);
-      }
-
-      auto data = pp.pData->pNext;
-      auto old_value = data->pValue;
-      pp.pData->pNext = delData(data);
-
+      auto node = unlink(pp);
+      auto old_value = node->valueStorage;
+      Tower::destroy(alloc, node);
       return old_value;
     }
 
     return nullptr;
   };
 
+  /**
+   * Owning mode: constructs the value for the key from args in place if
+   * there is no association with the key yet, otherwise does nothing
+   *
+   * @param key key to be copied or moved into the node
+   * @param args value constructor arguments
+   * @return the value for the key and whether it was inserted
+   */
+  template <class... Args>
+  std::pair<Value *, bool> Emplace(const Key &key, Args &&... args) {
+    return emplace(key, std::forward<Args>(args)...);
+  }
+
+  template <class... Args>
+  std::pair<Value *, bool> Emplace(Key &&key, Args &&... args) {
+    return emplace(std::move(key), std::forward<Args>(args)...);
+  }
+
+  /**
+   * Owning mode: assigns the value for the key, inserts it if there is no
+   * association with the key yet
+   *
+   * @param key key to be copied or moved into the node
+   * @param value value to be copied or moved
+   * @return the value for the key and whether it was inserted
+   */
+  template <class V>
+  std::pair<Value *, bool> InsertOrAssign(const Key &key, V &&value) {
+    return insert_or_assign(key, std::forward<V>(value));
+  }
+
+  template <class V>
+  std::pair<Value *, bool> InsertOrAssign(Key &&key, V &&value) {
+    return insert_or_assign(std::move(key), std::forward<V>(value));
+  }
+
+  /**
+   * Owning mode: removes the key and destroys its value
+   *
+   * @param key to be removed
+   * @return whether the key was there
+   */
+  bool Erase(const Key &key) {
+    static_assert(OWNING, "use Delete");
+    Path pp;
+    if (search(key, pp)) {
+      Tower::destroy(alloc, unlink(pp));
+      return true;
+    }
+    return false;
+  }
+
   /**
    * Same as Get
    */
-  virtual Value *operator[](const Key &key) const { return Get(key); };
+  Value *operator[](const Key &key) const { return Get(key); };
 
   /**
    * Return iterator onto very first key in the skiplist
    */
-  virtual Iterator<Key, Value> cbegin() const {
-    return Iterator<Key, Value>(pHead->pNext);
+  ConstIterator cbegin() const {
+    return ConstIterator(pHead->aNext[0]);
   };
 
   /**
    * Returns iterator to the first key that is greater or equals to
    * the given key
    */
-  virtual Iterator<Key, Value> cfind(const Key &min) const {
+  ConstIterator cfind(const Key &min) const {
     Path pp;
     search(min, pp);
-    return Iterator<Key, Value>(pp.pData->pNext);
+    return ConstIterator(pp.aPrev[0]->aNext[0]);
   };
 
   /**string
    * Returns iterator on the skiplist tail
    */
-  virtual Iterator<Key, Value> cend() const {
-    return Iterator<Key, Value>(pTail);
+  ConstIterator cend() const {
+    return ConstIterator(pTail);
   };
 
 private:
-  static void gvdump_datanode(std::ofstream &of,
-                              const DataNode<Key, Value> *pData) {
-    of << "\"" << (void *)pData << "_";
-    if (pData->pKey != nullptr) {
-      of << *pData->pKey;
+  void gvdump_node(std::ofstream &of, const Tower *pNode, size_t level) const {
+    of << "\"" << (void *)pNode << "_" << level << "_";
+    if (pNode != pHead && pNode != pTail) {
+      of << pNode->key();
     } else {
       of << "null";
     }
@@ -184,157 +245,118 @@ private:
   }
 
 public:
-  virtual void gvdump(std::string fname) const {
+  void gvdump(std::string fname) const {
     using std::endl;
     std::ofstream of(fname);
     of << "digraph SkipList {" << endl;
-    for (size_t i = 0; i < MAXHEIGHT; ++i) {
-      of << "  // idx layer " << i << endl;
-      for (auto pIdx = aHeadIdx[i]; pIdx != pTailIdx; pIdx = pIdx->pNext) {
-        of << "  \"" << (void *)pIdx << "\"->\"" << (void *)pIdx->pNext << "\""
-           << endl;
-        of << "  \"" << (void *)pIdx << "\"->\"" << (void *)pIdx->pDown << "\""
-           << endl;
-        // of << "  \"" << (void *)pIdx << "\"->\"" << (void *)pIdx->pRoot <<
-        // "\""
-        //   << endl;
+    for (size_t i = levels; i-- > 0;) {
+      of << "  // layer " << i << endl;
+      for (auto pNode = pHead; pNode != pTail; pNode = pNode->aNext[i]) {
+        of << "  ";
+        gvdump_node(of, pNode, i);
+        of << "->";
+        gvdump_node(of, pNode->aNext[i], i);
+        of << endl;
+        if (i > 0) {
+          of << "  ";
+          gvdump_node(of, pNode, i);
+          of << "->";
+          gvdump_node(of, pNode, i - 1);
+          of << endl;
+        }
       }
       of << "  { rank=same; ";
-      for (auto pIdx = aHeadIdx[i]; pIdx != pTailIdx; pIdx = pIdx->pNext) {
-        of << "\"" << (void *)pIdx << "\" ";
+      for (auto pNode = pHead; pNode != pTail; pNode = pNode->aNext[i]) {
+        gvdump_node(of, pNode, i);
+        of << " ";
       }
+      gvdump_node(of, pTail, i);
       of << "  }" << endl << endl;
     }
-
-    of << "  // data layer" << endl;
-    for (auto pData = pHead; pData != pTail; pData = pData->pNext) {
-      of << "  ";
-      gvdump_datanode(of, pData);
-      of << "->";
-      gvdump_datanode(of, pData->pNext);
-      of << endl;
-      of << "  \"" << (void *)pData << "\"->\"" << (void *)pData->pNext << "\""
-         << endl;
-    }
-
-    of << "  { rank=same; ";
-    for (auto pData = pHead; pData != pTail; pData = pData->pNext) {
-      of << "\"" << (void *)pData << "\" ";
-    }
-    of << "\"" << (void *)pTail << "\"  }" << endl;
-
-    of << "  \"pTailIdx_" << (void *)pTailIdx << "\"" << endl;
-    of << "  \"pTail_" << (void *)pTail << "\"" << endl;
     of << "}" << endl;
   };
 
 private:
+  // The last node before the key at every level
   struct Path {
-    IndexNode<Key, Value> *aIdx[MAXHEIGHT];
-    int match_at;
-    DataNode<Key, Value> *pData;
-
-    void reset() {
-      std::fill_n(aIdx, MAXHEIGHT, nullptr);
-      match_at = -1;
-      pData = nullptr;
-    }
+    Tower *aPrev[levels];
   };
 
   bool search(const Key &key, Path &prev_path) const {
-    prev_path.reset();
-
-    // iterate over index nodes
-    bool found = false;
-    const Key *curKey = nullptr;
-    IndexNode<Key, Value> *prevIdx = nullptr;
-    IndexNode<Key, Value> *curIdx = aHeadIdx[MAXHEIGHT - 1];
-
-    for (int i = MAXHEIGHT - 1; i >= 0;) {
-      // move forward
-      do {
-        prevIdx = curIdx;
-        curIdx = curIdx->pNext;
-        if (curIdx == pTailIdx) {
-          break;
-        }
-        curKey = curIdx->pRoot->pKey;
-      } while (Less()(*curKey, key));
-
-      // if not found yet, check for exact match
-      if (!found && curIdx != pTailIdx && !Less()(key, *curKey)) {
-        prev_path.match_at = i;
-        found = true;
-      }
-
-      // move down
-      prev_path.aIdx[i--] = prevIdx;
-      if (i >= 0) {
-        curIdx = dynamic_cast<IndexNode<Key, Value> *>(prevIdx->pDown);
-        assert(curIdx != nullptr);
+    Tower *prev = pHead;
+    for (size_t i = levels; i-- > 0;) {
+      Tower *cur = prev->aNext[i];
+      while (cur != pTail && Less()(cur->key(), key)) {
+        prev = cur;
+        cur = cur->aNext[i];
       }
+      prev_path.aPrev[i] = prev;
     }
 
-    // iterate over data nodes
-    DataNode<Key, Value> *prev = nullptr;
-    DataNode<Key, Value> *cur =
-        dynamic_cast<DataNode<Key, Value> *>(prevIdx->pDown);
-    assert(cur != nullptr);
-    assert(cur == prevIdx->pRoot);
-
-    do {
-      prev = cur;
-      cur = cur->pNext;
-      if (cur == pTail) {
-        break;
-      }
-      curKey = cur->pKey;
-    } while (Less()(*curKey, key));
-
-    prev_path.pData = prev;
-    return found || (cur != pTail && !Less()(key, *curKey));
+    Tower *cur = prev->aNext[0];
+    return cur != pTail && !Less()(key, cur->key());
   }
 
-  void put_new(const Path &prev_path, const Key &key, Value &value) {
-    assert(prev_path.match_at == -1);
-
-    auto pData = new DataNode<Key, Value>(new Key(key), &value);
-
-    pData->pNext = prev_path.pData->pNext;
-    prev_path.pData->pNext = pData;
+  template <class K, class... Args>
+  std::pair<Value *, bool> emplace(K &&key, Args &&... args) {
+    static_assert(OWNING, "use PutIfAbsent");
+    Path pp;
+    if (search(key, pp)) {
+      return std::make_pair(&pp.aPrev[0]->aNext[0]->value(), false);
+    }
+    Tower *pNode = Tower::emplace(alloc, random_height(), std::forward<K>(key),
+        std::forward<Args>(args)...);
+    link(pp, pNode);
+    return std::make_pair(&pNode->value(), true);
+  }
 
-    Node<Key, Value> *below = pData;
-    for (size_t i = 0; i < MAXHEIGHT && flip(); ++i) {
-      auto pIdx = new IndexNode<Key, Value>(below, pData);
-      pIdx->pNext = prev_path.aIdx[i]->pNext;
-      prev_path.aIdx[i]->pNext = pIdx;
-      below = pIdx;
+  template <class K, class V>
+  std::pair<Value *, bool> insert_or_assign(K &&key, V &&value) {
+    static_assert(OWNING, "use Put");
+    Path pp;
+    if (search(key, pp)) {
+      Value &existing = pp.aPrev[0]->aNext[0]->value();
+      existing = std::forward<V>(value);
+      return std::make_pair(&existing, false);
     }
+    Tower *pNode = Tower::emplace(alloc, random_height(), std::forward<K>(key),
+        std::forward<V>(value));
+    link(pp, pNode);
+    return std::make_pair(&pNode->value(), true);
   }
 
-  bool flip() const { return rand() & 1; }
+  size_t random_height() const {
+    size_t height = 1;
+    while (height < levels && flip()) {
+      ++height;
+    }
+    return height;
+  }
 
-  IndexNode<Key, Value> *delIdx(IndexNode<Key, Value> *pIdx) const {
-    IndexNode<Key, Value> *pNextIdx = pIdx->pNext;
-    pIdx->pDown = nullptr;
-    pIdx->pRoot = nullptr;
-    pIdx->pNext = nullptr;
-    delete pIdx;
+  void link(const Path &prev_path, Tower *pNode) {
+    for (size_t i = 0; i < pNode->height; ++i) {
+      pNode->aNext[i] = prev_path.aPrev[i]->aNext[i];
+      prev_path.aPrev[i]->aNext[i] = pNode;
+    }
+  }
 
-    return pNextIdx;
+  // Unlinks the node found by search
+  Tower *unlink(const Path &prev_path) {
+    Tower *pNode = prev_path.aPrev[0]->aNext[0];
+    for (size_t i = 0; i < pNode->height; ++i) {
+      prev_path.aPrev[i]->aNext[i] = pNode->aNext[i];
+    }
+    return pNode;
   }
 
-  DataNode<Key, Value> *delData(DataNode<Key, Value> *pData,
-                                bool delete_Value = false) const {
-    DataNode<Key, Value> *pNextData = pData->pNext;
-    delete pData->pKey;
+  bool flip() const { return rand() & 1; }
+};
 
-    pData->pKey = nullptr;
-    pData->pValue = nullptr;
-    pData->pNext = nullptr;
-    delete pData;
+/**
+ * SkipList that keeps keys and values in its nodes
+ */
+template <class Key, class Value, size_t MAXHEIGHT, class Less = std::less<Key>,
+    class Alloc = NodeArena>
+using OwningSkipList = SkipList<Key, Value, MAXHEIGHT, Less, true, Alloc>;
 
-    return pNextData;
-  }
-};
 #endif // __SKIPLIST_H
@@ -0,0 +1,172 @@
+#include "gtest/gtest.h"
+#include <atomic>
+#include <map>
+#include <random>
+#include <skiplist/concurrent_skiplist.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+TEST(ConcurrentSkipListTest, Empty) {
+  ConcurrentSkipList<int, string, 8> sk;
+  ASSERT_EQ(nullptr, sk.Get(100));
+  ASSERT_EQ(nullptr, sk.Delete(100));
+  ASSERT_TRUE(sk.cend() == sk.cbegin()) << "Begin iterator fails";
+  ASSERT_TRUE(sk.cend() == sk.cfind(10)) << "Find iterator fails";
+}
+
+TEST(ConcurrentSkipListTest, PutGetDelete) {
+  ConcurrentSkipList<int, string, 8> sk;
+  string a("a"), b("b"), c("c");
+
+  ASSERT_EQ(nullptr, sk.Put(10, a));
+  ASSERT_EQ(&a, sk.Get(10));
+  ASSERT_EQ(&a, sk.Put(10, b)) << "Put returns the old value";
+  ASSERT_EQ(&b, sk[10]);
+  ASSERT_EQ(&b, sk.PutIfAbsent(10, c)) << "PutIfAbsent keeps the value";
+  ASSERT_EQ(&b, sk.Get(10));
+  ASSERT_EQ(nullptr, sk.PutIfAbsent(5, c));
+
+  ASSERT_EQ(&b, sk.Delete(10));
+  ASSERT_EQ(nullptr, sk.Get(10));
+  ASSERT_EQ(nullptr, sk.Delete(10));
+  ASSERT_EQ(nullptr, sk.Put(10, a)) << "Deleted key may be put again";
+  ASSERT_EQ(&a, sk.Get(10));
+}
+
+TEST(ConcurrentSkipListTest, Iterate) {
+  ConcurrentSkipList<int, int, 8> sk;
+  vector<int> values(100);
+  for (int i = 99; i >= 0; i--) {
+    values[i] = i * 10;
+    sk.Put(i * 2, values[i]);
+  }
+  for (int i = 0; i < 100; i += 3) {
+    sk.Delete(i * 2);
+  }
+
+  int expected = 1;
+  for (auto it = sk.cbegin(); it != sk.cend(); ++it, ++expected) {
+    if (expected % 3 == 0) {
+      ++expected;
+    }
+    ASSERT_EQ(expected * 2, it.key());
+    ASSERT_EQ(expected * 10, *it);
+  }
+  ASSERT_EQ(99, expected);
+
+  auto it = sk.cfind(7);
+  ASSERT_EQ(8, it.key());
+  it = sk.cfind(12); // deleted, the next one
+  ASSERT_EQ(14, it.key());
+}
+
+// Threads work on their own keys and share a hot range: the own keys must be
+// exactly as the thread left them, each shared key has a value of someone
+TEST(ConcurrentSkipListTest, Stress) {
+  const int threads = 8, own = 2000, shared = 64, rounds = 20000;
+  ConcurrentSkipList<int, int, 12> sk;
+  vector<vector<int>> values(threads, vector<int>(own + shared));
+
+  vector<thread> workers;
+  vector<map<int, int *>> expected(threads);
+  for (int t = 0; t < threads; t++) {
+    workers.emplace_back([&, t]() {
+      mt19937 rnd(t);
+      for (int i = 0; i < own + shared; i++) {
+        values[t][i] = t * 1000000 + i;
+      }
+      for (int r = 0; r < rounds; r++) {
+        int i = rnd() % (own + shared);
+        int key = i < own ? (t + 1) * 100000 + i : i - own;
+        int op = rnd() % 4;
+        if (op == 0) {
+          int *old = sk.Put(key, values[t][i]);
+          if (i < own) {
+            ASSERT_EQ(expected[t][key], old);
+            expected[t][key] = &values[t][i];
+          }
+        } else if (op == 1) {
+          int *old = sk.Delete(key);
+          if (i < own) {
+            ASSERT_EQ(expected[t][key], old);
+            expected[t].erase(key);
+          }
+        } else if (op == 2) {
+          int *old = sk.PutIfAbsent(key, values[t][i]);
+          if (i < own) {
+            ASSERT_EQ(expected[t][key], old);
+            if (old == nullptr) {
+              expected[t][key] = &values[t][i];
+            }
+          }
+        } else {
+          int *found = sk.Get(key);
+          if (i < own) {
+            ASSERT_EQ(expected[t][key], found);
+          } else if (found != nullptr) {
+            ASSERT_EQ(key + own, *found % 1000000);
+          }
+        }
+        if (i < own && expected[t][key] == nullptr) {
+          expected[t].erase(key);
+        }
+      }
+    });
+  }
+  for (auto& w : workers) {
+    w.join();
+  }
+
+  map<int, int *> all;
+  for (int t = 0; t < threads; t++) {
+    all.insert(expected[t].begin(), expected[t].end());
+  }
+  int prev = -1;
+  size_t own_found = 0;
+  for (auto it = sk.cbegin(); it != sk.cend(); ++it) {
+    ASSERT_LT(prev, it.key()) << "Keys are sorted and unique";
+    prev = it.key();
+    if (it.key() >= 100000) {
+      ASSERT_EQ(all[it.key()], &*it);
+      own_found++;
+    }
+  }
+  ASSERT_EQ(all.size(), own_found);
+}
+
+// Exactly one of the racing PutIfAbsent calls inserts, exactly one of the
+// racing Delete calls gets the value
+TEST(ConcurrentSkipListTest, Races) {
+  const int threads = 4, keys = 2000;
+  ConcurrentSkipList<int, int, 8> sk;
+  vector<int> values(threads);
+  atomic<int> inserted(0), deleted(0), arrived(0);
+
+  vector<thread> workers;
+  for (int t = 0; t < threads; t++) {
+    workers.emplace_back([&, t]() {
+      for (int k = 0; k < keys; k++) {
+        if (sk.PutIfAbsent(k, values[t]) == nullptr) {
+          inserted++;
+        }
+      }
+      for (arrived++; arrived < threads;) {
+        this_thread::yield();
+      }
+      for (int k = 0; k < keys; k++) {
+        if (sk.Delete(k) != nullptr) {
+          deleted++;
+        }
+      }
+    });
+  }
+  for (auto& w : workers) {
+    w.join();
+  }
+  ASSERT_EQ(keys, inserted.load());
+  ASSERT_EQ(keys, deleted.load());
+  ASSERT_TRUE(sk.cbegin() == sk.cend());
+}
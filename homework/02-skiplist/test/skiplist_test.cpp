@@ -1,5 +1,7 @@
 #include "gtest/gtest.h"
+#include <memory>
 #include <string>
+#include <vector>
 #include <skiplist/skiplist.h>
 
 using namespace std;
@@ -33,3 +35,135 @@ TEST(SkipListTest, SimplePut) {
   ASSERT_EQ(string("test"), it.value()) << "Iterator value is correct";
   ASSERT_EQ(string("test"), *it)        << "Iterator value is correct";
 }
+
+TEST(SkipListTest, PutReplaceDelete) {
+  SkipList<int, string, 8> sk;
+  string a("a"), b("b"), c("c");
+
+  ASSERT_EQ(nullptr, sk.Put(10, a));
+  ASSERT_EQ(nullptr, sk.Put(5, c));
+  ASSERT_EQ(&a, sk.Put(10, b))         << "Put returns the old value";
+  ASSERT_EQ(&b, sk.Get(10))            << "Put replaces the value";
+  ASSERT_EQ(&b, sk.PutIfAbsent(10, c)) << "PutIfAbsent keeps the value";
+  ASSERT_EQ(&c, sk.Get(5));
+
+  ASSERT_EQ(&b, sk.Delete(10));
+  ASSERT_EQ(nullptr, sk.Get(10));
+  ASSERT_EQ(nullptr, sk.Delete(10));
+  ASSERT_EQ(&c, sk.Get(5));
+}
+
+TEST(SkipListTest, Iterate) {
+  SkipList<int, int, 8> sk;
+  vector<int> values(1000);
+  for (int i = 0; i < 1000; i++) {
+    values[i] = i;
+  }
+  for (int i = 0; i < 1000; i++) {
+    int key = (i * 7919) % 1000; // every key once, out of order
+    sk.Put(key, values[key]);
+  }
+  for (int i = 0; i < 1000; i += 2) {
+    sk.Delete(i);
+  }
+
+  int expected = 1;
+  for (Iterator<int, int> it = sk.cbegin(); it != sk.cend(); ++it, expected += 2) {
+    ASSERT_EQ(expected, it.key());
+    ASSERT_EQ(expected, *it);
+  }
+  ASSERT_EQ(1001, expected);
+
+  ASSERT_EQ(11, sk.cfind(10).key());
+  ASSERT_EQ(11, sk.cfind(11).key());
+  ASSERT_EQ(sk.cend(), sk.cfind(1000));
+}
+
+// Counts live instances, so the owning list is checked for leaks
+struct Counted {
+  static int alive;
+  int v;
+  Counted(int v) : v(v) { alive++; }
+  Counted(const Counted &that) : v(that.v) { alive++; }
+  Counted &operator=(const Counted &that) = default;
+  ~Counted() { alive--; }
+};
+int Counted::alive = 0;
+
+TEST(SkipListTest, OwningEmplace) {
+  {
+    OwningSkipList<string, Counted, 8> sk;
+    auto r = sk.Emplace(string("b"), 2);
+    ASSERT_TRUE(r.second);
+    ASSERT_EQ(2, r.first->v);
+    ASSERT_EQ(r.first, sk.Get("b"));
+
+    r = sk.Emplace("b", 3);
+    ASSERT_FALSE(r.second)   << "Emplace keeps the value";
+    ASSERT_EQ(2, r.first->v);
+
+    r = sk.InsertOrAssign("b", Counted(4));
+    ASSERT_FALSE(r.second);
+    ASSERT_EQ(4, sk.Get("b")->v) << "InsertOrAssign replaces the value";
+
+    string key("a");
+    r = sk.InsertOrAssign(move(key), Counted(1));
+    ASSERT_TRUE(r.second);
+    sk.Emplace("c", 5);
+    ASSERT_EQ(3, Counted::alive);
+
+    ASSERT_TRUE(sk.Erase("c"));
+    ASSERT_FALSE(sk.Erase("c"));
+    ASSERT_EQ(nullptr, sk.Get("c"));
+    ASSERT_EQ(2, Counted::alive);
+
+    OwningSkipList<string, Counted, 8>::ConstIterator it = sk.cbegin();
+    ASSERT_EQ("a", it.key());
+    ASSERT_EQ(1, it.value().v);
+    ++it;
+    ASSERT_EQ("b", it.key());
+    ASSERT_EQ(4, (*it).v);
+    ++it;
+    ASSERT_EQ(sk.cend(), it);
+  }
+  ASSERT_EQ(0, Counted::alive) << "Values are destroyed with the list";
+}
+
+TEST(SkipListTest, OwningMoveOnly) {
+  OwningSkipList<int, unique_ptr<int>, 8> sk;
+  for (int i = 0; i < 100; i++) {
+    sk.Emplace(i, new int(i * i));
+  }
+  unique_ptr<int> p(new int(-1));
+  sk.InsertOrAssign(5, move(p));
+  ASSERT_EQ(-1, **sk.Get(5));
+  ASSERT_EQ(81, **sk.Get(9));
+  ASSERT_TRUE(sk.Erase(9));
+  ASSERT_EQ(nullptr, sk.Get(9));
+}
+
+TEST(SkipListTest, NodeArena) {
+  NodeArena arena;
+  char *a = static_cast<char *>(arena.allocate(24, 8));
+  char *b = static_cast<char *>(arena.allocate(24, 8));
+  ASSERT_EQ(a + 24, b) << "Nodes are cut one after another";
+  arena.deallocate(a, 24);
+  ASSERT_NE(a, arena.allocate(32, 8)) << "Only nodes of the same size reuse";
+  ASSERT_EQ(a, arena.allocate(24, 8)) << "Freed node is reused";
+  void *big = arena.allocate(NodeArena::max_chunk * 2, 8);
+  ASSERT_NE(nullptr, big);
+  ASSERT_EQ(0u, (size_t)arena.allocate(16, 16) % 16);
+}
+
+TEST(SkipListTest, HeapNodeAllocator) {
+  {
+    OwningSkipList<int, Counted, 8, less<int>, HeapNodeAllocator> sk;
+    for (int i = 0; i < 100; i++) {
+      sk.Emplace(i, i);
+    }
+    ASSERT_TRUE(sk.Erase(50));
+    ASSERT_EQ(99, Counted::alive);
+    ASSERT_EQ(49, sk.Get(49)->v);
+  }
+  ASSERT_EQ(0, Counted::alive);
+}